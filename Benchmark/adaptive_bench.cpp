@@ -0,0 +1,122 @@
+// Online load estimation against the static cost model on a workload the static
+// model gets wrong. A thread outside the pool submits rounds of two functions:
+// a few heavy calls the model priced as cheap and many light calls it priced as
+// expensive. With static costs the placement policy reads the load backwards and
+// stacks light calls behind heavy ones it thinks are nothing; with
+// OBFUSCATION_ADAPTIVE_LOAD the loads soon reflect the measured costs, and
+// OBFUSCATION_PLACEMENT=eft also picks the worker expected to finish first.
+// Reports wall time per round and the mean and p99 latency, from submission to
+// completion, of the light calls.
+
+#include "../Runtime/obfuscation_runtime.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+namespace
+{
+    constexpr int HEAVY = 0;
+    constexpr int LIGHT = 1;
+    // What the static model believes: heavy calls are trivial, light ones are not.
+    constexpr int HEAVY_STATIC_COST = 1;
+    constexpr int LIGHT_STATIC_COST = 1000;
+
+    int g_heavyWork = 200000;
+    int g_lightWork = 2000;
+
+    struct SkewConfig : RuntimeDefaults
+    {
+        static constexpr int FUNCTIONS = 2;
+    };
+
+    using Runtime = ObfuscationRuntime<SkewConfig>;
+    using Clock = chrono::steady_clock;
+
+    struct SkewValues
+    {
+        int work;
+        Clock::time_point submitted;
+        double *latency;  // where the call stores its own latency in microseconds, if anywhere
+        CallResult *result;
+    };
+
+    void call(int thread_idx, SkewValues task_params)
+    {
+        (void)thread_idx;
+        volatile int sink = 0;
+        for (int i = 0; i < task_params.work; i++)
+            sink = sink * 31 + i;
+        if (task_params.latency)
+            *task_params.latency = chrono::duration<double, micro>(Clock::now() - task_params.submitted).count();
+        task_params.result->finish();
+    }
+
+    void measure(const char *placement, const char *adaptive, const char *eft, int heavy, int light, int rounds)
+    {
+        setenv("OBFUSCATION_ADAPTIVE_LOAD", adaptive, 1);
+        setenv("OBFUSCATION_PLACEMENT", eft, 1);
+        Runtime::initialize();
+        vector<double> latencies((size_t)rounds * light);
+        auto start = Clock::now();
+        for (int r = 0; r < rounds; r++)
+        {
+            vector<CallResult> results(heavy + light);
+            // Heavy calls are spread through the round, so light ones arrive on both sides of them.
+            int stride = light / max(heavy, 1) + 1;
+            for (int i = 0, h = 0, l = 0; i < heavy + light; i++)
+            {
+                bool isHeavy = h < heavy && (i % stride == 0 || l == light);
+                SkewValues args{isHeavy ? g_heavyWork : g_lightWork, Clock::now(),
+                                isHeavy ? nullptr : &latencies[(size_t)r * light + l], &results[i]};
+                if (isHeavy)
+                {
+                    Runtime::submitTask(Runtime::makeTask<call>(HEAVY, HEAVY_STATIC_COST, args));
+                    h++;
+                }
+                else
+                {
+                    Runtime::submitTask(Runtime::makeTask<call>(LIGHT, LIGHT_STATIC_COST, args));
+                    l++;
+                }
+            }
+            for (CallResult &result : results)
+            {
+                while (!result.isDone())
+                    this_thread::yield();
+            }
+        }
+        double seconds = chrono::duration<double>(Clock::now() - start).count();
+        int workers = Runtime::workerCount();
+        Runtime::exit();
+
+        double total = 0;
+        for (double latency : latencies)
+            total += latency;
+        size_t p99 = latencies.size() * 99 / 100;
+        nth_element(latencies.begin(), latencies.begin() + p99, latencies.end());
+        printf("%-16s %8d %10.3f %14.1f %14.1f\n", placement, workers, seconds * 1e3 / rounds, total / latencies.size(),
+               latencies[p99]);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int workers = argc > 1 ? atoi(argv[1]) : (int)max(2u, thread::hardware_concurrency());
+    int heavy = argc > 2 ? max(atoi(argv[2]), 1) : workers;
+    int light = argc > 3 ? max(atoi(argv[3]), 1) : 32 * workers;
+    int rounds = argc > 4 ? atoi(argv[4]) : 200;
+    setenv("OBFUSCATION_THREADS", to_string(workers).c_str(), 1);
+    // Every call is dispatched, however small, so placement alone differs.
+    setenv("OBFUSCATION_INLINE_COST", "0", 1);
+    setenv("OBFUSCATION_INLINE_DEPTH", "0", 1);
+
+    printf("%d heavy calls (%d iterations, static cost %d) and %d light calls (%d iterations, static cost %d), %d rounds\n",
+           heavy, g_heavyWork, HEAVY_STATIC_COST, light, g_lightWork, LIGHT_STATIC_COST, rounds);
+    printf("%-16s %8s %10s %14s %14s\n", "placement", "workers", "ms/round", "light mean us", "light p99 us");
+    measure("static", "0", "policy", heavy, light, rounds);
+    measure("adaptive", "1", "policy", heavy, light, rounds);
+    measure("adaptive+eft", "1", "eft", heavy, light, rounds);
+    return 0;
+}
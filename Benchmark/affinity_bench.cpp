@@ -0,0 +1,206 @@
+// Call-graph affinity against pure load balancing. The program has a number of
+// modules, each a root function that splits the module's own array into chunks
+// and dispatches a leaf call per chunk, then waits for their results; nothing
+// else touches the array. A thread outside the pool submits the roots of every
+// module round after round. Without affinity, roots land where the policy puts
+// them and thieves take leaves at random, so each module's array wanders
+// between cores. With Config::AFFINITY_GROUPS set to the module count and each
+// module's functions in a group of their own (what Estimation's
+// cluster_call_graph produces for such a call graph), a module's tasks stay on
+// its group of workers. Reports wall time per round and LLC and L1D misses per
+// leaf call from perf_event_open (`n/a` where perf events are not permitted).
+
+#include "../Runtime/obfuscation_runtime.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+    // One hardware counter covering this thread and every thread it creates
+    // while the counter is open. Reads as -1 where perf events are unavailable.
+    class PerfCounter
+    {
+    public:
+        PerfCounter(uint32_t type, uint64_t config) : fd(-1)
+        {
+#ifdef __linux__
+            perf_event_attr attr{};
+            attr.size = sizeof(attr);
+            attr.type = type;
+            attr.config = config;
+            attr.disabled = 1;
+            attr.inherit = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+            if (fd >= 0)
+            {
+                ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+#else
+            (void)type;
+            (void)config;
+#endif
+        }
+
+        ~PerfCounter()
+        {
+#ifdef __linux__
+            if (fd >= 0)
+                close(fd);
+#endif
+        }
+
+        long long read()
+        {
+#ifdef __linux__
+            long long value = 0;
+            if (fd >= 0 && ::read(fd, &value, sizeof(value)) == (ssize_t)sizeof(value))
+                return value;
+#endif
+            return -1;
+        }
+
+    private:
+        int fd;
+    };
+
+    constexpr int MAX_MODULES = 16;
+    constexpr int CHUNKS = 8;
+
+    int g_modules = 4;
+    size_t g_moduleWords = 0;
+    vector<vector<unsigned>> g_data;
+
+    // funcId 2m is module m's root, 2m + 1 its leaf.
+    template <int Groups>
+    struct AffinityConfig : RuntimeDefaults
+    {
+        static constexpr int FUNCTIONS = 2 * MAX_MODULES;
+        static constexpr int AFFINITY_GROUPS = Groups;
+        static int affinityGroup(int funcId) { return funcId / 2; }
+    };
+
+    struct LeafValues
+    {
+        int module;
+        int chunk;
+        CallResult *result;
+    };
+
+    struct RootValues
+    {
+        int module;
+        CallResult *result;
+    };
+
+    void leaf(int thread_idx, LeafValues task_params)
+    {
+        (void)thread_idx;
+        size_t size = g_moduleWords / CHUNKS;
+        unsigned *words = g_data[task_params.module].data() + task_params.chunk * size;
+        unsigned sum = 0;
+        for (size_t i = 0; i < size; i++)
+        {
+            words[i] = words[i] * 3u + 1u;
+            sum += words[i];
+        }
+        task_params.result->return_var = (int)(sum & 0xffff);
+        task_params.result->finish();
+    }
+
+    // Dispatches every chunk before it joins the first, as deferred joins do.
+    template <typename Runtime>
+    void root(int thread_idx, RootValues task_params)
+    {
+        CallResult results[CHUNKS];
+        for (int c = 0; c < CHUNKS; c++)
+        {
+            LeafValues args{task_params.module, c, &results[c]};
+            Runtime::submitTask(Runtime::template makeTask<leaf>(2 * task_params.module + 1, (int)(g_moduleWords / CHUNKS), args));
+        }
+        int sum = 0;
+        for (int c = 0; c < CHUNKS; c++)
+        {
+            while (!results[c].isDone())
+                Runtime::execute(thread_idx);
+            sum += results[c].return_var;
+        }
+        task_params.result->return_var = sum;
+        task_params.result->finish();
+    }
+
+    template <typename Config>
+    void measure(const char *placement, int rounds)
+    {
+        using Runtime = ObfuscationRuntime<Config>;
+#ifdef __linux__
+        PerfCounter l1d(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+        PerfCounter llc(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+#else
+        PerfCounter l1d(0, 0), llc(0, 0);
+#endif
+        Runtime::initialize();
+        auto start = chrono::steady_clock::now();
+        for (int r = 0; r < rounds; r++)
+        {
+            CallResult results[MAX_MODULES];
+            for (int m = 0; m < g_modules; m++)
+                Runtime::submitTask(Runtime::template makeTask<root<Runtime>>(2 * m, (int)g_moduleWords, RootValues{m, &results[m]}));
+            for (int m = 0; m < g_modules; m++)
+            {
+                while (!results[m].isDone())
+                    this_thread::yield();
+            }
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        long long l1dMisses = l1d.read(), llcMisses = llc.read();
+        int workers = Runtime::workerCount();
+        Runtime::exit();
+
+        double leaves = (double)rounds * g_modules * CHUNKS;
+        char l1dText[32], llcText[32];
+        if (l1dMisses >= 0)
+            snprintf(l1dText, sizeof(l1dText), "%.1f", l1dMisses / leaves);
+        else
+            snprintf(l1dText, sizeof(l1dText), "n/a");
+        if (llcMisses >= 0)
+            snprintf(llcText, sizeof(llcText), "%.1f", llcMisses / leaves);
+        else
+            snprintf(llcText, sizeof(llcText), "n/a");
+        printf("%-14s %8d %10.3f %14s %14s\n", placement, workers, seconds * 1e3 / rounds, llcText, l1dText);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int workers = argc > 1 ? atoi(argv[1]) : (int)max(2u, thread::hardware_concurrency());
+    // One module per worker by default, so every worker group has a module of its own.
+    g_modules = min(max(argc > 2 ? atoi(argv[2]) : workers, 1), MAX_MODULES);
+    int kilobytes = argc > 3 ? atoi(argv[3]) : 512;
+    int rounds = argc > 4 ? atoi(argv[4]) : 400;
+    setenv("OBFUSCATION_THREADS", to_string(workers).c_str(), 1);
+    // Every leaf is dispatched, however small, so placement alone differs.
+    setenv("OBFUSCATION_INLINE_COST", "0", 1);
+    setenv("OBFUSCATION_INLINE_DEPTH", "0", 1);
+
+    g_moduleWords = (size_t)kilobytes * 1024 / sizeof(unsigned) / CHUNKS * CHUNKS;
+    g_data.assign(g_modules, vector<unsigned>(g_moduleWords, 1u));
+
+    printf("%d modules of %d KB, %d chunks each, %d rounds\n", g_modules, kilobytes, CHUNKS, rounds);
+    printf("%-14s %8s %10s %14s %14s\n", "placement", "workers", "ms/round", "LLC miss/leaf", "L1D miss/leaf");
+    measure<AffinityConfig<0>>("load-balanced", rounds);
+    measure<AffinityConfig<MAX_MODULES>>("affinity", rounds);
+    return 0;
+}
@@ -0,0 +1,268 @@
+// Compares the two ways a caller can wait for a non-void callee: spin-waiting
+// while helping with other tasks on the same stack (the default runtime), and
+// suspending as a coroutine until the callee resumes it (USE_COROUTINES).
+// Reports wall time, process CPU time and the deepest worker stack seen, for a
+// deep call chain and for a wide, shallow call tree.
+
+#include "../Runtime/obfuscation_runtime.hpp"
+
+#include <chrono>
+#include <coroutine>
+#include <cstdio>
+#include <cstdlib>
+#include <sys/resource.h>
+
+namespace
+{
+    struct Job
+    {
+        void (*run)(void *arg, int worker);
+        void *arg;
+    };
+
+    int g_workers = 4;
+    int g_work = 200;
+    vector<WorkStealingDeque<Job>> *g_deques;
+    atomic<bool> g_stop(false);
+    atomic<long> g_peakStack(0);
+    thread_local char *t_stackBase = nullptr;
+    thread_local unsigned int t_seed = 0;
+
+    [[gnu::noinline]] long leafWork(int depth)
+    {
+        char probe;
+        long used = t_stackBase - &probe;
+        long peak = g_peakStack.load(memory_order_relaxed);
+        while (used > peak && !g_peakStack.compare_exchange_weak(peak, used))
+            ;
+
+        volatile long sink = depth;
+        for (int i = 0; i < g_work; i++)
+            sink = sink * 31 + i;
+        return sink & 1;
+    }
+
+    bool runOne(int worker)
+    {
+        Job job;
+        bool found = (*g_deques)[worker].pop(job);
+        for (int i = 0; !found && i < g_workers; i++)
+        {
+            t_seed = t_seed * 1103515245u + 12345u;
+            int victim = (t_seed >> 8) % g_workers;
+            found = victim != worker && (*g_deques)[victim].steal(job);
+        }
+        if (found)
+            job.run(job.arg, worker);
+        return found;
+    }
+
+    void workerLoop(int worker, atomic<int> *remaining)
+    {
+        char base;
+        t_stackBase = &base;
+        t_seed = 2463534242u ^ (unsigned int)(worker + 1);
+        while (!g_stop.load() && remaining->load() > 0)
+        {
+            if (!runOne(worker))
+                this_thread::sleep_for(chrono::microseconds(50));
+        }
+    }
+
+    // Spin-wait model: the caller helps run tasks until its callee's done flag flips.
+    struct SpinCall
+    {
+        int depth;
+        int fanout;
+        long result;
+        atomic<bool> done;
+        atomic<int> *remaining;
+    };
+
+    void runSpin(void *arg, int worker)
+    {
+        SpinCall *call = static_cast<SpinCall *>(arg);
+        long result = leafWork(call->depth);
+        if (call->depth > 0)
+        {
+            for (int i = 0; i < call->fanout; i++)
+            {
+                SpinCall child{call->depth - 1, call->fanout, 0, {false}, nullptr};
+                (*g_deques)[worker].push(Job{runSpin, &child});
+                while (!child.done.load(memory_order_acquire))
+                    runOne(worker);
+                result += child.result;
+            }
+        }
+        call->result = result;
+        if (call->remaining)
+            (*call->remaining)--;
+        call->done.store(true, memory_order_release);
+    }
+
+    // Coroutine model: the caller suspends and the callee resumes it when done.
+    struct CoCall
+    {
+        struct promise_type
+        {
+            coroutine_handle<> continuation;
+            long result = 0;
+            bool detached = false;
+
+            struct FinalAwaiter
+            {
+                bool await_ready() noexcept { return false; }
+
+                coroutine_handle<> await_suspend(coroutine_handle<promise_type> self) noexcept
+                {
+                    coroutine_handle<> next = self.promise().continuation;
+                    if (self.promise().detached)
+                        self.destroy();
+                    return next ? next : noop_coroutine();
+                }
+
+                void await_resume() noexcept {}
+            };
+
+            CoCall get_return_object() { return CoCall{coroutine_handle<promise_type>::from_promise(*this)}; }
+            suspend_always initial_suspend() noexcept { return {}; }
+            FinalAwaiter final_suspend() noexcept { return {}; }
+            void return_value(long value) { result = value; }
+            void unhandled_exception() { terminate(); }
+        };
+
+        coroutine_handle<promise_type> handle;
+    };
+
+    void resumeJob(void *arg, int)
+    {
+        coroutine_handle<>::from_address(arg).resume();
+    }
+
+    struct SpawnAwaiter
+    {
+        CoCall child;
+
+        bool await_ready() noexcept { return false; }
+
+        void await_suspend(coroutine_handle<> self)
+        {
+            child.handle.promise().continuation = self;
+            pushLocal(Job{resumeJob, child.handle.address()});
+        }
+
+        long await_resume()
+        {
+            long result = child.handle.promise().result;
+            child.handle.destroy();
+            return result;
+        }
+
+        static thread_local int t_worker;
+
+        // Out of line so the thread-local lookup is never cached across a resume on another thread.
+        [[gnu::noinline]] static void pushLocal(const Job &job) { (*g_deques)[t_worker].push(job); }
+    };
+
+    thread_local int SpawnAwaiter::t_worker = 0;
+
+    CoCall coNode(int depth, int fanout)
+    {
+        long result = leafWork(depth);
+        if (depth > 0)
+        {
+            for (int i = 0; i < fanout; i++)
+                result += co_await SpawnAwaiter{coNode(depth - 1, fanout)};
+        }
+        co_return result;
+    }
+
+    CoCall coRoot(int depth, int fanout, atomic<int> *remaining)
+    {
+        long result = co_await SpawnAwaiter{coNode(depth, fanout)};
+        (*remaining)--;
+        co_return result;
+    }
+
+    void coWorkerLoop(int worker, atomic<int> *remaining)
+    {
+        SpawnAwaiter::t_worker = worker;
+        workerLoop(worker, remaining);
+    }
+
+    double cpuSeconds()
+    {
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+    }
+
+    struct Result
+    {
+        double wall;
+        double cpu;
+        long peakStack;
+    };
+
+    template <typename Setup, typename Loop>
+    Result measure(int roots, Setup setup, Loop loop)
+    {
+        vector<WorkStealingDeque<Job>> deques(g_workers);
+        g_deques = &deques;
+        g_peakStack.store(0);
+        atomic<int> remaining(roots);
+
+        setup(deques[0], &remaining);
+
+        double cpuStart = cpuSeconds();
+        auto start = chrono::steady_clock::now();
+        vector<thread> threads;
+        for (int w = 0; w < g_workers; w++)
+            threads.emplace_back(loop, w, &remaining);
+        for (auto &t : threads)
+            t.join();
+        auto end = chrono::steady_clock::now();
+        return Result{chrono::duration<double>(end - start).count(), cpuSeconds() - cpuStart, g_peakStack.load()};
+    }
+
+    void compare(const char *shape, int depth, int fanout, int roots)
+    {
+        vector<SpinCall> spinRoots(roots);
+        Result spin = measure(roots, [&](WorkStealingDeque<Job> &deque, atomic<int> *remaining)
+                              {
+            for (auto &root : spinRoots)
+            {
+                root.depth = depth;
+                root.fanout = fanout;
+                root.remaining = remaining;
+                deque.push(Job{runSpin, &root});
+            } },
+                              workerLoop);
+
+        Result coro = measure(roots, [&](WorkStealingDeque<Job> &deque, atomic<int> *remaining)
+                              {
+            for (int i = 0; i < roots; i++)
+            {
+                CoCall root = coRoot(depth, fanout, remaining);
+                root.handle.promise().detached = true;
+                deque.push(Job{resumeJob, root.handle.address()});
+            } },
+                              coWorkerLoop);
+
+        printf("%-6s %-12s %10.3f %10.3f %12ld\n", shape, "spin-wait", spin.wall, spin.cpu, spin.peakStack);
+        printf("%-6s %-12s %10.3f %10.3f %12ld\n", shape, "coroutine", coro.wall, coro.cpu, coro.peakStack);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    g_workers = argc > 1 ? atoi(argv[1]) : (int)max(2u, thread::hardware_concurrency());
+    int deepDepth = argc > 2 ? atoi(argv[2]) : 2000;
+    int roots = argc > 3 ? atoi(argv[3]) : 64;
+
+    printf("%d workers, %d roots per shape\n", g_workers, roots);
+    printf("%-6s %-12s %10s %10s %12s\n", "shape", "mode", "wall s", "cpu s", "peak stack B");
+    compare("deep", deepDepth, 1, roots);
+    compare("wide", 2, 64, roots);
+    return 0;
+}
@@ -0,0 +1,275 @@
+// Measures false sharing in the layouts the runtime used to have against the
+// current ones, with hardware cache counters read through perf_event_open.
+//
+// load counters: every thread updates its own worker's pending-cost counter
+//   while it also samples two others, as the scheduler policy does. Packed
+//   counters (the old `atomic<int> *vec`) share lines between neighbours; the
+//   counters in WorkerState each have a line of their own.
+// done flags: pairs of threads play caller and callee. The callee reads its
+//   arguments, writes a result and sets the done flag; the caller polls the
+//   flag, reads the result and issues the next call. The old layout kept
+//   arguments, result and flag in one slot and packed slots back to back; now
+//   the arguments travel inside the task and the result and flag sit in a
+//   CallResult of their own in the caller's frame.
+//
+// HITM (loads hitting a line modified in another core's cache) has no generic
+// perf event; run `perf c2c record ./build/false_sharing_bench` and
+// `perf c2c report` to see it per cache line.
+
+#include "../Runtime/obfuscation_runtime.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+    // One hardware counter covering this thread and every thread it creates
+    // while the counter is open. Reads as -1 where perf events are unavailable.
+    class PerfCounter
+    {
+    public:
+        PerfCounter(uint32_t type, uint64_t config) : fd(-1)
+        {
+#ifdef __linux__
+            perf_event_attr attr{};
+            attr.size = sizeof(attr);
+            attr.type = type;
+            attr.config = config;
+            attr.disabled = 1;
+            attr.inherit = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+            if (fd >= 0)
+            {
+                ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+#else
+            (void)type;
+            (void)config;
+#endif
+        }
+
+        ~PerfCounter()
+        {
+#ifdef __linux__
+            if (fd >= 0)
+                close(fd);
+#endif
+        }
+
+        long long read()
+        {
+#ifdef __linux__
+            long long value = 0;
+            if (fd >= 0 && ::read(fd, &value, sizeof(value)) == (ssize_t)sizeof(value))
+                return value;
+#endif
+            return -1;
+        }
+
+    private:
+        int fd;
+    };
+
+    struct Counters
+    {
+        double seconds;
+        long long l1dMisses;
+        long long llcMisses;
+    };
+
+    // Runs body(thread) on `threads` threads and counts cache misses over all of them.
+    template <typename Body>
+    Counters measure(int threads, Body body)
+    {
+#ifdef __linux__
+        PerfCounter l1d(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+        PerfCounter llc(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+#else
+        PerfCounter l1d(0, 0), llc(0, 0);
+#endif
+        auto start = chrono::steady_clock::now();
+        vector<thread> pool;
+        for (int t = 0; t < threads; t++)
+            pool.emplace_back(body, t);
+        for (auto &t : pool)
+            t.join();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        return Counters{seconds, l1d.read(), llc.read()};
+    }
+
+    void report(const char *scenario, const char *layout, const Counters &c, long ops)
+    {
+        char l1d[32], llc[32];
+        if (c.l1dMisses >= 0)
+            snprintf(l1d, sizeof(l1d), "%.3f", (double)c.l1dMisses / ops);
+        else
+            snprintf(l1d, sizeof(l1d), "n/a");
+        if (c.llcMisses >= 0)
+            snprintf(llc, sizeof(llc), "%.3f", (double)c.llcMisses / ops);
+        else
+            snprintf(llc, sizeof(llc), "n/a");
+        printf("%-14s %-24s %10.1f %14s %14s\n", scenario, layout, c.seconds * 1e9 / ops, l1d, llc);
+    }
+
+    // Polls like a waiting caller, but lets the other thread run on machines with few cores.
+    template <typename Done>
+    void waitUntil(Done done)
+    {
+        for (int spins = 0; !done(); spins++)
+        {
+            if (spins % 64 == 63)
+                this_thread::yield();
+            else
+                cpuRelax();
+        }
+    }
+
+    // ---- load counters ----
+
+    template <typename Loads>
+    void loadCounterThread(Loads &loads, int self, int workers, long ops)
+    {
+        for (long i = 0; i < ops; i++)
+        {
+            loads[self].fetch_add(3, memory_order_relaxed);
+            // Power-of-two-choices style sampling of two other workers.
+            volatile int seen = loads[(self + 1) % workers].load(memory_order_relaxed) +
+                                loads[(self + workers / 2) % workers].load(memory_order_relaxed);
+            (void)seen;
+            loads[self].fetch_sub(3, memory_order_relaxed);
+        }
+    }
+
+    struct PaddedLoads
+    {
+        explicit PaddedLoads(int workers) : states(new WorkerState[workers]) {}
+        atomic<int> &operator[](int worker) { return states[worker].load; }
+        unique_ptr<WorkerState[]> states;
+    };
+
+    // ---- done flags ----
+
+    // The old slot layout: arguments, result and done flag together, slots back to back.
+    struct PackedValues
+    {
+        int a;
+        int b;
+        int return_var;
+        atomic<bool> done;
+    };
+
+    // How a caller hands a call to its callee: on a line of its own, like a
+    // task in a deque. In the current layout the arguments travel with it.
+    struct alignas(64) Go
+    {
+        atomic<long> call{0};
+        int a;
+        int b;
+        CallResult *result;
+    };
+
+    void packedPair(PackedValues *slots, Go *go, int thread, long rounds)
+    {
+        PackedValues &slot = slots[thread / 2];
+        atomic<long> &call = go[thread / 2].call;
+        for (long r = 1; r <= rounds; r++)
+        {
+            if (thread % 2)
+            {
+                waitUntil([&]
+                          { return call.load(memory_order_acquire) == r; });
+                slot.return_var = slot.a * 2 + slot.b;
+                slot.done.store(true, memory_order_release);
+            }
+            else
+            {
+                slot.a = (int)r;
+                slot.b = 1;
+                slot.done.store(false, memory_order_relaxed);
+                call.store(r, memory_order_release);
+                waitUntil([&]
+                          { return slot.done.load(memory_order_acquire); });
+                volatile int result = slot.return_var;
+                (void)result;
+            }
+        }
+    }
+
+    void resultPair(Go *go, int thread, long rounds)
+    {
+        Go &task = go[thread / 2];
+        CallResult result;
+        for (long r = 1; r <= rounds; r++)
+        {
+            if (thread % 2)
+            {
+                waitUntil([&]
+                          { return task.call.load(memory_order_acquire) == r; });
+                task.result->return_var = task.a * 2 + task.b;
+                task.result->finish();
+            }
+            else
+            {
+                result.done.store(false, memory_order_relaxed);
+                task.a = (int)r;
+                task.b = 1;
+                task.result = &result;
+                task.call.store(r, memory_order_release);
+                waitUntil([&]
+                          { return result.isDone(); });
+                volatile int value = result.return_var;
+                (void)value;
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int workers = argc > 1 ? atoi(argv[1]) : (int)max(2u, thread::hardware_concurrency());
+    long ops = argc > 2 ? atol(argv[2]) : 2000000;
+    long rounds = argc > 3 ? atol(argv[3]) : 200000;
+    int pairs = max(1, workers / 2);
+
+    printf("%d threads, %ld counter updates each; %d caller/callee pairs, %ld calls each\n", workers, ops, pairs,
+           rounds);
+    printf("%-14s %-24s %10s %14s %14s\n", "scenario", "layout", "ns/op", "L1D miss/op", "LLC miss/op");
+
+    {
+        unique_ptr<atomic<int>[]> packed(new atomic<int>[workers]());
+        Counters c = measure(workers, [&](int t)
+                             { loadCounterThread(packed, t, workers, ops); });
+        report("load counters", "packed array (old vec)", c, ops * workers);
+
+        PaddedLoads padded(workers);
+        c = measure(workers, [&](int t)
+                    { loadCounterThread(padded, t, workers, ops); });
+        report("", "WorkerState::load", c, ops * workers);
+    }
+
+    {
+        unique_ptr<PackedValues[]> packed(new PackedValues[pairs]());
+        unique_ptr<Go[]> go(new Go[pairs]);
+        Counters c = measure(2 * pairs, [&](int t)
+                             { packedPair(packed.get(), go.get(), t, rounds); });
+        report("done flags", "flag in payload", c, rounds * pairs);
+
+        go.reset(new Go[pairs]);
+        c = measure(2 * pairs, [&](int t)
+                    { resultPair(go.get(), t, rounds); });
+        report("", "args in task, CallResult", c, rounds * pairs);
+    }
+    return 0;
+}
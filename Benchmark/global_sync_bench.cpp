@@ -0,0 +1,110 @@
+// Compares the ways rewritten code can guard a global that several workers
+// touch: the legacy scheme (lock the current worker's queue mutex around the
+// line), a GlobalLockGuard over the global's lock stripe, and the atomic
+// global* helpers. Also compares reading a never-written global with and
+// without a lock. Each thread does a fixed number of `counter += 1` (or reads)
+// on one shared global; lost updates show where the scheme does not exclude.
+
+#include "../Runtime/obfuscation_runtime.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+
+namespace
+{
+    long g_counter = 0;
+    long g_readOnly = 42;
+    volatile long g_sink = 0;
+
+    struct Mode
+    {
+        const char *name;
+        bool reads;
+        void (*op)(int thread_idx, mutex *workerMutexes);
+    };
+
+    void workerMutexUpdate(int thread_idx, mutex *workerMutexes)
+    {
+        unique_lock<mutex> lock(workerMutexes[thread_idx]);
+        g_counter += 1;
+    }
+
+    void stripedUpdate(int, mutex *)
+    {
+        GlobalLockGuard globalLock({&g_counter});
+        g_counter += 1;
+    }
+
+    void atomicUpdate(int, mutex *)
+    {
+        globalAddFetch(g_counter, 1);
+    }
+
+    void workerMutexRead(int thread_idx, mutex *workerMutexes)
+    {
+        unique_lock<mutex> lock(workerMutexes[thread_idx]);
+        g_sink = g_readOnly;
+    }
+
+    void unlockedRead(int, mutex *)
+    {
+        g_sink = g_readOnly;
+    }
+
+    double run(const Mode &mode, int threads, int ops, long &lost)
+    {
+        unique_ptr<mutex[]> workerMutexes(new mutex[threads]);
+        g_counter = 0;
+        atomic<bool> go(false);
+        vector<thread> pool;
+        for (int t = 0; t < threads; t++)
+        {
+            pool.emplace_back([&, t]
+                              {
+                while (!go.load())
+                    this_thread::yield();
+                for (int i = 0; i < ops; i++)
+                    mode.op(t, workerMutexes.get()); });
+        }
+
+        auto start = chrono::steady_clock::now();
+        go.store(true);
+        for (auto &t : pool)
+            t.join();
+        auto end = chrono::steady_clock::now();
+
+        lost = mode.reads ? 0 : (long)threads * ops - g_counter;
+        return chrono::duration<double, nano>(end - start).count() / ops;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int ops = argc > 1 ? atoi(argv[1]) : 1000000;
+    int maxThreads = argc > 2 ? atoi(argv[2]) : (int)thread::hardware_concurrency();
+    if (maxThreads < 1)
+        maxThreads = 1;
+
+    Mode modes[] = {
+        {"worker-mutex +=", false, workerMutexUpdate},
+        {"striped-lock +=", false, stripedUpdate},
+        {"atomic +=", false, atomicUpdate},
+        {"worker-mutex read", true, workerMutexRead},
+        {"unlocked read", true, unlockedRead},
+    };
+
+    printf("%d operations per thread on one shared global\n", ops);
+    printf("%-18s %8s %12s %14s\n", "mode", "threads", "ns/op", "lost updates");
+    for (int threads = 1; threads <= maxThreads; threads *= 2)
+    {
+        for (const Mode &mode : modes)
+        {
+            long lost = 0;
+            double nanos = run(mode, threads, ops, lost);
+            printf("%-18s %8d %12.2f %14ld\n", mode.name, threads, nanos, lost);
+        }
+    }
+    return 0;
+}
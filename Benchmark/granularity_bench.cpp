@@ -0,0 +1,202 @@
+// Sweeps the granularity threshold of the generated runtime: a call whose
+// estimated cost is below it runs on the calling worker (runInline) instead of
+// being pushed as a task. The workload is a binary call tree where every call
+// does the same small amount of work and is estimated at the cost of its whole
+// subtree. A low threshold pays dispatch overhead on every leaf; a high one
+// serializes the tree. The last row enables only the queue-depth cutoff.
+
+#include "../Runtime/obfuscation_runtime.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+namespace
+{
+    int g_work = 50;
+
+    void spin(int depth)
+    {
+        volatile int sink = depth;
+        for (int i = 0; i < g_work; i++)
+            sink = sink * 31 + i;
+    }
+
+    // Estimated cost of a call at `depth`: the work of its whole subtree.
+    int subtreeCost(int depth)
+    {
+        return g_work * ((1 << (depth + 1)) - 1);
+    }
+
+    class GranularityPool
+    {
+    public:
+        GranularityPool(int workers, int threshold, int queueDepth)
+            : n(workers), threshold(threshold), queueDepth(queueDepth), deques(workers), inboxes(workers),
+              pending(0), inlined(0), stop(false)
+        {
+            for (int i = 0; i < n; i++)
+                threads.emplace_back([this, i]
+                                     { run(i); });
+        }
+
+        ~GranularityPool() { shutdown(); }
+
+        void shutdown()
+        {
+            stop.store(true);
+            for (auto &t : threads)
+            {
+                if (t.joinable())
+                    t.join();
+            }
+        }
+
+        // What a rewritten call site does: run in place or dispatch (compare runInline).
+        void call(int depth)
+        {
+            if (self >= 0 && (subtreeCost(depth) < threshold || allDeep()))
+            {
+                t_inlined++;
+                body(depth);
+                return;
+            }
+            pending++;
+            Task task{depth, subtreeCost(depth)};
+            if (self >= 0)
+                deques[self].push(task);
+            else
+                inboxes[0].push(task);
+        }
+
+        void waitIdle()
+        {
+            while (pending.load() != 0)
+                this_thread::yield();
+        }
+
+        // Valid after shutdown(); workers publish their counts on the way out.
+        long inlinedCalls() const { return inlined.load(); }
+
+    private:
+        bool allDeep()
+        {
+            if (queueDepth <= 0)
+                return false;
+            for (int i = 0; i < n; i++)
+            {
+                if (deques[i].size() < queueDepth)
+                    return false;
+            }
+            return true;
+        }
+
+        void body(int depth)
+        {
+            spin(depth);
+            if (depth > 0)
+            {
+                call(depth - 1);
+                call(depth - 1);
+            }
+        }
+
+        void run(int idx)
+        {
+            self = idx;
+            t_inlined = 0;
+            unsigned int seed = 2463534242u ^ (unsigned int)(idx + 1) * 2654435761u;
+            while (!stop.load())
+            {
+                Task task;
+                inboxes[idx].takeAll([&](const Task &t)
+                                     { deques[idx].push(t); });
+                bool found = deques[idx].pop(task);
+                for (int i = 0; !found && i < n; i++)
+                {
+                    seed ^= seed << 13;
+                    seed ^= seed >> 17;
+                    seed ^= seed << 5;
+                    int victim = seed % n;
+                    found = victim != idx && deques[victim].steal(task);
+                }
+
+                if (!found)
+                {
+                    this_thread::yield();
+                    continue;
+                }
+                body(task.funcId);
+                pending--;
+            }
+            inlined += t_inlined;
+        }
+
+        static thread_local int self;
+        static thread_local long t_inlined;
+
+        int n;
+        int threshold;
+        int queueDepth;
+        vector<WorkStealingDeque<Task>> deques;
+        vector<TaskInbox> inboxes;
+        vector<thread> threads;
+        atomic<int> pending;
+        atomic<long> inlined;
+        atomic<bool> stop;
+    };
+
+    thread_local int GranularityPool::self = -1;
+    thread_local long GranularityPool::t_inlined = 0;
+
+    struct Result
+    {
+        double seconds;
+        long inlined;
+    };
+
+    Result runTree(int workers, int depth, int threshold, int queueDepth)
+    {
+        GranularityPool pool(workers, threshold, queueDepth);
+        auto start = chrono::steady_clock::now();
+        pool.call(depth);
+        pool.waitIdle();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        pool.shutdown();
+        return Result{seconds, pool.inlinedCalls()};
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int depth = argc > 1 ? atoi(argv[1]) : 20;
+    g_work = argc > 2 ? atoi(argv[2]) : 50;
+    int workers = argc > 3 ? atoi(argv[3]) : (int)thread::hardware_concurrency();
+    if (workers < 1)
+        workers = 1;
+
+    double calls = (double)((1 << (depth + 1)) - 1);
+    printf("call tree depth %d (%.0f calls), %d spin iterations per call, %d workers\n", depth, calls, g_work, workers);
+    printf("%-24s %12s %10s %10s %10s\n", "threshold", "cost", "Mcall/s", "inlined", "speedup");
+
+    Result dispatchAll = runTree(workers, depth, 0, 0);
+    printf("%-24s %12d %10.2f %9.1f%% %9.2fx\n", "0 (dispatch all)", 0, calls / dispatchAll.seconds / 1e6, 0.0, 1.0);
+
+    // Threshold just above the cost of a subtree of height h: those subtrees run inline.
+    for (int h = 0; h <= depth; h += 2)
+    {
+        int threshold = subtreeCost(h) + 1;
+        Result r = runTree(workers, depth, threshold, 0);
+        char label[32];
+        snprintf(label, sizeof(label), "inline height <= %d", h);
+        printf("%-24s %12d %10.2f %9.1f%% %9.2fx\n", label, threshold, calls / r.seconds / 1e6,
+               100.0 * r.inlined / calls, dispatchAll.seconds / r.seconds);
+    }
+
+    Result deep = runTree(workers, depth, 0, INLINE_QUEUE_DEPTH);
+    char label[32];
+    snprintf(label, sizeof(label), "0 + queue depth %d", INLINE_QUEUE_DEPTH);
+    printf("%-24s %12d %10.2f %9.1f%% %9.2fx\n", label, 0, calls / deep.seconds / 1e6,
+           100.0 * deep.inlined / calls, dispatchAll.seconds / deep.seconds);
+    return 0;
+}
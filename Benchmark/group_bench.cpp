@@ -0,0 +1,146 @@
+// Waiting on a BasicTaskGroup against waiting for the whole runtime to go quiet.
+// Each round submits batches of fire-and-forget calls, each of which fires off a
+// few more, and waits for all of them: once by polling quiescent() the way exit()
+// does, once in a group opened on the thread outside the pool, and once in
+// groups opened inside root calls on the workers, which run other tasks while
+// they wait. Every call counts itself, so a wait that returns before its calls
+// have finished shows up as an early round. Reports ms per round and the number
+// of early rounds, which must be zero.
+
+#include "../Runtime/obfuscation_runtime.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+namespace
+{
+    constexpr int ROOT = 0;
+    constexpr int LEAF = 1;
+
+    int g_work = 2000;
+
+    struct GroupConfig : RuntimeDefaults
+    {
+        static constexpr int FUNCTIONS = 2;
+    };
+
+    using Runtime = ObfuscationRuntime<GroupConfig>;
+    using TaskGroup = BasicTaskGroup<Runtime>;
+
+    struct LeafValues
+    {
+        int fanout;
+        atomic<int> *done;
+    };
+
+    struct RootValues
+    {
+        int leaves;
+        int fanout;
+        CallResult *result;  // return_var is 1 if the group's wait returned early
+    };
+
+    // Fires off `fanout` more leaves, which join whatever group it belongs to.
+    void leaf(int thread_idx, LeafValues task_params)
+    {
+        (void)thread_idx;
+        for (int i = 0; i < task_params.fanout; i++)
+            Runtime::submitTask(Runtime::makeTask<leaf>(LEAF, g_work, LeafValues{0, task_params.done}));
+        volatile int sink = 0;
+        for (int i = 0; i < g_work; i++)
+            sink = sink * 31 + i;
+        task_params.done->fetch_add(1, memory_order_relaxed);
+    }
+
+    void submitLeaves(int leaves, int fanout, atomic<int> *done)
+    {
+        for (int i = 0; i < leaves; i++)
+            Runtime::submitTask(Runtime::makeTask<leaf>(LEAF, g_work * (fanout + 1), LeafValues{fanout, done}));
+    }
+
+    // What a rewritten function that waits on its own fire-and-forget calls does.
+    void root(int thread_idx, RootValues task_params)
+    {
+        (void)thread_idx;
+        atomic<int> done{0};
+        {
+            TaskGroup group;
+            submitLeaves(task_params.leaves, task_params.fanout, &done);
+        }
+        task_params.result->return_var = done.load() != task_params.leaves * (task_params.fanout + 1);
+        task_params.result->finish();
+    }
+
+    enum WaitMode
+    {
+        WAIT_QUIESCENT,
+        WAIT_GROUP,
+        WAIT_NESTED_GROUPS
+    };
+
+    void measure(const char *name, WaitMode mode, int batches, int leaves, int fanout, int rounds)
+    {
+        Runtime::initialize();
+        int early = 0;
+        auto start = chrono::steady_clock::now();
+        for (int r = 0; r < rounds; r++)
+        {
+            atomic<int> done{0};
+            int expected = batches * leaves * (fanout + 1);
+            if (mode == WAIT_QUIESCENT)
+            {
+                for (int b = 0; b < batches; b++)
+                    submitLeaves(leaves, fanout, &done);
+                while (!Runtime::quiescent())
+                    this_thread::yield();
+                early += done.load() != expected;
+            }
+            else if (mode == WAIT_GROUP)
+            {
+                TaskGroup group;
+                for (int b = 0; b < batches; b++)
+                    submitLeaves(leaves, fanout, &done);
+                group.wait();
+                early += done.load() != expected;
+            }
+            else
+            {
+                vector<CallResult> results(batches);
+                for (int b = 0; b < batches; b++)
+                    Runtime::submitTask(Runtime::makeTask<root>(ROOT, g_work * leaves * (fanout + 1),
+                                                                RootValues{leaves, fanout, &results[b]}));
+                for (CallResult &result : results)
+                {
+                    while (!result.isDone())
+                        this_thread::yield();
+                    early += result.return_var;
+                }
+            }
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        int workers = Runtime::workerCount();
+        Runtime::exit();
+
+        printf("%-14s %8d %10.3f %8d\n", name, workers, seconds * 1e3 / rounds, early);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int workers = argc > 1 ? atoi(argv[1]) : (int)max(2u, thread::hardware_concurrency());
+    int batches = argc > 2 ? max(atoi(argv[2]), 1) : workers;
+    int leaves = argc > 3 ? atoi(argv[3]) : 16;
+    int fanout = argc > 4 ? atoi(argv[4]) : 4;
+    int rounds = argc > 5 ? atoi(argv[5]) : 200;
+    setenv("OBFUSCATION_THREADS", to_string(workers).c_str(), 1);
+
+    printf("%d batches of %d calls firing off %d more each (%d iterations per call), %d rounds\n", batches, leaves,
+           fanout, g_work, rounds);
+    printf("%-14s %8s %10s %8s\n", "wait", "workers", "ms/round", "early");
+    measure("quiescent", WAIT_QUIESCENT, batches, leaves, fanout, rounds);
+    measure("group", WAIT_GROUP, batches, leaves, fanout, rounds);
+    measure("nested groups", WAIT_NESTED_GROUPS, batches, leaves, fanout, rounds);
+    return 0;
+}
@@ -0,0 +1,216 @@
+// Measures what idle workers cost the tasks that wake them. A producer thread
+// submits bursts of tiny tasks with pauses in between, the way a non-worker
+// caller does through the workers' inboxes. Workers either park as soon as they
+// run dry or follow the runtime's spin-yield-park policy (pollWhileIdle), and
+// the producer either wakes a worker per task or submits each burst as a batch
+// that wakes every target once (submitTasks). Reports wake-up latency from
+// submission to start, the futex wakes issued and the voluntary context switches.
+
+#include "../Runtime/obfuscation_runtime.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <sys/resource.h>
+
+namespace
+{
+    using Clock = chrono::steady_clock;
+
+    struct Worker
+    {
+        TaskInbox inbox;
+        mutex parkMutex;
+        condition_variable parkCondition;
+        atomic<bool> sleeping{false};
+    };
+
+    class IdlePool
+    {
+    public:
+        IdlePool(int workers, int spinMicros, int yieldMicros, vector<Clock::time_point> &submitted,
+                 vector<double> &latencies)
+            : n(workers), spinMicros(spinMicros), yieldMicros(yieldMicros), slots(new Worker[workers]),
+              submitted(submitted), latencies(latencies), pending(0), wakes(0), stop(false)
+        {
+            for (int i = 0; i < n; i++)
+                threads.emplace_back([this, i]
+                                     { run(i); });
+        }
+
+        ~IdlePool()
+        {
+            stop.store(true);
+            for (int i = 0; i < n; i++)
+            {
+                {
+                    lock_guard<mutex> lock(slots[i].parkMutex);
+                    slots[i].sleeping.store(false);
+                }
+                slots[i].parkCondition.notify_all();
+                threads[i].join();
+            }
+        }
+
+        // One wake attempt per task, like submitTask().
+        void submitEach(const Task *tasks, int count)
+        {
+            for (int i = 0; i < count; i++)
+            {
+                int target = next++ % n;
+                pending++;
+                submitted[tasks[i].funcId] = Clock::now();
+                slots[target].inbox.push(tasks[i]);
+                wake(target);
+            }
+        }
+
+        // One wake attempt per distinct target, like submitTasks().
+        void submitBatch(const Task *tasks, int count)
+        {
+            vector<int> targets;
+            pending += count;
+            for (int i = 0; i < count; i++)
+            {
+                int target = next++ % n;
+                submitted[tasks[i].funcId] = Clock::now();
+                slots[target].inbox.push(tasks[i]);
+                if (find(targets.begin(), targets.end(), target) == targets.end())
+                    targets.push_back(target);
+            }
+            for (int target : targets)
+                wake(target);
+        }
+
+        void waitIdle()
+        {
+            while (pending.load() != 0)
+                this_thread::yield();
+        }
+
+        long wakeCount() const { return wakes.load(); }
+
+    private:
+        void wake(int target)
+        {
+            atomic_thread_fence(memory_order_seq_cst);
+            if (!slots[target].sleeping.exchange(false))
+                return;
+            wakes++;
+            lock_guard<mutex> lock(slots[target].parkMutex);
+            slots[target].parkCondition.notify_one();
+        }
+
+        bool runOne(int idx)
+        {
+            bool ran = false;
+            slots[idx].inbox.takeAll([&](const Task &task)
+                                     {
+                latencies[task.funcId] = chrono::duration<double, micro>(Clock::now() - submitted[task.funcId]).count();
+                volatile int sink = 0;
+                for (int i = 0; i < task.cost; i++)
+                    sink = sink + i;
+                pending--;
+                ran = true; });
+            return ran;
+        }
+
+        void run(int idx)
+        {
+            Worker &self = slots[idx];
+            while (!stop.load())
+            {
+                if (runOne(idx))
+                    continue;
+                if (pollWhileIdle(spinMicros, yieldMicros, [&]
+                                  { return !self.inbox.empty() && runOne(idx); },
+                                  [&]
+                                  { return stop.load(); }))
+                    continue;
+
+                unique_lock<mutex> lock(self.parkMutex);
+                self.sleeping.store(true);
+                atomic_thread_fence(memory_order_seq_cst);
+                if (self.inbox.empty() && !stop.load())
+                    self.parkCondition.wait(lock, [&]
+                                            { return !self.sleeping.load() || stop.load(); });
+                self.sleeping.store(false);
+            }
+        }
+
+        int n;
+        int spinMicros;
+        int yieldMicros;
+        unique_ptr<Worker[]> slots;
+        vector<Clock::time_point> &submitted;
+        vector<double> &latencies;
+        vector<thread> threads;
+        unsigned next = 0;
+        atomic<int> pending;
+        atomic<long> wakes;
+        atomic<bool> stop;
+    };
+
+    long contextSwitches()
+    {
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_nvcsw;
+    }
+
+    void measure(const char *policy, int spinMicros, int yieldMicros, bool batched, int workers, int bursts,
+                 int burstSize, int gapMicros)
+    {
+        int total = bursts * burstSize;
+        vector<Clock::time_point> submitted(total);
+        vector<double> latencies(total);
+        long switchesBefore = contextSwitches();
+        long wakes;
+        auto start = Clock::now();
+        {
+            IdlePool pool(workers, spinMicros, yieldMicros, submitted, latencies);
+            vector<Task> burst(burstSize);
+            for (int b = 0; b < bursts; b++)
+            {
+                for (int i = 0; i < burstSize; i++)
+                    burst[i] = Task{b * burstSize + i, 100};  // funcId numbers the sample
+                if (batched)
+                    pool.submitBatch(burst.data(), burstSize);
+                else
+                    pool.submitEach(burst.data(), burstSize);
+                pool.waitIdle();
+                this_thread::sleep_for(chrono::microseconds(gapMicros));
+            }
+            wakes = pool.wakeCount();
+        }
+        double seconds = chrono::duration<double>(Clock::now() - start).count();
+        long switches = contextSwitches() - switchesBefore;
+
+        sort(latencies.begin(), latencies.end());
+        double mean = 0;
+        for (double latency : latencies)
+            mean += latency;
+        mean /= total;
+        printf("%-16s %-8s %10.2f %10.2f %10.2f %10.1f %10.1f %8.3f\n", policy, batched ? "batch" : "each", mean,
+               latencies[total / 2], latencies[total * 99 / 100], (double)wakes / bursts, (double)switches / bursts, seconds);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int workers = argc > 1 ? atoi(argv[1]) : (int)max(2u, thread::hardware_concurrency());
+    int bursts = argc > 2 ? atoi(argv[2]) : 2000;
+    int burstSize = argc > 3 ? atoi(argv[3]) : 16;
+    int gapMicros = argc > 4 ? atoi(argv[4]) : 50;
+
+    printf("%d workers, %d bursts of %d tasks, %d us between bursts\n", workers, bursts, burstSize, gapMicros);
+    printf("%-16s %-8s %10s %10s %10s %10s %10s %8s\n", "idle policy", "submit", "mean us", "p50 us", "p99 us",
+           "wakes/bst", "cswitch/bst", "wall s");
+    for (bool batched : {false, true})
+    {
+        measure("park", 0, 0, batched, workers, bursts, burstSize, gapMicros);
+        measure("spin-yield-park", IDLE_SPIN_MICROS, IDLE_YIELD_MICROS, batched, workers, bursts, burstSize, gapMicros);
+    }
+    return 0;
+}
@@ -0,0 +1,102 @@
+// Compares worker-selection policies at several pool sizes: the cost of one
+// selection call (single caller and several concurrent callers) and how evenly
+// the resulting placement spreads load.
+
+#include "../Runtime/obfuscation_runtime.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+
+namespace
+{
+    constexpr int PLACEMENTS_PER_WORKER = 2000;
+
+    double selectNanos(SchedulerPolicy &policy, atomic<int> *loads, int workers, int callers, int calls)
+    {
+        vector<thread> threads;
+        atomic<bool> go(false);
+        for (int c = 0; c < callers; c++)
+        {
+            threads.emplace_back([&]
+                                 {
+                while (!go.load())
+                    this_thread::yield();
+                for (int i = 0; i < calls; i++)
+                {
+                    int idx = policy.selectWorker(loads, workers);
+                    loads[idx].fetch_add(1, memory_order_relaxed);
+                    loads[idx].fetch_sub(1, memory_order_relaxed);
+                } });
+        }
+
+        auto start = chrono::steady_clock::now();
+        go.store(true);
+        for (auto &t : threads)
+            t.join();
+        auto end = chrono::steady_clock::now();
+        return chrono::duration<double, nano>(end - start).count() / ((double)calls * callers);
+    }
+
+    // Places tasks with random costs while every worker retires a fixed amount
+    // of work per step, then reports max load over mean load (1.0 is perfect).
+    double imbalance(SchedulerPolicy &policy, atomic<int> *loads, int workers)
+    {
+        for (int i = 0; i < workers; i++)
+            loads[i].store(0);
+
+        mt19937 costs(42);
+        uniform_int_distribution<int> cost(1, 100);
+        for (int step = 0; step < PLACEMENTS_PER_WORKER * workers; step++)
+        {
+            int idx = policy.selectWorker(loads, workers);
+            loads[idx].fetch_add(cost(costs));
+            if (step % workers == 0)
+            {
+                for (int i = 0; i < workers; i++)
+                    loads[i].store(max(0, loads[i].load() - 45));
+            }
+        }
+
+        double sum = 0, peak = 0;
+        for (int i = 0; i < workers; i++)
+        {
+            sum += loads[i].load();
+            peak = max(peak, (double)loads[i].load());
+        }
+        return sum > 0 ? peak / (sum / workers) : 1.0;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int calls = argc > 1 ? atoi(argv[1]) : 200000;
+    int callers = argc > 2 ? atoi(argv[2]) : 4;
+
+    BalancedRandomPolicy balanced;
+    PowerOfTwoChoicesPolicy twoChoices;
+    struct
+    {
+        const char *name;
+        SchedulerPolicy *policy;
+    } policies[] = {{"balanced-random", &balanced}, {"power-of-two", &twoChoices}};
+
+    printf("%d selections per caller, %d concurrent callers\n", calls, callers);
+    printf("%-16s %8s %12s %14s %10s\n", "policy", "workers", "ns/select", "ns/select(mt)", "max/mean");
+
+    for (int workers : {2, 8, 32, 64})
+    {
+        unique_ptr<atomic<int>[]> loads(new atomic<int>[workers]);
+        for (auto &entry : policies)
+        {
+            for (int i = 0; i < workers; i++)
+                loads[i].store(i % 7);
+            double single = selectNanos(*entry.policy, loads.get(), workers, 1, calls);
+            double shared = selectNanos(*entry.policy, loads.get(), workers, callers, calls);
+            double skew = imbalance(*entry.policy, loads.get(), workers);
+            printf("%-16s %8d %12.1f %14.1f %10.2f\n", entry.name, workers, single, shared, skew);
+        }
+    }
+    return 0;
+}
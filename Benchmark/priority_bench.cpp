@@ -0,0 +1,140 @@
+// Priority queues against a single queue per worker on call chains mixed with
+// fire-and-forget work. A thread outside the pool submits a backlog of
+// fire-and-forget calls and then a few chains of awaited calls: every link
+// dispatches the next one, fires off some side calls nobody waits for, and then
+// helps with other tasks until its callee is done. With one queue a waiting link
+// runs the side calls it just pushed before its own callee, and thieves take
+// the oldest backlog first; with OBFUSCATION_PRIORITIES the awaited links sit a
+// level above them on every worker, and links awaited by awaited links one
+// level higher still. Reports the mean, p50 and p99 latency of a chain, from
+// submission to the completion of its first link, and the wall time per round.
+
+#include "../Runtime/obfuscation_runtime.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+namespace
+{
+    constexpr int LINK = 0;
+    constexpr int SIDE = 1;
+
+    int g_linkWork = 2000;
+    int g_sideWork = 20000;
+    int g_sideCalls = 4;
+
+    struct PriorityConfig : RuntimeDefaults
+    {
+        static constexpr int FUNCTIONS = 2;
+    };
+
+    using Runtime = ObfuscationRuntime<PriorityConfig>;
+    using Clock = chrono::steady_clock;
+
+    void spin(int iterations)
+    {
+        volatile int sink = 0;
+        for (int i = 0; i < iterations; i++)
+            sink = sink * 31 + i;
+    }
+
+    struct SideValues
+    {
+        int work;
+    };
+
+    struct LinkValues
+    {
+        int depth;
+        Clock::time_point *finished;  // where the first link of a chain stores when it finished
+        CallResult *result;
+    };
+
+    void side(int thread_idx, SideValues task_params)
+    {
+        (void)thread_idx;
+        spin(task_params.work);
+    }
+
+    // One link of a chain: what a rewritten non-void function with a few
+    // fire-and-forget calls between its call and its join does.
+    void link(int thread_idx, LinkValues task_params)
+    {
+        spin(g_linkWork);
+        if (task_params.depth > 0)
+        {
+            CallResult next;
+            Runtime::submitAwaitedTask(Runtime::makeTask<link>(LINK, g_linkWork, LinkValues{task_params.depth - 1, nullptr, &next}));
+            for (int i = 0; i < g_sideCalls; i++)
+                Runtime::submitTask(Runtime::makeTask<side>(SIDE, g_sideWork, SideValues{g_sideWork}));
+            while (!next.isDone())
+                Runtime::execute(thread_idx);
+        }
+        if (task_params.finished)
+            *task_params.finished = Clock::now();
+        task_params.result->return_var = task_params.depth;
+        task_params.result->finish();
+    }
+
+    void measure(const char *queues, const char *priorities, int chains, int depth, int backlog, int rounds)
+    {
+        setenv("OBFUSCATION_PRIORITIES", priorities, 1);
+        Runtime::initialize();
+        vector<double> latencies;
+        auto start = Clock::now();
+        for (int r = 0; r < rounds; r++)
+        {
+            for (int i = 0; i < backlog; i++)
+                Runtime::submitTask(Runtime::makeTask<side>(SIDE, g_sideWork, SideValues{g_sideWork}));
+            vector<CallResult> results(chains);
+            vector<Clock::time_point> submitted(chains), finished(chains);
+            for (int c = 0; c < chains; c++)
+            {
+                submitted[c] = Clock::now();
+                Runtime::submitAwaitedTask(
+                    Runtime::makeTask<link>(LINK, g_linkWork, LinkValues{depth, &finished[c], &results[c]}));
+            }
+            for (int c = 0; c < chains; c++)
+            {
+                while (!results[c].isDone())
+                    this_thread::yield();
+                latencies.push_back(chrono::duration<double, micro>(finished[c] - submitted[c]).count());
+            }
+            // The side calls left over belong to this round.
+            while (!Runtime::quiescent())
+                this_thread::yield();
+        }
+        double seconds = chrono::duration<double>(Clock::now() - start).count();
+        int workers = Runtime::workerCount();
+        Runtime::exit();
+
+        double total = 0;
+        for (double latency : latencies)
+            total += latency;
+        sort(latencies.begin(), latencies.end());
+        printf("%-12s %8d %12.1f %12.1f %12.1f %10.3f\n", queues, workers, total / latencies.size(),
+               latencies[latencies.size() / 2], latencies[latencies.size() * 99 / 100], seconds * 1e3 / rounds);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int workers = argc > 1 ? atoi(argv[1]) : (int)max(2u, thread::hardware_concurrency());
+    int chains = argc > 2 ? max(atoi(argv[2]), 1) : workers;
+    int depth = argc > 3 ? atoi(argv[3]) : 8;
+    int backlog = argc > 4 ? atoi(argv[4]) : 16 * workers;
+    int rounds = argc > 5 ? atoi(argv[5]) : 200;
+    setenv("OBFUSCATION_THREADS", to_string(workers).c_str(), 1);
+    // Every call is dispatched, however small, so queueing alone differs.
+    setenv("OBFUSCATION_INLINE_COST", "0", 1);
+    setenv("OBFUSCATION_INLINE_DEPTH", "0", 1);
+
+    printf("%d chains of %d links (%d iterations, %d side calls of %d each), backlog of %d side calls, %d rounds\n",
+           chains, depth + 1, g_linkWork, g_sideCalls, g_sideWork, backlog, rounds);
+    printf("%-12s %8s %12s %12s %12s %10s\n", "queues", "workers", "mean us", "p50 us", "p99 us", "ms/round");
+    measure("single", "0", chains, depth, backlog, rounds);
+    measure("priority", "1", chains, depth, backlog, rounds);
+    return 0;
+}
@@ -0,0 +1,217 @@
+// Compares the legacy per-worker mutex+condvar queues (push to a random worker,
+// notify on every push) against the work-stealing deques used by the generated
+// runtime. The workload is a fork tree of tiny tasks, which is where dispatch
+// overhead dominates.
+
+#include "../Runtime/obfuscation_runtime.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <queue>
+#include <string>
+
+namespace
+{
+    int g_work = 64;
+
+    void spin(int depth)
+    {
+        volatile int sink = depth;
+        for (int i = 0; i < g_work; i++)
+            sink = sink * 31 + i;
+    }
+
+    class LockedQueuePool
+    {
+    public:
+        explicit LockedQueuePool(int workers)
+            : n(workers), queues(workers), locks(workers), conds(workers), pending(0), stop(false)
+        {
+            for (int i = 0; i < n; i++)
+                threads.emplace_back([this, i]
+                                     { run(i); });
+        }
+
+        ~LockedQueuePool()
+        {
+            stop.store(true);
+            for (int i = 0; i < n; i++)
+            {
+                {
+                    lock_guard<mutex> lock(locks[i]);
+                }
+                conds[i].notify_all();
+                threads[i].join();
+            }
+        }
+
+        void submit(const Task &task)
+        {
+            static thread_local mt19937 rng(random_device{}());
+            int target = uniform_int_distribution<int>(0, n - 1)(rng);
+            pending++;
+            {
+                lock_guard<mutex> lock(locks[target]);
+                queues[target].push(task);
+            }
+            conds[target].notify_one();
+        }
+
+        void waitIdle()
+        {
+            while (pending.load() != 0)
+                this_thread::yield();
+        }
+
+    private:
+        void run(int idx)
+        {
+            while (true)
+            {
+                Task task;
+                {
+                    unique_lock<mutex> lock(locks[idx]);
+                    conds[idx].wait(lock, [&]
+                                    { return !queues[idx].empty() || stop.load(); });
+                    if (queues[idx].empty())
+                        return;
+                    task = queues[idx].front();
+                    queues[idx].pop();
+                }
+                work(task);
+                pending--;
+            }
+        }
+
+        void work(const Task &task)
+        {
+            spin(task.funcId);
+            if (task.funcId > 0)
+            {
+                submit({task.funcId - 1, 1});
+                submit({task.funcId - 1, 1});
+            }
+        }
+
+        int n;
+        vector<queue<Task>> queues;
+        vector<mutex> locks;
+        vector<condition_variable> conds;
+        vector<thread> threads;
+        atomic<int> pending;
+        atomic<bool> stop;
+    };
+
+    class StealingPool
+    {
+    public:
+        explicit StealingPool(int workers)
+            : n(workers), deques(workers), inboxes(workers), pending(0), stop(false)
+        {
+            for (int i = 0; i < n; i++)
+                threads.emplace_back([this, i]
+                                     { run(i); });
+        }
+
+        ~StealingPool()
+        {
+            stop.store(true);
+            for (auto &t : threads)
+                t.join();
+        }
+
+        void submit(const Task &task)
+        {
+            pending++;
+            if (self >= 0)
+                deques[self].push(task);
+            else
+                inboxes[0].push(task);
+        }
+
+        void waitIdle()
+        {
+            while (pending.load() != 0)
+                this_thread::yield();
+        }
+
+    private:
+        void run(int idx)
+        {
+            self = idx;
+            unsigned int seed = 2463534242u ^ (unsigned int)(idx + 1) * 2654435761u;
+            while (!stop.load())
+            {
+                Task task;
+                inboxes[idx].takeAll([&](const Task &t)
+                                     { deques[idx].push(t); });
+                bool found = deques[idx].pop(task);
+                for (int i = 0; !found && i < n; i++)
+                {
+                    seed ^= seed << 13;
+                    seed ^= seed >> 17;
+                    seed ^= seed << 5;
+                    int victim = seed % n;
+                    found = victim != idx && deques[victim].steal(task);
+                }
+
+                if (!found)
+                {
+                    this_thread::yield();
+                    continue;
+                }
+                spin(task.funcId);
+                if (task.funcId > 0)
+                {
+                    submit({task.funcId - 1, 1});
+                    submit({task.funcId - 1, 1});
+                }
+                pending--;
+            }
+        }
+
+        static thread_local int self;
+
+        int n;
+        vector<WorkStealingDeque<Task>> deques;
+        vector<TaskInbox> inboxes;
+        vector<thread> threads;
+        atomic<int> pending;
+        atomic<bool> stop;
+    };
+
+    thread_local int StealingPool::self = -1;
+
+    template <typename Pool>
+    double runTree(int workers, int depth)
+    {
+        Pool pool(workers);
+        auto start = chrono::steady_clock::now();
+        pool.submit({depth, 1});
+        pool.waitIdle();
+        auto end = chrono::steady_clock::now();
+        return chrono::duration<double>(end - start).count();
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int depth = argc > 1 ? atoi(argv[1]) : 18;
+    g_work = argc > 2 ? atoi(argv[2]) : 64;
+    int maxWorkers = argc > 3 ? atoi(argv[3]) : (int)thread::hardware_concurrency();
+    if (maxWorkers < 1)
+        maxWorkers = 1;
+
+    double tasks = (double)((1 << (depth + 1)) - 1);
+    printf("fork tree depth %d (%.0f tasks), %d spin iterations per task\n", depth, tasks, g_work);
+    printf("%8s %16s %16s %10s\n", "workers", "locked Mtask/s", "stealing Mtask/s", "speedup");
+
+    for (int workers = 1; workers <= maxWorkers; workers *= 2)
+    {
+        double locked = runTree<LockedQueuePool>(workers, depth);
+        double stealing = runTree<StealingPool>(workers, depth);
+        printf("%8d %16.2f %16.2f %9.2fx\n", workers, tasks / locked / 1e6, tasks / stealing / 1e6, locked / stealing);
+    }
+    return 0;
+}
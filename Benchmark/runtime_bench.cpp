@@ -0,0 +1,120 @@
+// Runs one fork-join workload on ObfuscationRuntime specialized for each
+// combination of queue, scheduler policy and idle policy, plus one with the
+// worker count fixed at compile time. The workload uses the runtime the way a
+// rewritten program does: every call of a binary tree returns a value through a
+// CallResult, the caller dispatches one child unless runInline() keeps it,
+// calls the other directly and helps with other tasks while it waits, and a
+// thread outside the pool submits the roots. Reports millions of calls per
+// second and the time per tree.
+
+#include "../Runtime/obfuscation_runtime.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+namespace
+{
+    int g_work = 200;
+
+    template <template <typename> class QueueType, typename PolicyType, typename IdleType, int Workers = 0>
+    struct BenchConfig : RuntimeDefaults
+    {
+        template <typename T>
+        using Queue = QueueType<T>;
+        using Policy = PolicyType;
+        using Idle = IdleType;
+        static constexpr int WORKERS = Workers;
+    };
+
+    struct TreeValues
+    {
+        int depth;
+        CallResult *result;
+    };
+
+    // Estimated cost of a call at `depth`: the work of its whole subtree.
+    int subtreeCost(int depth)
+    {
+        return (g_work / 10) * ((1 << (depth + 1)) - 1);
+    }
+
+    // Returns the number of calls in its subtree.
+    template <typename Runtime>
+    void tree(int thread_idx, TreeValues task_params)
+    {
+        volatile int sink = task_params.depth;
+        for (int i = 0; i < g_work; i++)
+            sink = sink * 31 + i;
+
+        int calls = 1;
+        if (task_params.depth > 0)
+        {
+            CallResult left, right;
+            TreeValues args{task_params.depth - 1, &left};
+            int cost = subtreeCost(task_params.depth - 1);
+            if (Runtime::runInline(cost))
+                tree<Runtime>(thread_idx, args);
+            else
+                Runtime::submitTask(Runtime::template makeTask<tree<Runtime>>(0, cost, args));
+            tree<Runtime>(thread_idx, TreeValues{task_params.depth - 1, &right});
+            while (!left.isDone())
+                Runtime::execute(thread_idx);
+            calls += left.return_var + right.return_var;
+        }
+        task_params.result->return_var = calls;
+        task_params.result->finish();
+    }
+
+    template <typename Config>
+    void measure(const char *queue, const char *policy, const char *idle, int depth, int roots)
+    {
+        using Runtime = ObfuscationRuntime<Config>;
+        Runtime::initialize();
+        long calls = 0;
+        auto start = chrono::steady_clock::now();
+        for (int r = 0; r < roots; r++)
+        {
+            CallResult result;
+            Runtime::submitTask(Runtime::template makeTask<tree<Runtime>>(0, subtreeCost(depth), TreeValues{depth, &result}));
+            while (!result.isDone())
+                this_thread::yield();
+            calls += result.return_var;
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        int workers = Runtime::workerCount();
+        Runtime::exit();
+
+        string count = to_string(workers) + (Config::WORKERS > 0 ? " fixed" : "");
+        printf("%-14s %-12s %-16s %-8s %10.2f %10.3f\n", queue, policy, idle, count.c_str(), calls / seconds / 1e6,
+               seconds * 1e3 / roots);
+    }
+
+    template <template <typename> class QueueType>
+    void measureQueue(const char *queue, int depth, int roots)
+    {
+        measure<BenchConfig<QueueType, PowerOfTwoChoicesPolicy, SpinYieldParkIdle>>(queue, "two-choices", "spin-yield-park", depth, roots);
+        measure<BenchConfig<QueueType, PowerOfTwoChoicesPolicy, ParkIdle>>(queue, "two-choices", "park", depth, roots);
+        measure<BenchConfig<QueueType, BalancedRandomPolicy, SpinYieldParkIdle>>(queue, "balanced", "spin-yield-park", depth, roots);
+        measure<BenchConfig<QueueType, BalancedRandomPolicy, ParkIdle>>(queue, "balanced", "park", depth, roots);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int depth = argc > 1 ? atoi(argv[1]) : 14;
+    int roots = argc > 2 ? atoi(argv[2]) : 20;
+    constexpr int FIXED_WORKERS = 4;
+    // The runtime-sized configurations read OBFUSCATION_THREADS like a rewritten program.
+    int workers = argc > 3 ? atoi(argv[3]) : FIXED_WORKERS;
+    setenv("OBFUSCATION_THREADS", to_string(workers).c_str(), 1);
+
+    printf("binary call tree of depth %d, %d roots, %d iterations of work per call\n", depth, roots, g_work);
+    printf("%-14s %-12s %-16s %-8s %10s %10s\n", "queue", "policy", "idle", "workers", "Mcall/s", "ms/tree");
+    measureQueue<WorkStealingDeque>("work-stealing", depth, roots);
+    measureQueue<LockedQueue>("locked", depth, roots);
+    measure<BenchConfig<WorkStealingDeque, PowerOfTwoChoicesPolicy, SpinYieldParkIdle, FIXED_WORKERS>>(
+        "work-stealing", "two-choices", "spin-yield-park", depth, roots);
+    return 0;
+}
@@ -1,10 +1,39 @@
+import hashlib
+import json
 import os
+import re
+import shutil
+import threading
 import time
+from concurrent.futures import ThreadPoolExecutor, as_completed
 import clang.cindex
-from time_complexity_analyzer import analyze_time_complexity
 
 MAX_ATTEMPTS = 5
 SHOW_LOGS = True  # Set to False to disable logging
+USE_COROUTINES = False  # Set to True to emit a C++20 coroutine runtime instead of spin-waiting callers
+RUNTIME_QUEUE = "WorkStealingDeque"  # Per-worker queue of the generated runtime: WorkStealingDeque or LockedQueue
+RUNTIME_POLICY = "PowerOfTwoChoicesPolicy"  # Worker selection: PowerOfTwoChoicesPolicy or BalancedRandomPolicy
+RUNTIME_IDLE = "SpinYieldParkIdle"  # Idle workers: SpinYieldParkIdle or ParkIdle
+RUNTIME_WORKERS = 0  # Fixed worker count compiled into the runtime; 0 sizes the pool at startup
+RUNTIME_ADAPTIVE_LOAD = False  # Place tasks by their measured cost instead of the static estimate (OBFUSCATION_ADAPTIVE_LOAD overrides)
+RUNTIME_EARLIEST_FINISH = False  # Place tasks on the worker expected to finish them first (OBFUSCATION_PLACEMENT overrides)
+RUNTIME_PRIORITIES = True  # Queue awaited calls ahead of fire-and-forget ones (OBFUSCATION_PRIORITIES overrides)
+RUNTIME_AFFINITY_GROUPS = int(os.environ.get("RUNTIME_AFFINITY_GROUPS", "0"))  # Worker groups for call-graph affinity (needs networkx); 0 places tasks by load alone
+AFFINITY_AWAITED_WEIGHT = 4  # Call-graph edge weight of a call whose result the caller waits on; fire-and-forget calls weigh 1
+RUNTIME_LIBRARY = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "Runtime", "obfuscation_runtime.hpp")
+ESTIMATION_MODEL = os.environ.get("ESTIMATION_MODEL", "static")  # "static" (the Obfuscator derives costs itself), "llm", or "stub" for stub_model.py
+ESTIMATION_WORKERS = int(os.environ.get("ESTIMATION_WORKERS", "1"))  # Concurrent model calls; each worker loads its own model
+ESTIMATION_BATCH_SIZE = int(os.environ.get("ESTIMATION_BATCH_SIZE", "4"))  # Functions analyzed per prompt
+COST_CACHE_PATH = "cost_cache.json"  # Costs of previously analyzed function bodies
+PROFILE_PATHS = [path for path in os.environ.get("ESTIMATION_PROFILE", "").split(os.pathsep) if path]  # Profiles from -DOBFUSCATION_PROFILE runs
+PROFILE_NS_PER_COST_UNIT = float(os.environ.get("PROFILE_NS_PER_COST_UNIT", "1"))  # Measured nanoseconds per unit of cost
+SOURCE_FOLDER = os.environ.get("ESTIMATION_SOURCE", "../Input")  # Program to analyze; the runtime is written next to it
+TABLE_FOLDER = os.environ.get("ESTIMATION_TABLE_DIR", "../Obfuscator")  # Where cpp_functions.h is written
+
+if ESTIMATION_MODEL == "stub":
+    import stub_model as cost_model
+elif ESTIMATION_MODEL == "llm":
+    import time_complexity_analyzer as cost_model
 
 
 class ConsoleColors:
@@ -37,6 +66,9 @@ class FunctionInfo:
         self.function_name_with_params: str = params
         self.params: list[Parameter] = []
         self.return_type: str = None
+        self.profiled: bool = False
+        self.callees: list[tuple[str, bool]] = []  # (callee name with params, whether the call's result is awaited)
+        self.affinity_group: int = 0
 
     def setTimeComplexity(self, time_complexity):
         self.time_complexity = time_complexity
@@ -60,6 +92,29 @@ class FunctionInfo:
         return f"{self.function_name_with_params}({', '.join(map(str, self.params))}) -> {self.return_type}"
 
 
+def function_name_with_params(node):
+    """The function's name with one letter per parameter type, as the Obfuscator renames it."""
+    param_types = []
+    for param in node.get_arguments():
+        param_type = param.type.spelling.split()[0]
+        param_types.append(param_type[0])
+    params_suffix = ''.join(param_types)
+    return f"{node.spelling}{f'_{params_suffix}' if params_suffix else ''}"
+
+
+def collect_callees(node):
+    """Every call the function makes to a function, as (callee name with params, awaited)."""
+    callees = []
+    for child in node.walk_preorder():
+        if child.kind != clang.cindex.CursorKind.CALL_EXPR:
+            continue
+        callee = child.referenced
+        if callee is None or callee.kind != clang.cindex.CursorKind.FUNCTION_DECL:
+            continue
+        callees.append((function_name_with_params(callee), callee.result_type.spelling != "void"))
+    return callees
+
+
 def extract_functions_from_source(file_path):
     index = clang.cindex.Index.create()
 
@@ -123,14 +178,8 @@ def extract_functions_from_source(file_path):
             return_type = node.result_type.spelling
             func_info.return_type = None if return_type == "void" else return_type
 
-            param_types = []
-            for param in node.get_arguments():
-                param_type = param.type.spelling.split()[0]
-                param_types.append(param_type[0])
-            params_suffix = ''.join(param_types)
-            func_info.setFunctionNameWithParams(
-                f"{node.spelling}{f'_{params_suffix}' if params_suffix else ''}"
-            )
+            func_info.setFunctionNameWithParams(function_name_with_params(node))
+            func_info.callees = collect_callees(node)
 
             try:
                 total_statements = count_statements(node)
@@ -203,52 +252,301 @@ def extract_all_functions_from_project(source_folder):
     return all_functions
 
 
-source_folder = "../Input"
-functions = extract_all_functions_from_project(source_folder)
-limit = False
+_comment_or_literal = re.compile(r'//[^\n]*|/\*.*?\*/|"(?:\\.|[^"\\])*"|\'(?:\\.|[^\'\\])*\'', re.S)
 
-total_elapsed_time = 0
 
-for index, func in enumerate(functions):
-    isSuccess = False
-    count = 0
-    time_complexity = None
-    startingTime = time.time()
-    report = ""
-    while not isSuccess:
+def normalize_function_body(body):
+    """Drops comments and collapses whitespace, so reformatting a function keeps its cached cost."""
+    body = _comment_or_literal.sub(lambda m: m.group(0) if m.group(0)[0] in '"\'' else ' ', body)
+    return ' '.join(body.split())
+
+
+def cost_cache_key(func):
+    normalized = normalize_function_body(func.function_body)
+    return hashlib.sha256(f"{cost_model.model_name}\n{normalized}".encode("utf-8")).hexdigest()
+
+
+class CostCache:
+    """
+    Persistent map from a normalized function body hash to the cost the model gave it.
+    Functions the model could not analyze are stored too (ok = False) so they fall back
+    to the statement count without costing MAX_ATTEMPTS model calls on every run.
+    Delete the cache file to re-analyze everything.
+    """
+
+    VERSION = 1
+
+    def __init__(self, path):
+        self.path = path
+        self.entries = {}
+        self.lock = threading.Lock()
+        try:
+            with open(path, "r", encoding="utf-8") as cache_file:
+                data = json.load(cache_file)
+            if data.get("version") == self.VERSION:
+                self.entries = data.get("entries", {})
+        except (OSError, ValueError):
+            pass
+
+    def get(self, key):
+        with self.lock:
+            return self.entries.get(key)
+
+    def put(self, key, ok, cost):
+        with self.lock:
+            self.entries[key] = {"ok": ok, "cost": cost if ok else None}
+
+    def save(self):
+        with self.lock:
+            data = json.dumps({"version": self.VERSION, "entries": self.entries}, indent=1, sort_keys=True)
+        temp_path = self.path + ".tmp"
+        with open(temp_path, "w", encoding="utf-8") as cache_file:
+            cache_file.write(data)
+        os.replace(temp_path, self.path)
+
+
+def analyze_batch(bodies):
+    """
+    Runs one batched prompt, then retries every function the batch did not answer
+    on its own, up to MAX_ATTEMPTS model calls per function. Returns the
+    (isSuccess, result) pairs and the number of model calls made.
+    """
+    results = cost_model.analyze_time_complexity_batch(bodies)
+    calls = 1
+    for i, body in enumerate(bodies):
+        isSuccess, result = results[i]
+        count = 1
+        report = ""
+        while not isSuccess and count < MAX_ATTEMPTS:
+            report += f"Attempt {count}: {result}\n"
+            print(
+                f"{ConsoleColors.OKBLUE}Generating Complexity Attempt-[{count+1}/{MAX_ATTEMPTS}] for function {i + 1} of batch{ConsoleColors.ENDC}") if SHOW_LOGS else None
+            isSuccess, result = cost_model.analyze_time_complexity(body, report=report)
+            count += 1
+            calls += 1
+        results[i] = (isSuccess, result)
+    return results, calls
+
+
+# Names a cost expression may use besides the function's parameters. Called
+# functions, namespaces and members are not checked.
+COST_EXPRESSION_WORDS = {"sizeof", "true", "false", "nullptr", "static_cast", "const", "auto", "bool", "char", "short",
+                         "int", "long", "unsigned", "float", "double", "size_t"}
+
+
+def cost_names(expression):
+    """The plain names in a C++ cost expression, not counting calls, members and qualifiers."""
+    return set(re.findall(r'(?<![\w.])(?<!->)(?<!::)([A-Za-z_]\w*)\b(?!\s*(?:\(|::))', expression))
+
+
+def cost_uses_only_params(func, expression):
+    """
+    Whether a cost expression reads nothing but the function's parameters, so the
+    generated <function>_cost can evaluate it from the arguments of each call.
+    """
+    return cost_names(expression) <= {param.name for param in func.params} | COST_EXPRESSION_WORDS
+
+
+def apply_cost(func, isSuccess, time_complexity):
+    if isSuccess and not cost_uses_only_params(func, str(time_complexity)):
         print(
-            f"{ConsoleColors.OKBLUE}Generating Complexity Attempt-[{count+1}/{MAX_ATTEMPTS}]: {func.function_name}{ConsoleColors.ENDC}") if SHOW_LOGS else None
-        isSuccess, time_complexity = analyze_time_complexity(
-            str(func.function_body), report=report)
-        count += 1
-        if not isSuccess:
-            report += f"Attempt {count}: {time_complexity}\n"
-        if count >= MAX_ATTEMPTS:
-            count = 0
-            isSuccess = False
-            break
-    endingTime = time.time()
-    elapsedTime = endingTime - startingTime
-    total_elapsed_time += elapsedTime
-    avg_time_per_function = total_elapsed_time / (index + 1)
-    remaining_functions = len(functions) - (index + 1)
-    approx_eta = avg_time_per_function * remaining_functions
-
-    print(f"{ConsoleColors.OKCYAN}Generation time: {elapsedTime:.2f} seconds{ConsoleColors.ENDC}") if SHOW_LOGS else None
+            f"{ConsoleColors.WARNING}{func.getFunctionNameWithParams()}: cost '{time_complexity}' reads names other than the parameters; using the statement count{ConsoleColors.ENDC}") if SHOW_LOGS else None
+        isSuccess = False
     if isSuccess:
         func.setTimeComplexity(time_complexity)
-        print(
-            f"{ConsoleColors.OKGREEN}Time complexity: {func.getTimeComplexity()}{ConsoleColors.ENDC}") if SHOW_LOGS else None
     else:
-        print(f"{ConsoleColors.FAIL}Failed to analyze time complexity, using default value.{ConsoleColors.ENDC}") if SHOW_LOGS else None
         func.setTimeComplexity(str(func.getTotalStatements()))
-    print(f"{ConsoleColors.OKCYAN}Total Statements: {func.getTotalStatements()}{ConsoleColors.ENDC}") if SHOW_LOGS else None
-    eta_hours, eta_remainder = divmod(approx_eta, 3600)
+
+
+def format_eta(seconds):
+    eta_hours, eta_remainder = divmod(seconds, 3600)
     eta_minutes, eta_seconds = divmod(eta_remainder, 60)
+    return f"{int(eta_hours):02}:{int(eta_minutes):02}:{int(eta_seconds):02}"
+
+
+def estimate_costs(functions):
+    """
+    Sets the cost of every function. Cached bodies are answered immediately; the
+    rest are deduplicated, grouped into prompts of ESTIMATION_BATCH_SIZE and run
+    on ESTIMATION_WORKERS threads. The cache is saved after every batch, so an
+    interrupted run keeps its progress.
+    """
+    if ESTIMATION_MODEL == "static":
+        # The Obfuscator's static cost model (--cost-model=static) prices every call
+        # from the source; the table only needs placeholders for --cost-model=table.
+        for func in functions:
+            apply_cost(func, False, None)
+        print(
+            f"{ConsoleColors.OKCYAN}Static cost model: {len(functions)} functions use statement counts in the table{ConsoleColors.ENDC}") if SHOW_LOGS else None
+        return
+
+    cache = CostCache(COST_CACHE_PATH)
+    pending = {}
+    cache_hits = 0
+    for func in functions:
+        key = cost_cache_key(func)
+        entry = cache.get(key)
+        if entry is not None:
+            apply_cost(func, entry["ok"], entry["cost"])
+            cache_hits += 1
+        else:
+            pending.setdefault(key, []).append(func)
+
+    keys = list(pending)
+    batches = [keys[i:i + ESTIMATION_BATCH_SIZE] for i in range(0, len(keys), max(1, ESTIMATION_BATCH_SIZE))]
+    print(
+        f"{ConsoleColors.HEADER}Cost cache: {cache_hits}/{len(functions)} functions reused, {len(keys)} bodies to analyze in {len(batches)} batches on {ESTIMATION_WORKERS} workers{ConsoleColors.ENDC}") if SHOW_LOGS else None
+
+    startingTime = time.time()
+    analyzed = 0
+    model_calls = 0
+    failures = 0
+    with ThreadPoolExecutor(max_workers=max(1, ESTIMATION_WORKERS)) as pool:
+        futures = {pool.submit(analyze_batch, [pending[key][0].function_body for key in batch]): batch for batch in batches}
+        for future in as_completed(futures):
+            batch = futures[future]
+            results, calls = future.result()
+            model_calls += calls
+            for key, (isSuccess, time_complexity) in zip(batch, results):
+                cache.put(key, isSuccess, time_complexity)
+                for func in pending[key]:
+                    apply_cost(func, isSuccess, time_complexity)
+                func = pending[key][0]
+                if isSuccess:
+                    print(
+                        f"{ConsoleColors.OKGREEN}{func.function_name}: time complexity {func.getTimeComplexity()}{ConsoleColors.ENDC}") if SHOW_LOGS else None
+                else:
+                    failures += 1
+                    print(
+                        f"{ConsoleColors.FAIL}{func.function_name}: failed to analyze time complexity, using the statement count {func.getTotalStatements()}.{ConsoleColors.ENDC}") if SHOW_LOGS else None
+            cache.save()
+
+            analyzed += len(batch)
+            elapsed = time.time() - startingTime
+            functions_per_second = analyzed / elapsed if elapsed > 0 else 0.0
+            calls_per_second = model_calls / elapsed if elapsed > 0 else 0.0
+            approx_eta = (len(keys) - analyzed) / functions_per_second if functions_per_second > 0 else 0.0
+            print(
+                f"{ConsoleColors.HEADER}======================================= [{analyzed}/{len(keys)}] {analyzed / len(keys) * 100:.2f}% | cache hits: {cache_hits} | model calls: {model_calls} ({calls_per_second:.2f}/s) | {functions_per_second:.2f} functions/s | ETA: {format_eta(approx_eta)} ======================================={ConsoleColors.ENDC}") if SHOW_LOGS else None
+
+    elapsed = time.time() - startingTime
     print(
-        f"{ConsoleColors.HEADER}======================================= [{index+1}/{len(functions)}] {(index+1) / len(functions) * 100:.2f}% | ETA: {int(eta_hours):02}:{int(eta_minutes):02}:{int(eta_seconds):02} ======================================={ConsoleColors.ENDC}") if SHOW_LOGS else None
-    if limit and index == 2:
-        break
+        f"{ConsoleColors.OKCYAN}Estimated {len(functions)} functions in {elapsed:.2f} seconds: {cache_hits} cache hits, {len(keys)} analyzed, {failures} fell back to statement counts, {model_calls} model calls{ConsoleColors.ENDC}") if SHOW_LOGS else None
+
+
+def load_profiles(paths):
+    """
+    Merges profiles written by the runtime's exit() in a -DOBFUSCATION_PROFILE
+    build. Returns {function: {"calls", "ns", "histogram"}} with the histogram in
+    log2 buckets of nanoseconds.
+    """
+    profile = {}
+    for path in paths:
+        with open(path, "r", encoding="utf-8") as file:
+            lines = file.read().splitlines()
+        if not lines or lines[0] not in ("obfuscation-profile 1", "obfuscation-profile 2"):
+            raise ValueError(f"{path} is not an obfuscation profile")
+        ticks_per_ns = 1.0
+        for line in lines[1:]:
+            fields = line.split()
+            if fields[0] == "ticks_per_ns":
+                ticks_per_ns = float(fields[1]) or 1.0
+                continue
+            if fields[0].startswith("@"):  # runtime-wide rows such as @dispatch
+                continue
+            entry = profile.setdefault(fields[0], {"calls": 0, "ns": 0.0, "histogram": {}})
+            entry["calls"] += int(fields[1])
+            entry["ns"] += int(fields[2]) / ticks_per_ns
+            for bucket, count in enumerate(map(int, fields[3:])):
+                if count:
+                    bucket_ns = (1 << bucket) / ticks_per_ns
+                    entry["histogram"][bucket_ns] = entry["histogram"].get(bucket_ns, 0) + count
+    return profile
+
+
+def histogram_percentile(histogram, fraction):
+    total = sum(histogram.values())
+    seen = 0
+    for bucket_ns in sorted(histogram):
+        seen += histogram[bucket_ns]
+        if seen >= fraction * total:
+            return bucket_ns * 2  # upper bound of the bucket
+    return 0.0
+
+
+def apply_profile(functions, profile):
+    """Replaces the cost of every function the profile saw with its mean measured time."""
+    measured = 0
+    for func in functions:
+        entry = profile.get(func.getFunctionNameWithParams())
+        if not entry or entry["calls"] == 0:
+            continue
+        mean_ns = entry["ns"] / entry["calls"]
+        func.setTimeComplexity(str(max(1, round(mean_ns / PROFILE_NS_PER_COST_UNIT))))
+        func.profiled = True
+        measured += 1
+        print(
+            f"{ConsoleColors.OKGREEN}{func.getFunctionNameWithParams()}: {entry['calls']} calls, mean {mean_ns:.0f} ns, p50 < {histogram_percentile(entry['histogram'], 0.5):.0f} ns, p99 < {histogram_percentile(entry['histogram'], 0.99):.0f} ns -> cost {func.getTimeComplexity()}{ConsoleColors.ENDC}") if SHOW_LOGS else None
+    print(
+        f"{ConsoleColors.OKCYAN}Profile: measured costs for {measured}/{len(functions)} functions{ConsoleColors.ENDC}") if SHOW_LOGS else None
+
+
+def cluster_call_graph(functions, groups):
+    """
+    Splits the static call graph into communities (Louvain, on edges weighted by how
+    often one function calls the other, awaited calls counting AFFINITY_AWAITED_WEIGHT)
+    and spreads them over at most `groups` worker groups, largest first onto the
+    emptiest group. Sets func.affinity_group and returns the number of groups used;
+    0 when affinity is off or networkx is missing.
+    """
+    for func in functions:
+        func.affinity_group = 0
+    if groups <= 1:
+        return 0
+    try:
+        import networkx
+        from networkx.algorithms import community
+    except ImportError:
+        print(f"{ConsoleColors.WARNING}networkx is not installed; call-graph affinity is off{ConsoleColors.ENDC}")
+        return 0
+
+    graph = networkx.Graph()
+    graph.add_nodes_from(func.getFunctionNameWithParams() for func in functions)
+    for func in functions:
+        caller = func.getFunctionNameWithParams()
+        for callee, awaited in func.callees:
+            if callee == caller or callee not in graph:
+                continue
+            weight = AFFINITY_AWAITED_WEIGHT if awaited else 1
+            if graph.has_edge(caller, callee):
+                graph[caller][callee]["weight"] += weight
+            else:
+                graph.add_edge(caller, callee, weight=weight)
+
+    if hasattr(community, "louvain_communities"):
+        communities = community.louvain_communities(graph, weight="weight", seed=1)
+    else:
+        communities = community.greedy_modularity_communities(graph, weight="weight")
+
+    sizes = [0] * min(groups, len(communities))
+    group_of = {}
+    for members in sorted(communities, key=lambda members: (-len(members), min(members))):
+        group = sizes.index(min(sizes))
+        sizes[group] += len(members)
+        for name in members:
+            group_of[name] = group
+    for func in functions:
+        func.affinity_group = group_of[func.getFunctionNameWithParams()]
+    print(
+        f"{ConsoleColors.OKCYAN}Affinity: {len(communities)} call-graph communities in {len(sizes)} worker groups of {sizes} functions{ConsoleColors.ENDC}") if SHOW_LOGS else None
+    return len(sizes)
+
+
+functions = extract_all_functions_from_project(SOURCE_FOLDER)
+estimate_costs(functions)
+if PROFILE_PATHS:
+    apply_profile(functions, load_profiles(PROFILE_PATHS))
+affinity_groups = cluster_call_graph(functions, RUNTIME_AFFINITY_GROUPS)
 
 
 def saveAsCppFile(functions):
@@ -266,7 +564,10 @@ inline const std::unordered_map<std::string, std::string> cppFunctionsMap = {
     print(f"{ConsoleColors.OKCYAN}Generating HashMap...{ConsoleColors.ENDC}") if SHOW_LOGS else None
     unique_functions = {}
     function_names_set = set()
+    profiled_set = set()
     for func in functions:
+        if func.profiled:
+            profiled_set.add(func.getFunctionNameWithParams())
         key = func.getFunctionNameWithParams()
         if key not in unique_functions:
             complexity = func.getTimeComplexity() if func.getTimeComplexity(
@@ -286,10 +587,20 @@ inline const std::unordered_set<std::string> cppFunctionNamesSet = {
     for name in function_names_set:
         header_content += f'    "{name}",\n'
 
+    header_content += '''\
+};
+
+// Functions whose cost above was measured by a profiling run rather than estimated.
+inline const std::unordered_set<std::string> cppProfiledFunctionsSet = {
+'''
+    for name in sorted(profiled_set):
+        header_content += f'    "{name}",\n'
+
     header_content += '};\n\n'
+    header_content += f'inline constexpr bool useCoroutines = {"true" if USE_COROUTINES else "false"};\n\n'
     header_content += '#endif\n'
 
-    output_folder = "../Obfuscator"
+    output_folder = TABLE_FOLDER
     os.makedirs(output_folder, exist_ok=True)
     output_file_path = os.path.join(output_folder, "cpp_functions.h")
     with open(output_file_path, "w", encoding="utf-8") as header_file:
@@ -301,23 +612,28 @@ inline const std::unordered_set<std::string> cppFunctionNamesSet = {
 saveAsCppFile(functions)
 
 
+def cost_function(func):
+    """The generated <function>_cost: the function's cost expression over the arguments of a call."""
+    name = func.getFunctionNameWithParams()
+    expression = func.getTimeComplexity() if func.getTimeComplexity() is not None else str(func.getTotalStatements())
+    used = [param for param in func.params if param.name in cost_names(expression)]
+    code = f'inline int {name}_cost(const {name}_values &{"task_params" if used else ""})\n{{\n'
+    for param in used:
+        code += f'    const auto &{param.name} = task_params.{param.name};\n'
+    return code + f'    return clampCost({expression});\n}}\n\n'
+
+
 def saveObfuscatorHppFile(functions):
     print(f"{ConsoleColors.OKCYAN}Saving Obfuscator header file...{ConsoleColors.ENDC}") if SHOW_LOGS else None
     header_content = '''\
 #ifndef OBFUSCATOR_H
 #define OBFUSCATOR_H
 
-#include <queue>
-#include <atomic>
-#include <mutex>
-#include <condition_variable>
-#include <vector>
-#include <random>
-#include <thread>
-
-using namespace std;
-
-constexpr int OBFUSCATION_THREADS = 2;
+'''
+    if USE_COROUTINES:
+        header_content += '#define OBFUSCATION_COROUTINES\n'
+    header_content += '''\
+#include "obfuscation_runtime.hpp"
 
 enum FunctionID
 {
@@ -325,6 +641,7 @@ enum FunctionID
     for func in functions:
         header_content += f'    {func.getFunctionNameWithParams()}_enumidx,\n'
     header_content += '''\
+    FUNCTION_COUNT
 };
 '''
     for func in functions:
@@ -337,60 +654,103 @@ struct'''
         for param in func.params:
             header_content += f'    {param.type} {param.name};\n'
         if func.return_type:
-            header_content += f'    int return_var;\n'
-        header_content += f'    bool {func.getFunctionNameWithParams()}_done;\n'
+            header_content += f'    CallResult *result;\n'
         header_content += '''\
 };
 
 '''
 
-    for func in functions:
-        header_content += f'''\
-extern queue<int> {func.getFunctionNameWithParams()}_params_index_pool;
-'''
-    header_content += f'''\
+    header_content += '''\
 
+// Estimated cost of a call: the function's cppFunctionsMap expression over the
+// call's arguments. Call sites priced from the table evaluate it at every dispatch.
 '''
     for func in functions:
-        header_content += f'''\
-extern vector<{func.getFunctionNameWithParams()}_values> {func.getFunctionNameWithParams()}_params;
-'''
-    header_content += f'''\
+        header_content += cost_function(func)
 
-extern thread threads[OBFUSCATION_THREADS];
-extern queue<pair<int, int>> queues[OBFUSCATION_THREADS];
-extern mutex mutexes[OBFUSCATION_THREADS];
-extern condition_variable conditions[OBFUSCATION_THREADS];
+    header_content += f'''\
+// The runtime this program is built against, and its function registry
+// (defined in obfuscator.cpp).
+struct ProgramConfig : RuntimeDefaults
+{{
+    template <typename T>
+    using Queue = {RUNTIME_QUEUE}<T>;
+    using Policy = {RUNTIME_POLICY};
+    using Idle = {RUNTIME_IDLE};
+    static constexpr int WORKERS = {RUNTIME_WORKERS};
+    static constexpr bool ADAPTIVE_LOAD = {str(RUNTIME_ADAPTIVE_LOAD).lower()};
+    static constexpr bool EARLIEST_FINISH = {str(RUNTIME_EARLIEST_FINISH).lower()};
+    static constexpr bool PRIORITIES = {str(RUNTIME_PRIORITIES).lower()};
+
+    static constexpr int FUNCTIONS = FUNCTION_COUNT;
+    static const char *functionName(int funcId);
+    static void releaseArenas();
+
+    // Call-graph community of each function: its tasks prefer that worker group.
+    static constexpr int AFFINITY_GROUPS = {affinity_groups};
+    static int affinityGroup(int funcId)
+    {{
+        static constexpr int groups[FUNCTION_COUNT] = {{{", ".join(str(func.affinity_group) for func in functions)}}};
+        return groups[funcId];
+    }}
+}};
+
+using ProgramRuntime = ObfuscationRuntime<ProgramConfig>;
+using TaskBatch = BasicTaskBatch<ProgramRuntime>;
+
+// What the rewritten code calls.
+inline void initialize() {{ ProgramRuntime::initialize(); }}
+inline void exit() {{ ProgramRuntime::exit(); }}
+inline int currentWorker() {{ return ProgramRuntime::currentWorker(); }}
+inline bool execute(int thread_idx) {{ return ProgramRuntime::execute(thread_idx); }}
+inline void submitTask(const Task &task) {{ ProgramRuntime::submitTask(task); }}
+inline void submitAwaitedTask(const Task &task) {{ ProgramRuntime::submitAwaitedTask(task); }}
+inline bool runInline(int cost) {{ return ProgramRuntime::runInline(cost); }}
+inline bool runInlineRecursive(int cost) {{ return ProgramRuntime::runInlineRecursive(cost); }}
+
+template <auto Function>
+inline Task makeTask(int funcId, int cost, CallValues<Function> args)
+{{
+    return ProgramRuntime::makeTask<Function>(funcId, cost, std::move(args));
+}}
 
-extern bool stopThreads;
-extern mutex stopMutex;
+'''
+    if USE_COROUTINES:
+        header_content += '''\
+inline CallAwaiter<ProgramRuntime> awaitCall(const Task &task)
+{
+    return CallAwaiter<ProgramRuntime>{task, {}};
+}
 
-extern atomic<int> g_inFlightTasks;
-extern condition_variable g_allTasksDoneCV;
-extern mutex g_allTasksDoneMtx;
+inline void resumeInline(ObfTask job, int funcId, int thread_idx)
+{
+    ProgramRuntime::resumeInline(job, funcId, thread_idx);
+}
 
-extern std::atomic<int> *vec;
+'''
+    else:
+        header_content += '''\
+using TaskGroup = BasicTaskGroup<ProgramRuntime>;
 
-void initialize();
-void exit();
-void taskFinished();
-int getBalancedRandomIndex();
-void pushToThread(int funcId, int line_no, int param_index);
-void execute(int thread_idx);
-void threadFunction(int thread_idx);
+template <typename Body>
+inline void parallelFor(int funcId, long begin, long end, int cost, Body body)
+{
+    ProgramRuntime::parallelFor(funcId, begin, end, cost, std::move(body));
+}
 
 '''
     for func in functions:
         header_content += f'''\
-void {func.getFunctionNameWithParams()}(int thread_idx, int param_index);
+{"ObfTask" if USE_COROUTINES else "void"} {func.getFunctionNameWithParams()}(int thread_idx, {func.getFunctionNameWithParams()}_values task_params);
 '''
 
     header_content += '\n#endif\n'
-    output_folder = "../Input"
+    output_folder = SOURCE_FOLDER
     os.makedirs(output_folder, exist_ok=True)
     output_file_path = os.path.join(output_folder, "obfuscator.hpp")
     with open(output_file_path, "w", encoding="utf-8") as header_file:
         header_file.write(header_content)
+    shutil.copy(RUNTIME_LIBRARY, output_folder)
 
     print(f"{ConsoleColors.OKGREEN}Obfuscator header file saved successfully at {output_file_path}{ConsoleColors.ENDC}") if SHOW_LOGS else None
 
@@ -401,182 +761,30 @@ saveObfuscatorHppFile(functions)
 def saveObfuscatorCppFile(functions):
     print(f"{ConsoleColors.OKCYAN}Saving Obfuscator cpp file...{ConsoleColors.ENDC}") if SHOW_LOGS else None
     header_content = '''\
-#include <algorithm>
 #include "obfuscator.hpp"
 
-thread threads[OBFUSCATION_THREADS];
-
-queue<pair<int, int>> queues[OBFUSCATION_THREADS];
-mutex mutexes[OBFUSCATION_THREADS];
-condition_variable conditions[OBFUSCATION_THREADS];
-
-bool stopThreads = false;
-mutex stopMutex;
-
-atomic<int> g_inFlightTasks{0};
-condition_variable g_allTasksDoneCV;
-mutex g_allTasksDoneMtx;
-
-'''
-    for func in functions:
-        header_content += f'''\
-queue<int> {func.getFunctionNameWithParams()}_params_index_pool;
-'''
-    header_content += f'''\
-
+static const char *const functionNames[FUNCTION_COUNT] = {
 '''
     for func in functions:
-        header_content += f'''\
-vector<{func.getFunctionNameWithParams()}_values> {func.getFunctionNameWithParams()}_params;
-'''
+        header_content += f'    "{func.getFunctionNameWithParams()}",\n'
     header_content += '''\
+};
 
-std::atomic<int> *vec;
-
-std::random_device rd;
-std::mt19937 rng(rd());
-
-void initialize()
-{
-    vec = new std::atomic<int>[OBFUSCATION_THREADS];
-    for (int i = 0; i < OBFUSCATION_THREADS; i++)
-    {
-        vec[i].store(0);
-    }
-
-    for (int i = 0; i < OBFUSCATION_THREADS; i++)
-    {
-        threads[i] = thread(threadFunction, i);
-    }
-}
-
-void exit()
-{
-    unique_lock<mutex> lock(g_allTasksDoneMtx);
-    g_allTasksDoneCV.wait(lock, []
-                          { return g_inFlightTasks.load() == 0; });
-
-    {
-        lock_guard<mutex> stopLock(stopMutex);
-        stopThreads = true;
-    }
-
-    for (int i = 0; i < OBFUSCATION_THREADS; i++)
-    {
-        conditions[i].notify_all();
-        threads[i].join();
-    }
-}
-
-int getBalancedRandomIndex()
-{
-    double sum = 0;
-    std::vector<int> values(OBFUSCATION_THREADS);
-
-    for (int i = 0; i < OBFUSCATION_THREADS; i++)
-    {
-        values[i] = vec[i].load();
-        sum += values[i];
-    }
-
-    double avg = sum / OBFUSCATION_THREADS;
-    double threshold = avg * 0.8;
-
-    std::vector<int> candidateIndices;
-
-    for (int i = 0; i < OBFUSCATION_THREADS; i++)
-    {
-        if (values[i] <= threshold)
-        {
-            candidateIndices.push_back(i);
-        }
-    }
-
-    if (candidateIndices.empty())
-    {
-        std::vector<int> sortedValues = values;
-        std::sort(sortedValues.begin(), sortedValues.end());
-        int median = sortedValues[OBFUSCATION_THREADS / 2];
-
-        for (int i = 0; i < OBFUSCATION_THREADS; i++)
-        {
-            if (values[i] <= median)
-            {
-                candidateIndices.push_back(i);
-            }
-        }
-    }
-
-    std::uniform_int_distribution<int> dist(0, candidateIndices.size() - 1);
-    return candidateIndices[dist(rng)];
-}
-
-void pushToThread(int funcId, int line_no, int param_index)
-{
-    int thread_idx = getBalancedRandomIndex();
-    {
-        lock_guard<mutex> lock(mutexes[thread_idx]);
-        queues[thread_idx].emplace(funcId, param_index);
-        vec[thread_idx].fetch_add(line_no);
-        g_inFlightTasks++;
-    }
-    conditions[thread_idx].notify_one();
-}
-
-void taskFinished()
+const char *ProgramConfig::functionName(int funcId)
 {
-    int remaining = --g_inFlightTasks;
-    if (remaining == 0)
-    {
-        unique_lock<mutex> lock(g_allTasksDoneMtx);
-        g_allTasksDoneCV.notify_all();
-    }
+    return functionNames[funcId];
 }
 
-void execute(int thread_idx)
+void ProgramConfig::releaseArenas()
 {
-    if (queues[thread_idx].empty())
-        return;
-
-    pair<int, int> func_info;
-    {
-        lock_guard<mutex> lock(mutexes[thread_idx]);
-        func_info = queues[thread_idx].front();
-        queues[thread_idx].pop();
-    }
-
-    switch (func_info.first)
-    {
 '''
     for func in functions:
-        header_content += f'    case {func.getFunctionNameWithParams()}_enumidx:\n'
-        header_content += f'        {func.getFunctionNameWithParams()}(thread_idx, func_info.second);\n'
-        header_content += '        break;\n'
+        header_content += f'    shrinkParamArena<{func.getFunctionNameWithParams()}_values>();\n'
     header_content += '''\
-    }
-
-    taskFinished();
-}
-
-void threadFunction(int thread_idx)
-{
-    while (true)
-    {
-        {
-            unique_lock<mutex> lock(mutexes[thread_idx]);
-            conditions[thread_idx].wait(lock, [&]
-                                        { return !queues[thread_idx].empty() || stopThreads; });
-        }
-
-        if (stopThreads && queues[thread_idx].empty())
-            break;
-        execute(thread_idx);
-    }
 }
 '''
 
-    header_content += '\n'
-    output_folder = "../Input"
+    output_folder = SOURCE_FOLDER
     os.makedirs(output_folder, exist_ok=True)
     output_file_path = os.path.join(output_folder, "obfuscator.cpp")
     with open(output_file_path, "w", encoding="utf-8") as header_file:
@@ -0,0 +1,32 @@
+"""
+Deterministic stand-in for the LLM in time_complexity_analyzer.py, selected with
+ESTIMATION_MODEL=stub. It needs no model file, which makes it useful for tests,
+dry runs and for measuring the estimation pipeline itself. The cost it returns
+is the number of statements, scaled by 10 for every loop keyword.
+"""
+import os
+import re
+import time
+
+model_name = "stub"
+
+# Seconds each model call sleeps, to mimic LLM latency when timing the worker pool.
+STUB_MODEL_DELAY = float(os.environ.get("STUB_MODEL_DELAY", "0"))
+
+_loop_keyword = re.compile(r'\b(for|while)\b')
+
+
+def estimate(cpp_function: str) -> int:
+    statements = max(1, cpp_function.count(';'))
+    loops = len(_loop_keyword.findall(cpp_function))
+    return statements * 10 ** min(loops, 3)
+
+
+def analyze_time_complexity(cpp_function: str, report: str = "") -> tuple:
+    time.sleep(STUB_MODEL_DELAY)
+    return True, str(estimate(cpp_function))
+
+
+def analyze_time_complexity_batch(cpp_functions: list) -> list:
+    time.sleep(STUB_MODEL_DELAY)
+    return [(True, str(estimate(body))) for body in cpp_functions]
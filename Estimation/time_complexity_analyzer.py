@@ -1,16 +1,27 @@
 import json
+import threading
 from langchain_community.llms import LlamaCpp
 from langchain.output_parsers import StructuredOutputParser, ResponseSchema
 
 model_path = "./Model/DeepSeek-Coder-V2-Lite-Instruct-Q4_K_M.gguf"
+model_name = "DeepSeek-Coder-V2-Lite-Instruct-Q4_K_M"
+
+# A llama.cpp context cannot serve two prompts at once, so every estimation
+# worker thread loads its own instance on first use.
+_thread_state = threading.local()
+
+
+def get_llm():
+    if not hasattr(_thread_state, "llm"):
+        _thread_state.llm = LlamaCpp(
+            model_path=model_path,
+            n_ctx=13107,
+            n_gpu_layers=20,
+            verbose=False,
+            temperature=0.0
+        )
+    return _thread_state.llm
 
-llm = LlamaCpp(
-    model_path=model_path,
-    n_ctx=13107,
-    n_gpu_layers=20,
-    verbose=False,
-    temperature=0.0
-)
 
 response_schemas = [
     ResponseSchema(
@@ -102,23 +113,96 @@ def analyze_time_complexity(cpp_function: str, report: str = "") -> tuple:
             f"Previously you tried this with the same provided cpp function and it was not valid expression, I got this error and response: {report}. So this time make sure the output is a valid cpp expression."
 
     try:
-        response = llm(prompt)
+        response = get_llm()(prompt)
     except Exception as e:
         print("Error generating response:", e)
         return False, {"error": str(e), "response": ""}
 
     try:
-        txt = response.split("}")
-        txt = response.split("}")[-2].strip()
-        txt = txt.split("{")[-1].strip()
-        txt = f'```json\n{{{txt}}}\n```'
-        parsed_output = output_parser.parse(txt)
+        parsed_output = output_parser.parse(extract_json_block(response))
         return True, parsed_output["time_complexity_calculation"]
     except Exception as e:
         print("Error parsing structured output:", e)
         return False, {"error": str(e), "response": response}
 
 
+def extract_json_block(response: str) -> str:
+    txt = response.split("}")[-2].strip()
+    txt = txt.split("{")[-1].strip()
+    return f'```json\n{{{txt}}}\n```'
+
+
+_batch_parsers = {}
+
+
+def get_batch_parser(count: int) -> StructuredOutputParser:
+    if count not in _batch_parsers:
+        _batch_parsers[count] = StructuredOutputParser.from_response_schemas([
+            ResponseSchema(
+                name=f"time_complexity_calculation_{i + 1}",
+                type="code",
+                description=f"The expression for function {i + 1}. " + response_schemas[0].description
+            )
+            for i in range(count)
+        ])
+    return _batch_parsers[count]
+
+
+def analyze_time_complexity_batch(cpp_functions: list) -> list:
+    """
+    Analyzes several functions with one prompt. Returns one (isSuccess, result)
+    pair per function, in order; a function the model skipped or answered with
+    an empty expression comes back as a failure so the caller can retry it alone.
+    """
+    if len(cpp_functions) == 1:
+        return [analyze_time_complexity(cpp_functions[0])]
+
+    parser = get_batch_parser(len(cpp_functions))
+    numbered = "\n".join(
+        f"    // Function {i + 1}:\n    {body}\n" for i, body in enumerate(cpp_functions))
+    prompt = f"""
+    You are an AI that generates valid C++ expressions representing the estimated time needed to run given functions.
+    For each function, the expression should be such that when used in the code:
+        int timeNeedToRun = (expression);
+    it evaluates to an integer representing the approximate number of basic operations, assuming each operation takes 1 unit of time.
+    You do not reply the time complexity in Big O notation, but rather as a concrete expression.
+    Each expression may only use the parameters of its own function.
+    If there are other function or method calls in a function, you can use 1 as a placeholder for their time complexity.
+    If you cannot determine the time complexity directly, return the number of statements in the function body.
+    If a function contains recursion, consider it as a nested operation and explain it accordingly.
+    Below are several examples demonstrating the expected output for a single function:
+    {examples}
+
+    Now, analyze the following {len(cpp_functions)} C++ functions and provide one expression per function following these format instructions exactly:
+    {parser.get_format_instructions()}
+    C++ functions to analyze:
+{numbered}
+    """
+
+    try:
+        response = get_llm()(prompt)
+    except Exception as e:
+        print("Error generating response:", e)
+        return [(False, {"error": str(e), "response": ""})] * len(cpp_functions)
+
+    try:
+        parsed_output = json.loads(extract_json_block(response)[len("```json\n"):-len("\n```")])
+    except Exception as e:
+        print("Error parsing structured output:", e)
+        return [(False, {"error": str(e), "response": response})] * len(cpp_functions)
+
+    results = []
+    for i in range(len(cpp_functions)):
+        value = parsed_output.get(f"time_complexity_calculation_{i + 1}")
+        if isinstance(value, (int, float)):
+            value = str(value)
+        if isinstance(value, str) and value.strip():
+            results.append((True, value.strip()))
+        else:
+            results.append((False, {"error": "missing expression", "response": response}))
+    return results
+
+
 # test_cpp_function = """
 # void function1(const std::vector<int> &v)
 # {
@@ -1,17 +1,7 @@
 #ifndef OBFUSCATOR_H
 #define OBFUSCATOR_H
 
-#include <queue>
-#include <atomic>
-#include <mutex>
-#include <condition_variable>
-#include <vector>
-#include <random>
-#include <thread>
-
-using namespace std;
-
-constexpr int OBFUSCATION_THREADS = 2;
+#include "obfuscation_runtime.hpp"
 
 enum FunctionID
 {
@@ -20,20 +10,19 @@ enum FunctionID
     funcE_ii_enumidx,
     funcC_enumidx,
     funcA_enumidx,
+    FUNCTION_COUNT
 };
 
 struct funcD_ii_values
 {
     int a;
     int b;
-    int return_var;
-    bool funcD_ii_done;
+    CallResult *result;
 };
 
 
 struct funcB_values
 {
-    bool funcB_done;
 };
 
 
@@ -41,60 +30,104 @@ struct funcE_ii_values
 {
     int a;
     int b;
-    int return_var;
-    bool funcE_ii_done;
+    CallResult *result;
 };
 
 
 struct funcC_values
 {
-    bool funcC_done;
 };
 
 
 struct funcA_values
 {
-    bool funcA_done;
 };
 
-extern queue<int> funcD_ii_params_index_pool;
-extern queue<int> funcB_params_index_pool;
-extern queue<int> funcE_ii_params_index_pool;
-extern queue<int> funcC_params_index_pool;
-extern queue<int> funcA_params_index_pool;
-
-extern vector<funcD_ii_values> funcD_ii_params;
-extern vector<funcB_values> funcB_params;
-extern vector<funcE_ii_values> funcE_ii_params;
-extern vector<funcC_values> funcC_params;
-extern vector<funcA_values> funcA_params;
-
-extern thread threads[OBFUSCATION_THREADS];
-extern queue<pair<int, int>> queues[OBFUSCATION_THREADS];
-extern mutex mutexes[OBFUSCATION_THREADS];
-extern condition_variable conditions[OBFUSCATION_THREADS];
-
-extern bool stopThreads;
-extern mutex stopMutex;
-
-extern atomic<int> g_inFlightTasks;
-extern condition_variable g_allTasksDoneCV;
-extern mutex g_allTasksDoneMtx;
-
-extern std::atomic<int> *vec;
-
-void initialize();
-void exit();
-void taskFinished();
-int getBalancedRandomIndex();
-void pushToThread(int funcId, int line_no, int param_index);
-void execute(int thread_idx);
-void threadFunction(int thread_idx);
-
-void funcD_ii(int thread_idx, int param_index);
-void funcB(int thread_idx, int param_index);
-void funcE_ii(int thread_idx, int param_index);
-void funcC(int thread_idx, int param_index);
-void funcA(int thread_idx, int param_index);
+
+// Estimated cost of a call: the function's cppFunctionsMap expression over the
+// call's arguments. Call sites priced from the table evaluate it at every dispatch.
+inline int funcD_ii_cost(const funcD_ii_values &)
+{
+    return clampCost(4);
+}
+
+inline int funcB_cost(const funcB_values &)
+{
+    return clampCost(2 + 1 + 2 + 1);
+}
+
+inline int funcE_ii_cost(const funcE_ii_values &)
+{
+    return clampCost(3);
+}
+
+inline int funcC_cost(const funcC_values &)
+{
+    return clampCost(2 + 3);
+}
+
+inline int funcA_cost(const funcA_values &)
+{
+    return clampCost(4);
+}
+
+// The runtime this program is built against, and its function registry
+// (defined in obfuscator.cpp).
+struct ProgramConfig : RuntimeDefaults
+{
+    template <typename T>
+    using Queue = WorkStealingDeque<T>;
+    using Policy = PowerOfTwoChoicesPolicy;
+    using Idle = SpinYieldParkIdle;
+    static constexpr int WORKERS = 0;
+    static constexpr bool ADAPTIVE_LOAD = false;
+    static constexpr bool EARLIEST_FINISH = false;
+    static constexpr bool PRIORITIES = true;
+
+    static constexpr int FUNCTIONS = FUNCTION_COUNT;
+    static const char *functionName(int funcId);
+    static void releaseArenas();
+
+    // Call-graph community of each function: its tasks prefer that worker group.
+    static constexpr int AFFINITY_GROUPS = 0;
+    static int affinityGroup(int funcId)
+    {
+        static constexpr int groups[FUNCTION_COUNT] = {0, 0, 0, 0, 0};
+        return groups[funcId];
+    }
+};
+
+using ProgramRuntime = ObfuscationRuntime<ProgramConfig>;
+using TaskBatch = BasicTaskBatch<ProgramRuntime>;
+
+// What the rewritten code calls.
+inline void initialize() { ProgramRuntime::initialize(); }
+inline void exit() { ProgramRuntime::exit(); }
+inline int currentWorker() { return ProgramRuntime::currentWorker(); }
+inline bool execute(int thread_idx) { return ProgramRuntime::execute(thread_idx); }
+inline void submitTask(const Task &task) { ProgramRuntime::submitTask(task); }
+inline void submitAwaitedTask(const Task &task) { ProgramRuntime::submitAwaitedTask(task); }
+inline bool runInline(int cost) { return ProgramRuntime::runInline(cost); }
+inline bool runInlineRecursive(int cost) { return ProgramRuntime::runInlineRecursive(cost); }
+
+template <auto Function>
+inline Task makeTask(int funcId, int cost, CallValues<Function> args)
+{
+    return ProgramRuntime::makeTask<Function>(funcId, cost, std::move(args));
+}
+
+using TaskGroup = BasicTaskGroup<ProgramRuntime>;
+
+template <typename Body>
+inline void parallelFor(int funcId, long begin, long end, int cost, Body body)
+{
+    ProgramRuntime::parallelFor(funcId, begin, end, cost, std::move(body));
+}
+
+void funcD_ii(int thread_idx, funcD_ii_values task_params);
+void funcB(int thread_idx, funcB_values task_params);
+void funcE_ii(int thread_idx, funcE_ii_values task_params);
+void funcC(int thread_idx, funcC_values task_params);
+void funcA(int thread_idx, funcA_values task_params);
 
 #endif
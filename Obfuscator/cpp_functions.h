@@ -22,4 +22,10 @@ inline const std::unordered_set<std::string> cppFunctionNamesSet = {
     "funcA",
 };
 
+// Functions whose cost above was measured by a profiling run rather than estimated.
+inline const std::unordered_set<std::string> cppProfiledFunctionsSet = {
+};
+
+inline constexpr bool useCoroutines = false;
+
 #endif
@@ -1,17 +1,34 @@
 #include <clang/AST/AST.h>
+#include <clang/AST/ParentMapContext.h>
 #include <clang/AST/RecursiveASTVisitor.h>
 #include <clang/Frontend/CompilerInstance.h>
 #include <clang/Frontend/FrontendActions.h>
+#include <clang/Lex/PPCallbacks.h>
+#include <clang/Lex/Preprocessor.h>
 #include <clang/Tooling/Tooling.h>
 #include <clang/ASTMatchers/ASTMatchFinder.h>
 #include <clang/Tooling/CommonOptionsParser.h>
 #include <clang/Rewrite/Core/Rewriter.h>
 #include <llvm/Support/CommandLine.h>
+#include <llvm/Support/VirtualFileSystem.h>
 
 #include "cpp_functions.h"
 
 #include <iostream>
 #include <filesystem>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <optional>
+#include <sstream>
+#include <mutex>
+#include <set>
+#include <thread>
 #include <vector>
 #include <string>
 
@@ -21,6 +38,705 @@ using namespace clang::ast_matchers;
 
 namespace fs = std::filesystem;
 
+static llvm::cl::OptionCategory MyToolCategory("my-tool options");
+
+// How a global is synchronized in rewritten code. Decided once per program from
+// every access seen across all input files (see GlobalUsageCollector).
+enum class GlobalSync { None, Atomic, Locked };
+
+// How one expression uses a global.
+enum class GlobalAccess { Read, Store, AtomicRMW, Other };
+
+struct GlobalUsage {
+    bool written = false;
+    bool needsLock = false;
+};
+
+// Merged from every file's record once the usage pass is done; only read while rewriting.
+static std::map<std::string, GlobalUsage> globalUsage;
+
+static llvm::cl::opt<std::string> CostModel("cost-model",
+    llvm::cl::desc("Where dispatch costs come from: 'auto' (measured costs from cppFunctionsMap where a profile "
+                   "provided them, static costs scaled to the same unit otherwise; default), 'static' (derived from the "
+                   "source) or 'table' (cppFunctionsMap, evaluated over each call's arguments)"),
+    llvm::cl::init("auto"), llvm::cl::cat(MyToolCategory));
+
+// Static cost of one function: an expression in which "$<n>" stands for the
+// function's n-th parameter, plus the parameter names so the placeholders can be
+// bound to the call's argument struct at a call site (see renderCost).
+struct StaticCost {
+    std::vector<std::string> params;
+    std::string expression;
+};
+
+// Filled from every file's record once the usage pass is done, keyed by rewritten name.
+static std::map<std::string, StaticCost> staticCosts;
+
+// Cost units per static operation. Static costs count operations, while measured
+// costs are in units of PROFILE_NS_PER_COST_UNIT nanoseconds; with --cost-model=auto
+// and a profile, calibrateStaticCosts() sets this so both are in the measured unit
+// and the runtime's one inline threshold compares like with like.
+static double staticCostScale = 1.0;
+
+static std::string staticCostScaleText() {
+    char text[32];
+    std::snprintf(text, sizeof(text), "%.17g", staticCostScale);
+    return text;
+}
+
+// What the tool knows about one input file, either from this run or from the
+// rewrite cache. Keyed by canonical path; TUs fill their own record from
+// several threads, so access goes through fileRecordsMutex.
+struct FileRecord {
+    std::set<std::string> dependencies;   // user files the TU reads, itself included
+    std::map<std::string, GlobalUsage> usage;
+    std::map<std::string, StaticCost> costs;   // static costs of the dispatched functions it defines
+    std::set<std::string> callees;        // dispatched functions it calls, whose costs its rewrite prints
+    bool usageKnown = false;
+    uint64_t outputKey = 0;
+    std::string output;
+    bool hasOutput = false;
+    bool rewritten = false;               // output produced by Clang in this run
+    bool fresh = false;                   // parsed in this run, so the cache entry must be rewritten
+};
+
+static std::map<std::string, FileRecord> fileRecords;
+static std::mutex fileRecordsMutex;
+
+static std::string canonicalPath(const std::string &path) {
+    std::error_code EC;
+    fs::path canonical = fs::weakly_canonical(path, EC);
+    return EC ? path : canonical.string();
+}
+
+static bool isSyncedGlobal(const VarDecl *VD, const SourceManager &SM) {
+    if (SM.isInSystemHeader(VD->getLocation()))
+        return false;
+    if (VD->getTLSKind() != VarDecl::TLS_None)
+        return false;
+    return VD->getDeclContext()->isTranslationUnit() || VD->hasGlobalStorage();
+}
+
+static bool referencesDecl(const Stmt *S, const ValueDecl *D) {
+    if (!S)
+        return false;
+    if (const auto *DRE = dyn_cast<DeclRefExpr>(S))
+        if (DRE->getDecl() == D)
+            return true;
+    for (const Stmt *Child : S->children())
+        if (referencesDecl(Child, D))
+            return true;
+    return false;
+}
+
+// Classifies the access DRE makes and returns the expression that performs it
+// (the DeclRefExpr itself for reads, the assignment or increment otherwise).
+static GlobalAccess classifyGlobalAccess(ASTContext &Context, const DeclRefExpr *DRE, const Expr *&Access) {
+    Access = DRE;
+    if (DRE->getBeginLoc().isMacroID())
+        return GlobalAccess::Other;
+
+    const Expr *Child = DRE;
+    auto Parents = Context.getParents(*Child);
+    while (!Parents.empty() && Parents[0].get<ParenExpr>()) {
+        Child = Parents[0].get<ParenExpr>();
+        Parents = Context.getParents(*Child);
+    }
+    if (Parents.empty())
+        return GlobalAccess::Other;
+
+    if (const auto *ICE = Parents[0].get<ImplicitCastExpr>()) {
+        return ICE->getCastKind() == CK_LValueToRValue ? GlobalAccess::Read : GlobalAccess::Other;
+    }
+
+    // Atomic read-modify-writes only exist for integers; bool and pointer arithmetic differ.
+    QualType Type = DRE->getDecl()->getType();
+    bool integer = Type->isIntegerType() && !Type->isBooleanType() && !Type->isEnumeralType();
+
+    if (const auto *CAO = Parents[0].get<CompoundAssignOperator>()) {
+        Access = CAO;
+        if (!integer || CAO->getLHS()->IgnoreParens() != DRE)
+            return GlobalAccess::Other;
+        switch (CAO->getOpcode()) {
+        case BO_AddAssign:
+        case BO_SubAssign:
+        case BO_AndAssign:
+        case BO_OrAssign:
+        case BO_XorAssign:
+            return GlobalAccess::AtomicRMW;
+        default:
+            return GlobalAccess::Other;
+        }
+    }
+
+    if (const auto *UO = Parents[0].get<UnaryOperator>()) {
+        Access = UO;
+        return integer && UO->isIncrementDecrementOp() ? GlobalAccess::AtomicRMW : GlobalAccess::Other;
+    }
+
+    if (const auto *BO = Parents[0].get<BinaryOperator>()) {
+        Access = BO;
+        // x = x * 2 reads and writes separately, which an atomic store cannot make indivisible.
+        if (integer && BO->getOpcode() == BO_Assign && BO->getLHS()->IgnoreParens() == DRE &&
+            !referencesDecl(BO->getRHS(), DRE->getDecl()))
+            return GlobalAccess::Store;
+        return GlobalAccess::Other;
+    }
+
+    return GlobalAccess::Other;
+}
+
+// Read-only globals need no synchronization; integer globals that are only
+// loaded, stored and updated with simple read-modify-writes become atomic;
+// everything else takes the global's lock stripe.
+static GlobalSync globalSyncFor(const VarDecl *VD) {
+    if (VD->getType().isConstQualified())
+        return GlobalSync::None;
+    auto it = globalUsage.find(VD->getQualifiedNameAsString());
+    if (it == globalUsage.end() || !it->second.written)
+        return GlobalSync::None;
+    return it->second.needsLock ? GlobalSync::Locked : GlobalSync::Atomic;
+}
+
+// First pass over every input file: records how each global is used so that the
+// rewriting pass can pick the same synchronization for it in every file.
+class GlobalUsageCollector : public RecursiveASTVisitor<GlobalUsageCollector> {
+public:
+    explicit GlobalUsageCollector(ASTContext &C) : Context(C) {}
+
+    bool VisitDeclRefExpr(DeclRefExpr *DRE) {
+        const VarDecl *VD = dyn_cast<VarDecl>(DRE->getDecl());
+        if (!VD || !isSyncedGlobal(VD, Context.getSourceManager()))
+            return true;
+        if (!Context.getSourceManager().isInMainFile(Context.getSourceManager().getExpansionLoc(DRE->getBeginLoc())))
+            return true;
+
+        const Expr *Access;
+        GlobalUsage &usage = usages[VD->getQualifiedNameAsString()];
+        switch (classifyGlobalAccess(Context, DRE, Access)) {
+        case GlobalAccess::Read:
+            break;
+        case GlobalAccess::Store:
+        case GlobalAccess::AtomicRMW:
+            usage.written = true;
+            break;
+        case GlobalAccess::Other:
+            // Address taken, bound to a reference, member access and the like: assume a write.
+            usage.written = true;
+            usage.needsLock = true;
+            break;
+        }
+        return true;
+    }
+
+    bool VisitFunctionDecl(FunctionDecl *Func) {
+        if (Func->doesThisDeclarationHaveABody() && !Func->isDependentContext())
+            definitions.push_back(Func);
+        return true;
+    }
+
+    bool VisitCallExpr(CallExpr *CE) {
+        const SourceManager &SM = Context.getSourceManager();
+        if (CE->getDirectCallee() && SM.isInMainFile(SM.getExpansionLoc(CE->getBeginLoc())))
+            calls.insert(CE->getDirectCallee()->getCanonicalDecl());
+        return true;
+    }
+
+    std::map<std::string, GlobalUsage> usages;
+    std::vector<const FunctionDecl *> definitions;
+    std::set<const FunctionDecl *> calls;
+
+private:
+    ASTContext &Context;
+};
+
+// Costs above this are clamped; the scheduler only needs their relative size.
+constexpr long long COST_CAP = 1LL << 30;
+// Assumed iterations of a loop whose trip count cannot be derived.
+constexpr long long DEFAULT_TRIP_COUNT = 10;
+
+// A cost that is either a folded constant or a symbolic C++ expression.
+struct Cost {
+    bool constant = true;
+    long long value = 0;
+    std::string expr;
+
+    static Cost of(long long v) {
+        Cost c;
+        c.value = std::max(0LL, std::min(v, COST_CAP));
+        return c;
+    }
+
+    static Cost symbolic(std::string e) {
+        Cost c;
+        c.constant = false;
+        c.expr = std::move(e);
+        return c;
+    }
+
+    std::string text() const { return constant ? std::to_string(value) : expr; }
+};
+
+static Cost operator+(const Cost &a, const Cost &b) {
+    if (a.constant && b.constant) return Cost::of(a.value + b.value);
+    if (a.constant && a.value == 0) return b;
+    if (b.constant && b.value == 0) return a;
+    return Cost::symbolic("(" + a.text() + " + " + b.text() + ")");
+}
+
+static Cost operator-(const Cost &a, const Cost &b) {
+    if (a.constant && b.constant) {
+        Cost c;
+        c.value = a.value - b.value;   // may go negative inside a trip count; clamped by tripCount
+        return c;
+    }
+    if (b.constant && b.value == 0) return a;
+    return Cost::symbolic("(" + a.text() + " - " + b.text() + ")");
+}
+
+static Cost operator*(const Cost &a, const Cost &b) {
+    if (a.constant && b.constant) {
+        if (a.value != 0 && b.value > COST_CAP / a.value) return Cost::of(COST_CAP);
+        return Cost::of(a.value * b.value);
+    }
+    if ((a.constant && a.value == 0) || (b.constant && b.value == 0)) return Cost::of(0);
+    if (a.constant && a.value == 1) return b;
+    if (b.constant && b.value == 1) return a;
+    return Cost::symbolic(a.text() + " * " + b.text());
+}
+
+static Cost divide(const Cost &a, long long divisor) {
+    if (divisor == 1) return a;
+    if (a.constant) {
+        Cost c;
+        c.value = a.value / divisor;
+        return c;
+    }
+    return Cost::symbolic("(" + a.text() + ") / " + std::to_string(divisor));
+}
+
+static Cost costMax(const Cost &a, const Cost &b) {
+    if (a.constant && b.constant) return Cost::of(std::max(a.value, b.value));
+    if (a.constant && a.value == 0) return b;
+    if (b.constant && b.value == 0) return a;
+    return Cost::symbolic("std::max<long long>(" + a.text() + ", " + b.text() + ")");
+}
+
+static Cost clampTrip(const Cost &trip) {
+    if (trip.constant) return Cost::of(trip.value);
+    return Cost::symbolic("std::max<long long>(0, " + trip.text() + ")");
+}
+
+// Derives a cost expression for a function body: straight-line code costs one
+// unit per operation, loops multiply their body by a trip count derived from
+// constant, parameter or parameter.size() bounds (DEFAULT_TRIP_COUNT when none
+// can be found), and branches take the more expensive side. Calls count as one
+// operation; dispatched callees are charged when they are pushed.
+class StaticCostModel {
+public:
+    StaticCostModel(ASTContext &Context, const FunctionDecl *Func) : Context(Context), Func(Func) {}
+
+    Cost functionCost() {
+        Cost body = costOf(Func->getBody());
+        return body.constant && body.value < 1 ? Cost::of(1) : body;
+    }
+
+private:
+    ASTContext &Context;
+    const FunctionDecl *Func;
+
+    const ParmVarDecl *asParam(const Expr *E) {
+        if (const auto *DRE = dyn_cast<DeclRefExpr>(E->IgnoreParenImpCasts()))
+            if (const auto *PVD = dyn_cast<ParmVarDecl>(DRE->getDecl()))
+                if (PVD->getDeclContext() == Func)
+                    return PVD;
+        return nullptr;
+    }
+
+    // A loop bound the caller can evaluate: constants, parameters, param.size().
+    std::optional<Cost> boundOf(const Expr *E) {
+        if (!E)
+            return std::nullopt;
+        E = E->IgnoreParenImpCasts();
+        if (!E->isValueDependent()) {
+            Expr::EvalResult Result;
+            if (E->EvaluateAsInt(Result, Context))
+                return Cost::of(Result.Val.getInt().getExtValue());
+        }
+        if (const ParmVarDecl *PVD = asParam(E)) {
+            if (PVD->getType()->isIntegerType())
+                return Cost::symbolic("(long long)$" + std::to_string(PVD->getFunctionScopeIndex()));
+            return std::nullopt;
+        }
+        if (const auto *Call = dyn_cast<CXXMemberCallExpr>(E)) {
+            const CXXMethodDecl *Method = Call->getMethodDecl();
+            if (Method && Call->getNumArgs() == 0 && (Method->getName() == "size" || Method->getName() == "length"))
+                if (const ParmVarDecl *PVD = asParam(Call->getImplicitObjectArgument()))
+                    return Cost::symbolic("(long long)$" + std::to_string(PVD->getFunctionScopeIndex()) + "." +
+                                          Method->getNameAsString() + "()");
+            return std::nullopt;
+        }
+        if (const auto *BO = dyn_cast<BinaryOperator>(E)) {
+            std::optional<Cost> L = boundOf(BO->getLHS()), R = boundOf(BO->getRHS());
+            if (!L || !R)
+                return std::nullopt;
+            switch (BO->getOpcode()) {
+            case BO_Add: return *L + *R;
+            case BO_Sub: return *L - *R;
+            case BO_Mul: return *L * *R;
+            case BO_Div:
+                if (R->constant && R->value > 0) return divide(*L, R->value);
+                return std::nullopt;
+            default: return std::nullopt;
+            }
+        }
+        return std::nullopt;
+    }
+
+    static const VarDecl *referencedVar(const Expr *E) {
+        if (const auto *DRE = dyn_cast<DeclRefExpr>(E->IgnoreParenImpCasts()))
+            return dyn_cast<VarDecl>(DRE->getDecl());
+        return nullptr;
+    }
+
+    // Signed step of `var` in an increment expression, if it is a constant stride.
+    std::optional<long long> stepOf(const Expr *E, const VarDecl *Var) {
+        if (!E)
+            return std::nullopt;
+        E = E->IgnoreParenImpCasts();
+        if (const auto *UO = dyn_cast<UnaryOperator>(E)) {
+            if (UO->isIncrementDecrementOp() && referencedVar(UO->getSubExpr()) == Var)
+                return UO->isIncrementOp() ? 1 : -1;
+            return std::nullopt;
+        }
+        if (const auto *CAO = dyn_cast<CompoundAssignOperator>(E)) {
+            if (referencedVar(CAO->getLHS()) != Var)
+                return std::nullopt;
+            std::optional<Cost> Stride = boundOf(CAO->getRHS());
+            if (!Stride || !Stride->constant || Stride->value == 0)
+                return std::nullopt;
+            if (CAO->getOpcode() == BO_AddAssign) return Stride->value;
+            if (CAO->getOpcode() == BO_SubAssign) return -Stride->value;
+        }
+        return std::nullopt;
+    }
+
+    // Finds the single statement in a loop body that steps `var`.
+    std::optional<long long> stepInBody(const Stmt *S, const VarDecl *Var, int &found) {
+        if (!S)
+            return std::nullopt;
+        std::optional<long long> Result;
+        if (const auto *E = dyn_cast<Expr>(S)) {
+            if (std::optional<long long> Step = stepOf(E, Var)) {
+                ++found;
+                return Step;
+            }
+            // Any other write makes the stride unknown.
+            if (const auto *BO = dyn_cast<BinaryOperator>(E->IgnoreParenImpCasts()))
+                if (BO->isAssignmentOp() && referencedVar(BO->getLHS()) == Var)
+                    found += 2;
+        }
+        for (const Stmt *Child : S->children())
+            if (std::optional<long long> Step = stepInBody(Child, Var, found))
+                Result = Step;
+        return Result;
+    }
+
+    // Iterations of a loop over `var` that starts at `start`, continues while `cond`
+    // holds and moves by `step` per iteration.
+    std::optional<Cost> tripCount(const VarDecl *Var, const Cost &Start, const Expr *Cond, long long Step) {
+        const auto *BO = Cond ? dyn_cast<BinaryOperator>(Cond->IgnoreParenImpCasts()) : nullptr;
+        if (!BO || !BO->isComparisonOp())
+            return std::nullopt;
+
+        BinaryOperatorKind Op = BO->getOpcode();
+        const Expr *BoundExpr = BO->getRHS();
+        if (referencedVar(BO->getRHS()) == Var) {
+            BoundExpr = BO->getLHS();
+            Op = BinaryOperator::reverseComparisonOp(Op);
+        } else if (referencedVar(BO->getLHS()) != Var) {
+            return std::nullopt;
+        }
+        std::optional<Cost> Bound = boundOf(BoundExpr);
+        if (!Bound)
+            return std::nullopt;
+
+        long long Stride = Step > 0 ? Step : -Step;
+        Cost Distance = Step > 0 ? *Bound - Start : Start - *Bound;
+        if ((Step > 0 && Op == BO_LT) || (Step < 0 && Op == BO_GT))
+            return clampTrip(divide(Distance + Cost::of(Stride - 1), Stride));
+        if ((Step > 0 && Op == BO_LE) || (Step < 0 && Op == BO_GE))
+            return clampTrip(divide(Distance + Cost::of(Stride), Stride));
+        if (Op == BO_NE)
+            return clampTrip(divide(Distance, Stride));
+        return std::nullopt;
+    }
+
+    Cost forTrip(const ForStmt *For) {
+        const VarDecl *Var = nullptr;
+        const Expr *Init = nullptr;
+        if (const auto *DS = dyn_cast_or_null<DeclStmt>(For->getInit())) {
+            if (DS->isSingleDecl())
+                if ((Var = dyn_cast<VarDecl>(DS->getSingleDecl())))
+                    Init = Var->getInit();
+        } else if (const auto *BO = dyn_cast_or_null<BinaryOperator>(For->getInit())) {
+            if (BO->getOpcode() == BO_Assign) {
+                Var = referencedVar(BO->getLHS());
+                Init = BO->getRHS();
+            }
+        }
+        if (!Var || !Init)
+            return Cost::of(DEFAULT_TRIP_COUNT);
+        std::optional<Cost> Start = boundOf(Init);
+        std::optional<long long> Step = stepOf(For->getInc(), Var);
+        if (!Start || !Step)
+            return Cost::of(DEFAULT_TRIP_COUNT);
+        std::optional<Cost> Trip = tripCount(Var, *Start, For->getCond(), *Step);
+        return Trip ? *Trip : Cost::of(DEFAULT_TRIP_COUNT);
+    }
+
+    // while (i < n) { ...; i++; } with i a parameter or a local with a derivable initializer.
+    Cost whileTrip(const Expr *Cond, const Stmt *Body) {
+        const auto *BO = Cond ? dyn_cast<BinaryOperator>(Cond->IgnoreParenImpCasts()) : nullptr;
+        if (!BO || !BO->isComparisonOp())
+            return Cost::of(DEFAULT_TRIP_COUNT);
+        for (const Expr *Side : {BO->getLHS(), BO->getRHS()}) {
+            const VarDecl *Var = referencedVar(Side);
+            if (!Var || !Var->getType()->isIntegerType())
+                continue;
+            int found = 0;
+            std::optional<long long> Step = stepInBody(Body, Var, found);
+            if (!Step || found != 1)
+                continue;
+            std::optional<Cost> Start = isa<ParmVarDecl>(Var) ? boundOf(Side) : boundOf(Var->getInit());
+            if (!Start)
+                continue;
+            if (std::optional<Cost> Trip = tripCount(Var, *Start, Cond, *Step))
+                return *Trip;
+        }
+        return Cost::of(DEFAULT_TRIP_COUNT);
+    }
+
+    Cost rangeTrip(const CXXForRangeStmt *Range) {
+        const Expr *Init = Range->getRangeInit()->IgnoreParenImpCasts();
+        if (const ParmVarDecl *PVD = asParam(Init))
+            if (PVD->getType().getNonReferenceType()->isRecordType())
+                return Cost::symbolic("(long long)$" + std::to_string(PVD->getFunctionScopeIndex()) + ".size()");
+        if (const auto *Array = Context.getAsConstantArrayType(Init->getType()))
+            return Cost::of(Array->getSize().getLimitedValue(COST_CAP));
+        return Cost::of(DEFAULT_TRIP_COUNT);
+    }
+
+    // Operations in an expression: operators, calls, subscripts, new/delete.
+    static long long operations(const Stmt *S) {
+        if (!S)
+            return 0;
+        long long count = isa<BinaryOperator>(S) || isa<UnaryOperator>(S) || isa<CallExpr>(S) ||
+                          isa<ArraySubscriptExpr>(S) || isa<CXXNewExpr>(S) || isa<CXXDeleteExpr>(S);
+        for (const Stmt *Child : S->children())
+            count += operations(Child);
+        return count;
+    }
+
+    static Cost atLeastOne(long long ops) { return Cost::of(std::max(1LL, ops)); }
+
+    Cost costOf(const Stmt *S) {
+        if (!S)
+            return Cost::of(0);
+        if (const auto *CS = dyn_cast<CompoundStmt>(S)) {
+            Cost Total = Cost::of(0);
+            for (const Stmt *Child : CS->body())
+                Total = Total + costOf(Child);
+            return Total;
+        }
+        if (const auto *For = dyn_cast<ForStmt>(S)) {
+            Cost Iteration = atLeastOne(operations(For->getCond())) + Cost::of(operations(For->getInc())) + costOf(For->getBody());
+            return costOf(For->getInit()) + forTrip(For) * Iteration;
+        }
+        if (const auto *While = dyn_cast<WhileStmt>(S)) {
+            Cost Iteration = atLeastOne(operations(While->getCond())) + costOf(While->getBody());
+            return whileTrip(While->getCond(), While->getBody()) * Iteration;
+        }
+        if (const auto *Do = dyn_cast<DoStmt>(S)) {
+            Cost Iteration = atLeastOne(operations(Do->getCond())) + costOf(Do->getBody());
+            return costMax(Cost::of(1), whileTrip(Do->getCond(), Do->getBody())) * Iteration;
+        }
+        if (const auto *Range = dyn_cast<CXXForRangeStmt>(S))
+            return rangeTrip(Range) * (Cost::of(1) + costOf(Range->getBody()));
+        if (const auto *If = dyn_cast<IfStmt>(S))
+            return atLeastOne(operations(If->getCond())) + costMax(costOf(If->getThen()), costOf(If->getElse()));
+        if (const auto *Ret = dyn_cast<ReturnStmt>(S))
+            return Cost::of(1 + operations(Ret->getRetValue()));
+        if (const auto *DS = dyn_cast<DeclStmt>(S)) {
+            long long ops = 0;
+            for (const Decl *D : DS->decls())
+                if (const auto *VD = dyn_cast<VarDecl>(D))
+                    ops += VD->hasInit() ? 1 + operations(VD->getInit()) : 0;
+            return Cost::of(ops);
+        }
+        if (isa<Expr>(S))
+            return atLeastOne(operations(S));
+
+        Cost Total = Cost::of(0);
+        for (const Stmt *Child : S->children())
+            Total = Total + costOf(Child);
+        return Total;
+    }
+};
+
+// Name the rewriter gives a function: its name plus the first letter of each parameter type.
+static std::string obfuscatedName(const FunctionDecl *Func) {
+    std::string name = Func->getNameAsString();
+    if (Func->getNumParams() > 0)
+        name += "_";
+    for (unsigned i = 0; i < Func->getNumParams(); ++i)
+        name += Func->getParamDecl(i)->getType().getAsString()[0];
+    return name;
+}
+
+// Cost argument for a dispatch of `name` whose arguments sit in the struct `args` (e.g. "args_0").
+// Table costs go through the <name>_cost function Estimation generates from the
+// cppFunctionsMap expression, so its names are the callee's parameters, not the caller's locals.
+static std::string renderCost(const std::string &name, const std::string &args) {
+    auto it = staticCosts.find(name);
+    bool measured = CostModel == "auto" && cppProfiledFunctionsSet.count(name) > 0;
+    if (CostModel == "table" || measured || it == staticCosts.end())
+        return name + "_cost(" + args + ")";
+
+    const StaticCost &cost = it->second;
+    if (staticCostScale != 1.0 && cost.expression.find('$') == std::string::npos) {
+        long long value = std::llround(std::stoll(cost.expression) * staticCostScale);
+        return std::to_string(std::max(1LL, std::min(value, COST_CAP)));
+    }
+    std::string rendered;
+    bool symbolic = false;
+    for (size_t i = 0; i < cost.expression.size(); ++i) {
+        if (cost.expression[i] != '$') {
+            rendered += cost.expression[i];
+            continue;
+        }
+        size_t end = i + 1;
+        while (end < cost.expression.size() && isdigit((unsigned char)cost.expression[end]))
+            ++end;
+        unsigned index = std::stoul(cost.expression.substr(i + 1, end - i - 1));
+        rendered += args + "." + cost.params.at(index);
+        symbolic = true;
+        i = end - 1;
+    }
+    if (staticCostScale != 1.0)
+        rendered = "(long long)(" + staticCostScaleText() + " * (" + rendered + "))";
+    return symbolic ? "(int)std::min<long long>(" + rendered + ", " + std::to_string(COST_CAP) + ")" : rendered;
+}
+
+// Sets staticCostScale from the profiled functions whose static cost is a
+// constant: the median of their measured cost over their operation count. Those
+// with symbolic costs are left out, since the profile only has their mean over
+// whatever arguments the run used.
+static void calibrateStaticCosts() {
+    if (CostModel != "auto" || cppProfiledFunctionsSet.empty())
+        return;
+    std::vector<double> ratios;
+    for (const std::string &name : cppProfiledFunctionsSet) {
+        auto measured = cppFunctionsMap.find(name);
+        auto estimated = staticCosts.find(name);
+        if (measured == cppFunctionsMap.end() || estimated == staticCosts.end() ||
+            estimated->second.expression.find('$') != std::string::npos)
+            continue;
+        char *end = nullptr;
+        long long units = std::strtoll(measured->second.c_str(), &end, 10);
+        long long operations = std::stoll(estimated->second.expression);
+        if (*end != '\0' || units <= 0 || operations <= 0)
+            continue;
+        ratios.push_back((double)units / operations);
+    }
+    if (ratios.empty()) {
+        std::cout << "Static costs left in operations: no profiled function has a constant static cost\n";
+        return;
+    }
+    std::nth_element(ratios.begin(), ratios.begin() + ratios.size() / 2, ratios.end());
+    staticCostScale = ratios[ratios.size() / 2];
+    std::cout << "Static costs scaled by " << staticCostScale << " cost units per operation (" << ratios.size()
+              << " profiled functions)\n";
+}
+
+// Records every user (non-system) file a TU enters; the rewrite cache revalidates
+// an entry by re-hashing exactly these files.
+class DependencyRecorder : public PPCallbacks {
+public:
+    DependencyRecorder(SourceManager &SM, std::set<std::string> &Dependencies) : SM(SM), Dependencies(Dependencies) {}
+
+    void FileChanged(SourceLocation Loc, FileChangeReason Reason, SrcMgr::CharacteristicKind FileType, FileID) override {
+        if (Reason != EnterFile || FileType != SrcMgr::C_User)
+            return;
+        StringRef name = SM.getFilename(Loc);
+        if (!name.empty() && name.front() != '<')
+            Dependencies.insert(canonicalPath(name.str()));
+    }
+
+private:
+    SourceManager &SM;
+    std::set<std::string> &Dependencies;
+};
+
+class GlobalUsageConsumer : public ASTConsumer {
+public:
+    GlobalUsageConsumer(std::string path, std::set<std::string> &Dependencies)
+        : Path(std::move(path)), Dependencies(Dependencies) {}
+
+    void HandleTranslationUnit(ASTContext &Context) override {
+        GlobalUsageCollector Collector(Context);
+        Collector.TraverseDecl(Context.getTranslationUnitDecl());
+
+        // Static costs of the functions defined here that will be dispatched.
+        std::map<std::string, StaticCost> costs;
+        const SourceManager &SM = Context.getSourceManager();
+        for (const FunctionDecl *Func : Collector.definitions) {
+            if (!SM.isInMainFile(SM.getExpansionLoc(Func->getLocation())))
+                continue;
+            std::string name = obfuscatedName(Func);
+            if (cppFunctionsMap.find(name) == cppFunctionsMap.end())
+                continue;
+            StaticCost cost;
+            for (const ParmVarDecl *Param : Func->parameters())
+                cost.params.push_back(Param->getName().empty() ? "_" : Param->getNameAsString());
+            cost.expression = StaticCostModel(Context, Func).functionCost().text();
+            costs[name] = cost;
+        }
+        std::set<std::string> callees;
+        for (const FunctionDecl *Callee : Collector.calls) {
+            std::string name = obfuscatedName(Callee);
+            if (cppFunctionsMap.find(name) != cppFunctionsMap.end())
+                callees.insert(name);
+        }
+
+        std::lock_guard<std::mutex> lock(fileRecordsMutex);
+        FileRecord &record = fileRecords[Path];
+        record.dependencies = Dependencies;
+        record.usage = std::move(Collector.usages);
+        record.costs = std::move(costs);
+        record.callees = std::move(callees);
+        record.usageKnown = true;
+        record.fresh = true;
+    }
+
+private:
+    std::string Path;
+    std::set<std::string> &Dependencies;
+};
+
+class GlobalUsageAction : public ASTFrontendAction {
+public:
+    std::unique_ptr<ASTConsumer> CreateASTConsumer(CompilerInstance &CI, StringRef file) override {
+        std::string path = canonicalPath(file.str());
+        Dependencies.insert(path);
+        CI.getPreprocessor().addPPCallbacks(std::make_unique<DependencyRecorder>(CI.getSourceManager(), Dependencies));
+        return std::make_unique<GlobalUsageConsumer>(path, Dependencies);
+    }
+
+private:
+    std::set<std::string> Dependencies;
+};
+
 class FunctionRewriter : public MatchFinder::MatchCallback, public RecursiveASTVisitor<FunctionRewriter> {
 public:
     FunctionRewriter(Rewriter &R) : TheRewriter(R), CurrentFunction(nullptr) {}
@@ -28,6 +744,7 @@ public:
     void run(const MatchFinder::MatchResult &Result) override {
         if (const FunctionDecl *Func = Result.Nodes.getNodeAs<FunctionDecl>("function")) {
             CurrentFunction = Func;
+            Context = Result.Context;
             if ((Func->getNameAsString() == "main")) {
                 if (const CompoundStmt *Body = dyn_cast<CompoundStmt>(Func->getBody())) {
                     std::string mainStartCode = R"(initialize();)";
@@ -46,8 +763,10 @@ public:
                     }
                 }
 
-                nonVoidCallees.clear();
+                callSiteCount = 0;
                 TraverseDecl(const_cast<FunctionDecl *>(Func));
+                emitGlobalLocks();
+                emitDeferredJoins();
             }
 
             
@@ -61,7 +780,8 @@ public:
             if (!isMain){
                 // (1) Rewrite return type and function signature
                 SourceLocation ReturnTypeStart = Func->getReturnTypeSourceRange().getBegin();
-                TheRewriter.ReplaceText(ReturnTypeStart, Func->getReturnType().getAsString().length(), "void");
+                TheRewriter.ReplaceText(ReturnTypeStart, Func->getReturnType().getAsString().length(),
+                                        useCoroutines ? "ObfTask" : "void");
 
                 std::string originalName = Func->getNameInfo().getName().getAsString();
 
@@ -71,8 +791,6 @@ public:
                     if (!typeStr.empty()) suffix += typeStr[0];
                 }
 
-                currentSuffix = suffix;
-
                 newName = suffix.empty() ? originalName : originalName + "_" + suffix;
 
                 SourceLocation nameLoc = Func->getNameInfo().getBeginLoc();
@@ -83,7 +801,7 @@ public:
                     SourceLocation RParenLoc = FTL.getRParenLoc();
                     if (LParenLoc.isValid() && RParenLoc.isValid() && LParenLoc < RParenLoc) {
                         TheRewriter.ReplaceText(SourceRange(LParenLoc, RParenLoc),
-                                                "(int thread_idx, int param_index)");
+                                                "(int thread_idx, " + newName + "_values task_params)");
                     }
                 }
                 
@@ -99,7 +817,7 @@ public:
                         for (auto *Stmt : Body->body()) {
                             if (const ReturnStmt *RetStmt = dyn_cast<ReturnStmt>(Stmt)) {
                                 SourceLocation RetStart = RetStmt->getBeginLoc();
-                                std::string ReturnReplacement = newName + "_params[param_index].return_var = ";
+                                std::string ReturnReplacement = "task_params.result->return_var = ";
                                 TheRewriter.ReplaceText(SourceRange(RetStart, RetStart.getLocWithOffset(6)),
                                                         ReturnReplacement);
                             }
@@ -109,23 +827,22 @@ public:
             }
 
             // (3) Traverse function body to rewrite parameter references and record call expressions.
-            nonVoidCallees.clear();
+            callSiteCount = 0;
             TraverseDecl(const_cast<FunctionDecl *>(Func));
+            emitGlobalLocks();
 
             // (4) Insert the extra lines at the end of the function body.
             if (const CompoundStmt *Body = dyn_cast<CompoundStmt>(Func->getBody())) {
                 SourceLocation InsertLoc = Body->getRBracLoc();
                 std::string extraCode;
-                for (const auto &callee : nonVoidCallees) {
-                    extraCode += callee + "_params_index_pool.push(index);\n";
-                }
-                // If the current function returns a value, mark it done.
-                if (!Func->getReturnType()->isVoidType() && !isMain) {
-                    extraCode += newName + "_params[param_index]." + newName + "_done = true;\n";
-                }
-                extraCode += "vec[thread_idx].fetch_sub(" + cppFunctionsMap.at(newName) + ");";
+                // If the current function returns a value, tell the waiting caller it is there.
+                if (!Func->getReturnType()->isVoidType() && !isMain)
+                    extraCode += "task_params.result->finish();\n";
+                // The runtime credits the task's cost back to the worker's load once the function returns.
+                if (useCoroutines && !isMain) extraCode += "co_return;";
                 TheRewriter.InsertTextBefore(InsertLoc, extraCode);
             }
+            emitDeferredJoins();
 
             CurrentFunction = nullptr;
         }
@@ -135,56 +852,146 @@ public:
         if (!CurrentFunction)
             return true;
 
+        // References inside a dispatched call's arguments went into its argument
+        // struct already (see argumentText).
+        if (argumentRefs.count(DRE))
+            return true;
+
         // (1) Rewrite parameter references.
         if (const ParmVarDecl *PVD = dyn_cast<ParmVarDecl>(DRE->getDecl())) {
-            std::string functionName = CurrentFunction->getNameAsString();
             std::string paramName = PVD->getNameAsString();
-            std::string replacement = functionName + (currentSuffix.empty() ? "" : "_" + currentSuffix) +"_params[param_index]." + paramName;
+            std::string replacement = "task_params." + paramName;
 
             SourceLocation ParamLoc = DRE->getBeginLoc();
             TheRewriter.ReplaceText(ParamLoc, paramName.length(), replacement);
         }
 
-        // (2) Global variable usage rewriting: wrap the entire line in a block with a lock.
+        // (2) Global variable usage rewriting.
         if (const VarDecl *VD = dyn_cast<VarDecl>(DRE->getDecl())) {
             const SourceManager &SM = TheRewriter.getSourceMgr();
-            if (SM.isInSystemHeader(VD->getLocation()))
+            if (!isSyncedGlobal(VD, SM))
                 return true;
 
-            if (VD->getDeclContext()->isTranslationUnit() || VD->hasGlobalStorage()) {
-                SourceLocation loc = DRE->getBeginLoc();
-                unsigned line = SM.getSpellingLineNumber(loc);
-
-                // Only process this line once.
-                if (processedGlobalLines.find(line) == processedGlobalLines.end()) {
-                    processedGlobalLines.insert(line);
-
-                    // Compute the start of the line.
-                    unsigned offset = SM.getFileOffset(loc);
-                    unsigned colNo = SM.getColumnNumber(SM.getFileID(loc), offset);
-                    SourceLocation lineStart = loc.getLocWithOffset(-static_cast<int>(colNo) + 1);
-
-                    FileID fid = SM.getFileID(loc);
-                    bool invalid = false;
-                    StringRef buffer = SM.getBufferData(fid, &invalid);
-                    if (!invalid) {
-                        unsigned lineEndOffset = offset;
-                        while (lineEndOffset < buffer.size() && buffer[lineEndOffset] != '\n')
-                            ++lineEndOffset;
-                        SourceLocation lineEnd = SM.getLocForStartOfFile(fid).getLocWithOffset(lineEndOffset);
-
-                        std::string lockBlockStart = "{ unique_lock<mutex> lock(mutexes[thread_idx]);";
-                        TheRewriter.InsertText(lineStart, lockBlockStart, true, true);
-                        std::string lockBlockEnd = " }";
-                        TheRewriter.InsertTextAfterToken(lineEnd, lockBlockEnd);
-                    }
+            GlobalSync sync = globalSyncFor(VD);
+            if (sync == GlobalSync::None)
+                return true;
+
+            const Expr *Access;
+            GlobalAccess access = classifyGlobalAccess(*Context, DRE, Access);
+            if (sync == GlobalSync::Atomic && access != GlobalAccess::Other) {
+                rewriteAtomicAccess(DRE, access, Access);
+                return true;
+            }
+
+            // Collect the globals each line needs; the lock is added once the function is done.
+            SourceLocation loc = DRE->getBeginLoc();
+            unsigned line = SM.getSpellingLineNumber(loc);
+            LockedLine &locked = lockedLines[line];
+            if (locked.globals.empty()) {
+                // Compute the start of the line.
+                unsigned offset = SM.getFileOffset(loc);
+                unsigned colNo = SM.getColumnNumber(SM.getFileID(loc), offset);
+                locked.start = loc.getLocWithOffset(-static_cast<int>(colNo) + 1);
+
+                FileID fid = SM.getFileID(loc);
+                bool invalid = false;
+                StringRef buffer = SM.getBufferData(fid, &invalid);
+                if (invalid) {
+                    lockedLines.erase(line);
+                    return true;
                 }
+                unsigned lineEndOffset = offset;
+                while (lineEndOffset < buffer.size() && buffer[lineEndOffset] != '\n')
+                    ++lineEndOffset;
+                locked.end = SM.getLocForStartOfFile(fid).getLocWithOffset(lineEndOffset);
             }
+            locked.globals.insert(VD->getNameAsString());
         }
 
         return true;
     }
 
+    // Rewrites one access to an atomic global into the runtime's global* helpers.
+    void rewriteAtomicAccess(DeclRefExpr *DRE, GlobalAccess access, const Expr *Access) {
+        std::string name = DRE->getNameInfo().getAsString();
+        if (access == GlobalAccess::Read) {
+            TheRewriter.ReplaceText(SourceRange(DRE->getBeginLoc(), DRE->getEndLoc()), "globalLoad(" + name + ")");
+            return;
+        }
+
+        if (const auto *UO = dyn_cast<UnaryOperator>(Access)) {
+            TheRewriter.ReplaceText(UO->getSourceRange(), atomicHelper(UO) + "(" + name + ", 1)");
+            return;
+        }
+
+        const auto *BO = cast<BinaryOperator>(Access);
+        // Only the "x op=" prefix is replaced so edits inside the right-hand side survive.
+        TheRewriter.ReplaceText(SourceRange(BO->getLHS()->getBeginLoc(), BO->getOperatorLoc()), atomicHelper(BO) + "(" + name + ", ");
+        TheRewriter.InsertTextAfterToken(BO->getRHS()->getEndLoc(), ")");
+    }
+
+    static std::string atomicHelper(const UnaryOperator *UO) {
+        if (UO->isPrefix())
+            return UO->isIncrementOp() ? "globalAddFetch" : "globalSubFetch";
+        return UO->isIncrementOp() ? "globalFetchAdd" : "globalFetchSub";
+    }
+
+    static std::string atomicHelper(const BinaryOperator *BO) {
+        switch (BO->getOpcode()) {
+        case BO_Assign:    return "globalStore";
+        case BO_AddAssign: return "globalAddFetch";
+        case BO_SubAssign: return "globalSubFetch";
+        case BO_AndAssign: return "globalAndFetch";
+        case BO_OrAssign:  return "globalOrFetch";
+        default:           return "globalXorFetch";
+        }
+    }
+
+    // Wraps every line that touches locked globals in a guard over their lock stripes.
+    void emitGlobalLocks() {
+        for (const auto &entry : lockedLines) {
+            std::string addresses;
+            for (const std::string &global : entry.second.globals)
+                addresses += (addresses.empty() ? "&" : ", &") + global;
+            TheRewriter.InsertText(entry.second.start, "{ GlobalLockGuard globalLock({" + addresses + "});", true, true);
+            TheRewriter.InsertTextAfterToken(entry.second.end, " }");
+        }
+        lockedLines.clear();
+    }
+
+    // Inserts the joins of deferred calls (see joinLocation). They go in last and in
+    // front of everything else at their location, so a join precedes the dispatch
+    // code of the statement that needs the result, and the final finish().
+    void emitDeferredJoins() {
+        for (auto it = deferredJoins.rbegin(); it != deferredJoins.rend(); ++it)
+            TheRewriter.InsertTextBefore(it->at, it->code);
+        deferredJoins.clear();
+    }
+
+    bool TraverseLambdaExpr(LambdaExpr *LE) {
+        ++lambdaDepth;
+        bool result = RecursiveASTVisitor<FunctionRewriter>::TraverseLambdaExpr(LE);
+        --lambdaDepth;
+        return result;
+    }
+
+    // A counted loop whose body is a single dispatched call becomes one parallelFor
+    // (see rewriteParallelLoop); its body is not visited, as the loop is rewritten whole.
+    bool TraverseForStmt(ForStmt *FS) {
+        if (CurrentFunction && !useCoroutines && lambdaDepth == 0 && rewriteParallelLoop(FS))
+            return true;
+        return RecursiveASTVisitor<FunctionRewriter>::TraverseForStmt(FS);
+    }
+
+    // Plain returns are not allowed in a coroutine body (lambdas keep theirs).
+    bool VisitReturnStmt(ReturnStmt *RS) {
+        if (!useCoroutines || !CurrentFunction || lambdaDepth > 0 || CurrentFunction->getNameAsString() == "main")
+            return true;
+        if (!RS->getRetValue()) {
+            TheRewriter.ReplaceText(SourceRange(RS->getBeginLoc(), RS->getBeginLoc().getLocWithOffset(5)), "co_return");
+        }
+        return true;
+    }
 
     // Visitor to handle function calls.
     bool VisitCallExpr(CallExpr *CE) {
@@ -195,14 +1002,10 @@ public:
         std::string functionName = Callee->getNameAsString();
         if (cppFunctionNamesSet.find(functionName) == cppFunctionNamesSet.end()) return true;
 
-        const SourceManager &SM1 = TheRewriter.getSourceMgr();
         std::string argsString;
         for (unsigned i = 0; i < CE->getNumArgs(); ++i) {
-            const Expr *arg = CE->getArg(i);
-            SourceRange argRange = arg->getSourceRange();
-            llvm::StringRef argText = Lexer::getSourceText(CharSourceRange::getTokenRange(argRange), SM1, TheRewriter.getLangOpts());
             if (i > 0) argsString += ", ";
-            argsString += argText.str();
+            argsString += argumentText(CE->getArg(i));
         }
 
         if (const FunctionDecl *Callee = CE->getDirectCallee()) {
@@ -214,41 +1017,110 @@ public:
             }
         }
 
-        std::string pushThreadStmt = "int index; \n { \n";
-
-        if (CurrentFunction->getNameAsString() != "main") pushThreadStmt += "unique_lock<mutex> lock(mutexes[thread_idx]);\n";
-        
-        pushThreadStmt += "if (" + functionName + "_params_index_pool.empty()){\n index = " + functionName +
-            "_params.size();\n" + functionName + "_params.emplace_back();\n }\n else { \n index = " +
-            functionName + "_params_index_pool.front(); \n" + functionName + "_params_index_pool.pop(); \n }\n" +
-            functionName + "_params[index] = {" + argsString + "};\n }\n" +
-            "; \n pushToThread(" + functionName + "_enumidx," + cppFunctionsMap.at(functionName) + ", index);\n";
+        // The arguments are gathered in the caller and travel inside the task (see makeTask);
+        // a non-void callee leaves its result in a CallResult in the caller's frame.
+        std::string callSite = std::to_string(callSiteCount++);
+        std::string argsVar = "args_" + callSite;
+        std::string resultVar = "result_" + callSite;
+        std::string costVar = "cost_" + callSite;
+        bool inMain = CurrentFunction->getNameAsString() == "main";
+        bool awaitsResult = !Callee->getReturnType()->isVoidType();
+
+        std::string pushThreadStmt;
+        if (awaitsResult) {
+            pushThreadStmt += "CallResult " + resultVar + ";\n";
+            argsString += (argsString.empty() ? "&" : ", &") + resultVar;
+        }
+        pushThreadStmt += functionName + "_values " + argsVar + "{" + argsString + "};\n";
+        pushThreadStmt += "int " + costVar + " = " + renderCost(functionName, argsVar) + ";\n";
+        std::string task = "makeTask<" + functionName + ">(" + functionName + "_enumidx, " + costVar +
+            ", std::move(" + argsVar + "))";
+
+        // Consecutive fire-and-forget calls are collected in one TaskBatch and submitted
+        // after the last of them, so the run costs one wake per worker rather than one per call.
+        const CallExpr *BatchFirst = nullptr;
+        bool batchEnds = false;
+        bool batched = batchRun(CE, BatchFirst, batchEnds);
+        if (batched && BatchFirst == CE) {
+            currentBatch = "batch_" + callSite;
+            pushThreadStmt = "TaskBatch " + currentBatch + ";\n" + pushThreadStmt;
+        }
+        // The wait for a result is bracketed for -DOBFUSCATION_TRACE builds; otherwise the calls are empty.
+        std::string waitVar = "wait_" + callSite;
+        auto waitFor = [&](const std::string &help) {
+            return "uint64_t " + waitVar + " = traceWaitBegin();\n" +
+                "while (!" + resultVar + ".isDone()) {\n " + help + " \n} \n" +
+                "traceWaitEnd(" + functionName + "_enumidx, " + waitVar + ");\n";
+        };
+        // A call whose result is waited for is queued ahead of fire-and-forget work.
+        auto dispatch = [&]() {
+            if (batched)
+                return currentBatch + ".add(" + task + ");\n";
+            return (awaitsResult ? "submitAwaitedTask(" : "submitTask(") + task + ");\n";
+        };
+        std::string help = inMain ? "this_thread::yield();" : "execute(thread_idx);";
+
+        // A result stored in a local is only waited for before the first statement that
+        // needs it, so the calls made in between are dispatched before any is joined.
+        const Stmt *Statement = nullptr;
+        const VarDecl *Var = nullptr;
+        SourceLocation joinLoc;
+        bool deferred = awaitsResult && (inMain || !useCoroutines) && lambdaDepth == 0 &&
+                        deferrableCall(CE, Statement, Var) && joinLocation(Statement, Var, joinLoc);
+
+        if (awaitsResult && useCoroutines && !inMain) {
+            // Suspend until the callee is done; we may be resumed on a different worker.
+            // awaitCall runs the callee in place when runInline() says dispatching is not worth it.
+            pushThreadStmt += "thread_idx = co_await awaitCall(" + task + ");\n";
+        } else if (inMain) {
+            pushThreadStmt += dispatch();
+            if (awaitsResult && !deferred)
+                pushThreadStmt += waitFor(help);
+        } else {
+            // Granularity control: calls too cheap to dispatch, or made while every queue
+            // is deep, run the callee directly on this worker; so do recursive calls made
+            // past the runtime's spawn depth cutoff.
+            std::string directCall = functionName + "(thread_idx, std::move(" + argsVar + "))";
+            if (useCoroutines)
+                directCall = "resumeInline(" + directCall + ", " + functionName + "_enumidx, thread_idx)";
+            bool recursive = Callee->getCanonicalDecl() == CurrentFunction->getCanonicalDecl();
+            std::string inlineCheck = recursive && !useCoroutines ? "runInlineRecursive" : "runInline";
+            pushThreadStmt += "if (" + inlineCheck + "(" + costVar + ")) " + directCall + ";\n";
+            pushThreadStmt += "else " + dispatch();
+            if (awaitsResult && !deferred)
+                pushThreadStmt += waitFor(help);
+        }
 
-        if (!Callee->getReturnType()->isVoidType()) {
-            pushThreadStmt += "while (!" + functionName + "_params[index]." + functionName +
-                "_done) {\n if(!queues[thread_idx].empty()) execute(thread_idx); \n} \n";
-            // Record the callee name so that later we add the push statement
-            nonVoidCallees.push_back(functionName);
+        if (batched && batchEnds) {
+            pushThreadStmt += currentBatch + ".submit();\n";
+            currentBatch.clear();
         }
 
         SourceRange callRange = CE->getSourceRange();
         CharSourceRange charRange = CharSourceRange::getTokenRange(callRange);
         SourceLocation callStart = charRange.getBegin();
-
-        // Find the beginning of the line where the call occurs.
         const SourceManager &SM = TheRewriter.getSourceMgr();
-        SourceLocation expansionLoc = SM.getExpansionLoc(callStart);
-        FileID fid = SM.getFileID(expansionLoc);
-        unsigned offset = SM.getFileOffset(expansionLoc);
-        unsigned colNo = SM.getColumnNumber(fid, offset);
-        SourceLocation lineStart = callStart.getLocWithOffset(-static_cast<int>(colNo) + 1);
 
         // Insert the pushThreadStmt before the line.
-        TheRewriter.InsertTextBefore(lineStart, pushThreadStmt);
-
-        if (!Callee->getReturnType()->isVoidType()) {
-            std::string returnReplacement = functionName + "_params[index].return_var";
-            TheRewriter.ReplaceText(charRange, returnReplacement);
+        TheRewriter.InsertTextBefore(lineStartOf(callStart), pushThreadStmt);
+
+        if (deferred) {
+            // The statement moves to the join, reading the result from the CallResult;
+            // a discarded result leaves only the wait.
+            const LangOptions &LangOpts = TheRewriter.getLangOpts();
+            SourceLocation stmtStart = Statement->getBeginLoc();
+            SourceLocation stmtEnd = isa<DeclStmt>(Statement)
+                ? Lexer::getLocForEndOfToken(Statement->getEndLoc(), 0, SM, LangOpts)
+                : Lexer::findLocationAfterToken(Statement->getEndLoc(), tok::semi, SM, LangOpts, false);
+            SourceLocation callEnd = Lexer::getLocForEndOfToken(CE->getEndLoc(), 0, SM, LangOpts);
+            std::string moved =
+                Lexer::getSourceText(CharSourceRange::getCharRange(stmtStart, callStart), SM, LangOpts).str() +
+                resultVar + ".return_var" +
+                Lexer::getSourceText(CharSourceRange::getCharRange(callEnd, stmtEnd), SM, LangOpts).str();
+            TheRewriter.RemoveText(CharSourceRange::getCharRange(stmtStart, stmtEnd));
+            deferredJoins.push_back({joinLoc, waitFor(help) + (Var ? moved + "\n" : "")});
+        } else if (awaitsResult) {
+            TheRewriter.ReplaceText(charRange, resultVar + ".return_var");
         } else {
             SourceLocation callEnd = CE->getEndLoc();
             SourceLocation semiLoc = Lexer::findLocationAfterToken(
@@ -264,11 +1136,475 @@ public:
     }
 
 private:
+    // Rewrites `for (T i = A; i < B; ++i) f(args);` or `... ARR[i] = f(args);` into a
+    // parallelFor over [A, B) with a single join at the loop's exit. The iterations
+    // have to be independent: A, B and the arguments make no calls, touch no globals,
+    // have no side effects and pass nothing by pointer or reference, B does not depend
+    // on i, and each iteration writes only its own element of a local or parameter
+    // array, vector or std::array, which nothing else in the loop reads. The cost of
+    // an iteration is that of the first one.
+    bool rewriteParallelLoop(ForStmt *FS) {
+        if (!Context || expandsMacro(FS))
+            return false;
+        const auto *Init = dyn_cast_or_null<DeclStmt>(FS->getInit());
+        const auto *Index = Init && Init->isSingleDecl() ? dyn_cast<VarDecl>(Init->getSingleDecl()) : nullptr;
+        if (!Index || !Index->getInit() || !Index->getType()->isIntegerType() || Index->getType()->isBooleanType())
+            return false;
+
+        const auto *Cond = dyn_cast_or_null<BinaryOperator>(FS->getCond());
+        if (!Cond || (Cond->getOpcode() != BO_LT && Cond->getOpcode() != BO_LE) ||
+            !isRefTo(Cond->getLHS(), Index))
+            return false;
+        const Stmt *Inc = FS->getInc();
+        const auto *IncUO = dyn_cast_or_null<UnaryOperator>(Inc);
+        const auto *IncCAO = dyn_cast_or_null<CompoundAssignOperator>(Inc);
+        const auto *Step = IncCAO ? dyn_cast<IntegerLiteral>(IncCAO->getRHS()->IgnoreParenImpCasts()) : nullptr;
+        bool unitStep = (IncUO && IncUO->isIncrementOp() && isRefTo(IncUO->getSubExpr(), Index)) ||
+                        (IncCAO && IncCAO->getOpcode() == BO_AddAssign && isRefTo(IncCAO->getLHS(), Index) &&
+                         Step && Step->getValue() == 1);
+        if (!unitStep)
+            return false;
+
+        const Stmt *Body = FS->getBody();
+        if (const auto *Block = dyn_cast<CompoundStmt>(Body)) {
+            if (Block->size() != 1)
+                return false;
+            Body = Block->body_front();
+        }
+        const auto *BodyExpr = dyn_cast<Expr>(Body);
+        if (!BodyExpr)
+            return false;
+        const Expr *Target = nullptr;
+        const VarDecl *TargetBase = nullptr;
+        const auto *CE = dyn_cast<CallExpr>(BodyExpr->IgnoreImplicit());
+        if (const auto *BO = dyn_cast<BinaryOperator>(BodyExpr->IgnoreImplicit())) {
+            const Expr *Subscript = nullptr;
+            const Expr *Base = BO->getOpcode() == BO_Assign ? elementBase(BO->getLHS(), Subscript) : nullptr;
+            const auto *BaseRef = Base ? dyn_cast<DeclRefExpr>(Base->IgnoreParenImpCasts()) : nullptr;
+            TargetBase = BaseRef ? dyn_cast<VarDecl>(BaseRef->getDecl()) : nullptr;
+            if (!TargetBase || TargetBase->hasGlobalStorage() || !isRefTo(Subscript, Index))
+                return false;
+            Target = BO->getLHS();
+            CE = dyn_cast<CallExpr>(BO->getRHS()->IgnoreImplicit());
+        }
+        const FunctionDecl *Callee = CE ? CE->getDirectCallee() : nullptr;
+        if (!Callee || cppFunctionNamesSet.find(Callee->getNameAsString()) == cppFunctionNamesSet.end())
+            return false;
+        if (Target && Callee->getReturnType()->isVoidType())
+            return false;
+        for (const ParmVarDecl *Param : Callee->parameters())
+            if (Param->getType()->isPointerType() || Param->getType()->isReferenceType())
+                return false;
+
+        const Expr *Begin = Index->getInit();
+        const Expr *End = Cond->getRHS();
+        if (!isPlainExpr(Begin) || !isPlainExpr(End) || referencesDecl(End, Index) ||
+            (TargetBase && referencesDecl(End, TargetBase)))
+            return false;
+        for (const Expr *Arg : CE->arguments())
+            if (!isPlainExpr(Arg) || (TargetBase && referencesDecl(Arg, TargetBase)))
+                return false;
+
+        std::string functionName = obfuscatedName(Callee);
+        std::string site = std::to_string(callSiteCount++);
+        std::string argsVar = "args_" + site;
+        std::string resultVar = "result_" + site;
+        std::string costVar = "loop_cost_" + site;
+        std::string indexVar = "loop_" + site + "_index";
+        bool awaitsResult = !Callee->getReturnType()->isVoidType();
+        std::string indexType = Index->getType().getAsString();
+        std::string indexDecl = indexType + " " + Index->getNameAsString() + " = ";
+        bool usesIndex = referencesDecl(Body, Index);
+
+        std::string argsString;
+        for (unsigned i = 0; i < CE->getNumArgs(); ++i) {
+            if (i > 0) argsString += ", ";
+            argsString += argumentText(CE->getArg(i));
+        }
+        std::string beginText = argumentText(Begin);
+        std::string endText = "(long)(" + argumentText(End) + ")" + (Cond->getOpcode() == BO_LE ? " + 1" : "");
+
+        // The cost of one iteration, from the arguments of the first when the cost
+        // model reads them.
+        std::string code = "{\n";
+        std::string cost = renderCost(functionName, argsVar);
+        if (cost.find(argsVar) == std::string::npos) {
+            code += "int " + costVar + " = " + cost + ";\n";
+        } else {
+            code += "int " + costVar + ";\n{\n";
+            if (usesIndex)
+                code += indexDecl + beginText + ";\n";
+            code += functionName + "_values " + argsVar + "{" + argsString + (awaitsResult ? ", nullptr" : "") + "};\n";
+            code += costVar + " = " + cost + ";\n}\n";
+        }
+
+        std::string withResult = argsString + (argsString.empty() ? "&" : ", &") + resultVar;
+        code += "parallelFor(" + functionName + "_enumidx, (long)(" + beginText + "), " + endText + ", " + costVar +
+            ", [&](int thread_idx, long " + indexVar + ") {\n";
+        if (usesIndex)
+            code += indexDecl + "(" + indexType + ")" + indexVar + ";\n";
+        if (awaitsResult)
+            code += "CallResult " + resultVar + ";\n";
+        code += functionName + "_values " + argsVar + "{" + (awaitsResult ? withResult : argsString) + "};\n";
+        code += functionName + "(thread_idx, std::move(" + argsVar + "));\n";
+        if (Target)
+            code += argumentText(Target) + " = " + resultVar + ".return_var;\n";
+        code += "});\n}";
+
+        // A body without braces ends at its call; the loop's text runs to the semicolon.
+        const SourceManager &SM = TheRewriter.getSourceMgr();
+        const LangOptions &LangOpts = TheRewriter.getLangOpts();
+        SourceLocation loopEnd = isa<CompoundStmt>(FS->getBody())
+            ? Lexer::getLocForEndOfToken(FS->getEndLoc(), 0, SM, LangOpts)
+            : Lexer::findLocationAfterToken(FS->getEndLoc(), tok::semi, SM, LangOpts, false);
+        if (loopEnd.isInvalid())
+            return false;
+        TheRewriter.ReplaceText(CharSourceRange::getCharRange(FS->getBeginLoc(), loopEnd), code);
+        return true;
+    }
+
+    static bool isRefTo(const Expr *E, const VarDecl *Var) {
+        const auto *DRE = E ? dyn_cast<DeclRefExpr>(E->IgnoreParenImpCasts()) : nullptr;
+        return DRE && DRE->getDecl() == Var;
+    }
+
+    // An expression a parallel loop may evaluate once up front, or on any worker.
+    bool isPlainExpr(const Expr *E) {
+        return !containsCall(E) && !referencesGlobal(E) && !E->HasSideEffects(*Context);
+    }
+
+    // The array of `array[index]`, for builtin arrays and pointers and for std::vector
+    // and std::array, whose operator[] only computes an address (vector<bool>'s does not).
+    static const Expr *elementBase(const Expr *E, const Expr *&Index) {
+        E = E->IgnoreParenImpCasts();
+        if (const auto *ASE = dyn_cast<ArraySubscriptExpr>(E)) {
+            Index = ASE->getIdx();
+            return ASE->getBase();
+        }
+        const auto *OCE = dyn_cast<CXXOperatorCallExpr>(E);
+        if (!OCE || OCE->getOperator() != OO_Subscript || OCE->getNumArgs() != 2)
+            return nullptr;
+        const CXXRecordDecl *Record = OCE->getArg(0)->getType()->getAsCXXRecordDecl();
+        if (!Record || !Record->isInStdNamespace() || (Record->getName() != "vector" && Record->getName() != "array"))
+            return nullptr;
+        if (const auto *Spec = dyn_cast<ClassTemplateSpecializationDecl>(Record)) {
+            const TemplateArgument &Element = Spec->getTemplateArgs()[0];
+            if (Element.getKind() != TemplateArgument::Type || Element.getAsType()->isBooleanType())
+                return nullptr;
+        }
+        Index = OCE->getArg(1);
+        return OCE->getArg(0);
+    }
+
+    static bool expandsMacro(const Stmt *S) {
+        if (!S)
+            return false;
+        if (S->getBeginLoc().isMacroID() || S->getEndLoc().isMacroID())
+            return true;
+        for (const Stmt *Child : S->children())
+            if (expandsMacro(Child))
+                return true;
+        return false;
+    }
+
+    // The source of a dispatched call's argument with the caller's parameter
+    // references and synced globals rewritten. The call is replaced as a whole, so
+    // VisitDeclRefExpr must leave the references inside it alone: atomic globals
+    // go through the global* helpers here, and an argument that touches a locked
+    // global is evaluated under its lock stripes (globalLockedRead).
+    std::string argumentText(const Expr *Arg) {
+        const SourceManager &SM = TheRewriter.getSourceMgr();
+        const LangOptions &LangOpts = TheRewriter.getLangOpts();
+        CharSourceRange Range = CharSourceRange::getTokenRange(Arg->getSourceRange());
+        std::string text = Lexer::getSourceText(Range, SM, LangOpts).str();
+        if (Range.getBegin().isMacroID())
+            return text;
+
+        std::vector<const DeclRefExpr *> refs;
+        collectArgumentRefs(Arg, refs);
+        unsigned base = SM.getFileOffset(Range.getBegin());
+        auto offsetOf = [&](SourceLocation Loc) { return SM.getFileOffset(Loc) - base; };
+        auto endOf = [&](SourceLocation Loc) { return offsetOf(Loc) + Lexer::MeasureTokenLength(Loc, SM, LangOpts); };
+        // Replacements of [begin, end) of the text; they never overlap.
+        struct Edit {
+            unsigned begin, end;
+            std::string text;
+        };
+        std::vector<Edit> edits;
+        std::set<std::string> lockedGlobals;
+        for (const DeclRefExpr *Ref : refs) {
+            if (Ref->getBeginLoc().isMacroID())
+                continue;
+            argumentRefs.insert(Ref);
+            unsigned begin = offsetOf(Ref->getBeginLoc());
+            if (isa<ParmVarDecl>(Ref->getDecl())) {
+                edits.push_back({begin, begin, "task_params."});
+                continue;
+            }
+
+            const VarDecl *VD = cast<VarDecl>(Ref->getDecl());
+            const Expr *Access;
+            GlobalAccess access = classifyGlobalAccess(*Context, Ref, Access);
+            if (globalSyncFor(VD) == GlobalSync::Locked || access == GlobalAccess::Other) {
+                lockedGlobals.insert(VD->getNameAsString());
+                continue;
+            }
+            // The same rewrites as rewriteAtomicAccess.
+            std::string name = Ref->getNameInfo().getAsString();
+            if (access == GlobalAccess::Read) {
+                edits.push_back({begin, endOf(Ref->getEndLoc()), "globalLoad(" + name + ")"});
+            } else if (const auto *UO = dyn_cast<UnaryOperator>(Access)) {
+                edits.push_back({offsetOf(UO->getBeginLoc()), endOf(UO->getEndLoc()), atomicHelper(UO) + "(" + name + ", 1)"});
+            } else {
+                const auto *BO = cast<BinaryOperator>(Access);
+                edits.push_back({offsetOf(BO->getLHS()->getBeginLoc()), endOf(BO->getOperatorLoc()), atomicHelper(BO) + "(" + name + ", "});
+                unsigned rhsEnd = endOf(BO->getRHS()->getEndLoc());
+                edits.push_back({rhsEnd, rhsEnd, ")"});
+            }
+        }
+        std::sort(edits.begin(), edits.end(), [](const Edit &a, const Edit &b) { return a.begin > b.begin; });
+        for (const Edit &edit : edits)
+            text.replace(edit.begin, edit.end - edit.begin, edit.text);
+
+        if (lockedGlobals.empty())
+            return text;
+        std::string addresses;
+        for (const std::string &global : lockedGlobals)
+            addresses += (addresses.empty() ? "&" : ", &") + global;
+        return "globalLockedRead({" + addresses + "}, [&] { return " + text + "; })";
+    }
+
+    // The parameter references and synchronized globals argumentText rewrites.
+    void collectArgumentRefs(const Stmt *S, std::vector<const DeclRefExpr *> &refs) {
+        if (!S)
+            return;
+        if (const auto *DRE = dyn_cast<DeclRefExpr>(S)) {
+            if (isa<ParmVarDecl>(DRE->getDecl()))
+                refs.push_back(DRE);
+            else if (const auto *VD = dyn_cast<VarDecl>(DRE->getDecl()))
+                if (isSyncedGlobal(VD, TheRewriter.getSourceMgr()) && globalSyncFor(VD) != GlobalSync::None)
+                    refs.push_back(DRE);
+        }
+        for (const Stmt *Child : S->children())
+            collectArgumentRefs(Child, refs);
+    }
+
+    SourceLocation lineStartOf(SourceLocation Loc) {
+        const SourceManager &SM = TheRewriter.getSourceMgr();
+        SourceLocation expansionLoc = SM.getExpansionLoc(Loc);
+        unsigned colNo = SM.getColumnNumber(SM.getFileID(expansionLoc), SM.getFileOffset(expansionLoc));
+        return Loc.getLocWithOffset(-static_cast<int>(colNo) + 1);
+    }
+
+    static bool referencesGlobal(const Stmt *S) {
+        if (!S)
+            return false;
+        if (const auto *DRE = dyn_cast<DeclRefExpr>(S))
+            if (const auto *VD = dyn_cast<VarDecl>(DRE->getDecl()))
+                if (VD->hasGlobalStorage())
+                    return true;
+        for (const Stmt *Child : S->children())
+            if (referencesGlobal(Child))
+                return true;
+        return false;
+    }
+
+    // Whether S may leave its block, or be jumped into: a deferred call's CallResult
+    // lives in the block, so it has to be joined before such a statement runs.
+    static bool mayLeaveBlock(const Stmt *S) {
+        if (!S)
+            return false;
+        if (isa<ReturnStmt, BreakStmt, ContinueStmt, GotoStmt, IndirectGotoStmt, LabelStmt, SwitchCase,
+                CXXThrowExpr, CoreturnStmt>(S))
+            return true;
+        for (const Stmt *Child : S->children())
+            if (mayLeaveBlock(Child))
+                return true;
+        return false;
+    }
+
+    // A non-void call whose join can be deferred: the whole initializer of a local
+    // declared on its own, the whole right-hand side of an assignment to a local, or
+    // a call whose result is discarded, in a statement of a block that starts on the
+    // call's line. The arguments must make no calls, touch no globals (their locks
+    // wrap the call's line) and pass nothing by pointer or reference, since the
+    // caller keeps running while the callee does. Reports the statement and the
+    // local that receives the result.
+    bool deferrableCall(const CallExpr *CE, const Stmt *&Statement, const VarDecl *&Var) {
+        if (!Context || CE->getBeginLoc().isMacroID() || CE->getEndLoc().isMacroID())
+            return false;
+        for (const ParmVarDecl *Param : CE->getDirectCallee()->parameters())
+            if (Param->getType()->isPointerType() || Param->getType()->isReferenceType())
+                return false;
+        for (const Expr *Arg : CE->arguments())
+            if (containsCall(Arg) || referencesGlobal(Arg))
+                return false;
+
+        const Expr *Outer = CE;
+        DynTypedNodeList Parents = Context->getParents(*CE);
+        while (!Parents.empty() && Parents[0].get<ImplicitCastExpr>()) {
+            Outer = Parents[0].get<ImplicitCastExpr>();
+            Parents = Context->getParents(*Outer);
+        }
+        if (Parents.empty())
+            return false;
+        if (const auto *VD = Parents[0].get<VarDecl>()) {
+            DynTypedNodeList DeclParents = Context->getParents(*VD);
+            const auto *DS = DeclParents.empty() ? nullptr : DeclParents[0].get<DeclStmt>();
+            if (!DS || !DS->isSingleDecl() || !VD->hasLocalStorage() || VD->getInit() != Outer)
+                return false;
+            Statement = DS;
+            Var = VD;
+        } else if (const auto *BO = Parents[0].get<BinaryOperator>()) {
+            const auto *LHS = dyn_cast<DeclRefExpr>(BO->getLHS()->IgnoreParens());
+            const auto *VD = LHS ? dyn_cast<VarDecl>(LHS->getDecl()) : nullptr;
+            if (BO->getOpcode() != BO_Assign || BO->getRHS() != Outer || !VD || !VD->hasLocalStorage() ||
+                isa<ParmVarDecl>(VD))
+                return false;
+            Statement = BO;
+            Var = VD;
+        } else if (Parents[0].get<CompoundStmt>() && Outer == CE) {
+            // The result is discarded, but the CallResult still has to be joined.
+            Statement = CE;
+            Var = nullptr;
+        } else {
+            return false;
+        }
+
+        DynTypedNodeList StmtParents = Context->getParents(*Statement);
+        const SourceManager &SM = Context->getSourceManager();
+        return !StmtParents.empty() && StmtParents[0].get<CompoundStmt>() && !Statement->getBeginLoc().isMacroID() &&
+               SM.getSpellingLineNumber(Statement->getBeginLoc()) == SM.getSpellingLineNumber(CE->getBeginLoc());
+    }
+
+    // Where a deferred call is joined: before the first later statement of its block
+    // that references Var (if any), may leave the block, touches a global or makes a
+    // call, since the callee may write globals or whatever those calls read; other
+    // program calls that only dispatch (see isIndependentDispatch) do not join it.
+    // Otherwise before the block's closing brace. Fails when that point shares a
+    // line with the call's statement.
+    bool joinLocation(const Stmt *Statement, const VarDecl *Var, SourceLocation &Loc) {
+        const auto *Block = Context->getParents(*Statement)[0].get<CompoundStmt>();
+        const SourceManager &SM = Context->getSourceManager();
+        unsigned line = SM.getExpansionLineNumber(Statement->getEndLoc());
+        auto it = std::find(Block->body_begin(), Block->body_end(), Statement);
+        for (++it; it != Block->body_end(); ++it) {
+            bool joins = (Var && referencesDecl(*it, Var)) || mayLeaveBlock(*it) ||
+                         ((referencesGlobal(*it) || containsCall(*it)) && !isIndependentDispatch(*it));
+            if (!joins)
+                continue;
+            SourceLocation begin = SM.getExpansionLoc((*it)->getBeginLoc());
+            if (SM.getExpansionLineNumber(begin) == line)
+                return false;
+            Loc = lineStartOf(begin);
+            return true;
+        }
+        if (SM.getExpansionLineNumber(Block->getRBracLoc()) == line)
+            return false;
+        Loc = Block->getRBracLoc();
+        return true;
+    }
+
+    // A statement that only calls a program function, on arguments that make no calls
+    // and touch no globals, and keeps or discards its result in a local: it is
+    // dispatched like the deferred call, so the two run side by side.
+    static bool isIndependentDispatch(const Stmt *S) {
+        const Expr *E = dyn_cast<Expr>(S);
+        if (const auto *DS = dyn_cast<DeclStmt>(S)) {
+            const auto *VD = DS->isSingleDecl() ? dyn_cast<VarDecl>(DS->getSingleDecl()) : nullptr;
+            E = VD && VD->hasLocalStorage() ? VD->getInit() : nullptr;
+        } else if (const auto *BO = dyn_cast<BinaryOperator>(S)) {
+            const auto *LHS = dyn_cast<DeclRefExpr>(BO->getLHS()->IgnoreParens());
+            const auto *VD = LHS ? dyn_cast<VarDecl>(LHS->getDecl()) : nullptr;
+            if (BO->getOpcode() == BO_Assign && VD && VD->hasLocalStorage())
+                E = BO->getRHS();
+        }
+        const auto *CE = E ? dyn_cast<CallExpr>(E->IgnoreImpCasts()) : nullptr;
+        if (!CE || !CE->getDirectCallee() ||
+            cppFunctionNamesSet.find(CE->getDirectCallee()->getNameAsString()) == cppFunctionNamesSet.end())
+            return false;
+        for (const Expr *Arg : CE->arguments())
+            if (containsCall(Arg) || referencesGlobal(Arg))
+                return false;
+        return true;
+    }
+
+    static bool containsCall(const Stmt *S) {
+        if (!S)
+            return false;
+        if (isa<CallExpr>(S))
+            return true;
+        for (const Stmt *Child : S->children())
+            if (containsCall(Child))
+                return true;
+        return false;
+    }
+
+    // A statement that is nothing but a call to a dispatched void function whose
+    // arguments make no calls of their own.
+    static bool isBatchableCall(const Stmt *S) {
+        const auto *CE = dyn_cast_or_null<CallExpr>(S);
+        if (!CE || !CE->getDirectCallee() || !CE->getDirectCallee()->getReturnType()->isVoidType())
+            return false;
+        if (cppFunctionNamesSet.find(CE->getDirectCallee()->getNameAsString()) == cppFunctionNamesSet.end())
+            return false;
+        for (const Expr *Arg : CE->arguments())
+            if (containsCall(Arg))
+                return false;
+        return true;
+    }
+
+    // Whether CE belongs to a run of two or more batchable sibling statements, each on
+    // its own line (the rewriter inserts dispatch code at the start of the call's line).
+    // Reports the run's first call and whether CE is its last.
+    bool batchRun(const CallExpr *CE, const CallExpr *&First, bool &IsLast) {
+        if (!Context || !isBatchableCall(CE))
+            return false;
+        DynTypedNodeList Parents = Context->getParents(*CE);
+        const CompoundStmt *Block = Parents.empty() ? nullptr : Parents[0].get<CompoundStmt>();
+        if (!Block)
+            return false;
+
+        std::vector<const Stmt *> Body(Block->body_begin(), Block->body_end());
+        size_t Index = std::find(Body.begin(), Body.end(), CE) - Body.begin();
+        if (Index == Body.size())
+            return false;
+        const SourceManager &SM = Context->getSourceManager();
+        auto ownLines = [&](size_t a, size_t b) {
+            return isBatchableCall(Body[b]) &&
+                   SM.getExpansionLineNumber(Body[a]->getBeginLoc()) != SM.getExpansionLineNumber(Body[b]->getBeginLoc());
+        };
+        size_t Begin = Index, End = Index + 1;
+        while (Begin > 0 && ownLines(Begin, Begin - 1))
+            --Begin;
+        while (End < Body.size() && ownLines(End - 1, End))
+            ++End;
+        if (End - Begin < 2)
+            return false;
+        First = cast<CallExpr>(Body[Begin]);
+        IsLast = Index + 1 == End;
+        return true;
+    }
+
     Rewriter &TheRewriter;
     const FunctionDecl *CurrentFunction;
-    std::string currentSuffix;
-    std::vector<std::string> nonVoidCallees;
-    std::set<unsigned> processedGlobalLines;
+    std::set<const DeclRefExpr *> argumentRefs;        // rewritten by argumentText
+    unsigned callSiteCount = 0;
+    unsigned lambdaDepth = 0;
+    std::string currentBatch;   // TaskBatch collecting the current run of calls (see batchRun)
+    struct DeferredJoin {
+        SourceLocation at;
+        std::string code;
+    };
+    std::vector<DeferredJoin> deferredJoins;   // emitted by emitDeferredJoins
+    ASTContext *Context = nullptr;
+
+    struct LockedLine {
+        SourceLocation start;
+        SourceLocation end;
+        std::set<std::string> globals;
+    };
+    std::map<unsigned, LockedLine> lockedLines;
 };
 
 
@@ -288,6 +1624,22 @@ private:
     MatchFinder Matcher;
 };
 
+// Rewritten files are staged in their record and written only after every TU has
+// been parsed, so no TU can read a file another TU is still writing. A file staged
+// twice in one run keeps its first rewrite.
+static void stageRewrite(const std::string &path, std::string contents) {
+    std::lock_guard<std::mutex> lock(fileRecordsMutex);
+    FileRecord &record = fileRecords[path];
+    if (record.rewritten) {
+        std::cerr << "Warning: " << path << " was rewritten by more than one translation unit; keeping the first.\n";
+        return;
+    }
+    record.output = std::move(contents);
+    record.hasOutput = true;
+    record.rewritten = true;
+    record.fresh = true;
+}
+
 class FunctionFrontendAction : public ASTFrontendAction {
 public:
     FunctionFrontendAction() {}
@@ -299,11 +1651,11 @@ public:
 
         if(IsCppFile) TheRewriter.InsertText(StartLoc, "#include \"obfuscator.hpp\"\n", true, true);
 
-        std::error_code EC;
-        llvm::raw_fd_ostream OutFile(SourceFilePath, EC, llvm::sys::fs::OF_Text);
-        if (!EC) {
-            TheRewriter.getEditBuffer(MainFileID).write(OutFile);
-        }
+        std::string contents;
+        llvm::raw_string_ostream Out(contents);
+        TheRewriter.getEditBuffer(MainFileID).write(Out);
+        Out.flush();
+        stageRewrite(canonicalPath(SourceFilePath), std::move(contents));
     }
 
     std::unique_ptr<ASTConsumer> CreateASTConsumer(CompilerInstance &CI, StringRef file) override {
@@ -319,24 +1671,294 @@ private:
     bool IsCppFile;
 };
 
-static llvm::cl::OptionCategory MyToolCategory("my-tool options");
+static llvm::cl::opt<unsigned> Jobs("j",
+    llvm::cl::desc("Number of translation units to parse and rewrite in parallel (0 = one per hardware thread)"),
+    llvm::cl::init(1), llvm::cl::cat(MyToolCategory));
+
+// Runs ActionT over each file as its own translation unit on up to `jobs` threads.
+// Returns non-zero if any file failed.
+template <typename ActionT>
+static int runTool(const CompilationDatabase &Compilations, const std::vector<std::string> &files, unsigned jobs) {
+    if (files.empty())
+        return 0;
+    if (jobs <= 1 || files.size() <= 1) {
+        ClangTool Tool(Compilations, files);
+        return Tool.run(newFrontendActionFactory<ActionT>().get());
+    }
+
+    std::atomic<size_t> next{0};
+    std::atomic<int> failures{0};
+    auto worker = [&]() {
+        // ClangTool changes the working directory of its file system, so each thread needs its own.
+        llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> FS(llvm::vfs::createPhysicalFileSystem().release());
+        for (size_t i = next++; i < files.size(); i = next++) {
+            ClangTool Tool(Compilations, {files[i]}, std::make_shared<PCHContainerOperations>(), FS);
+            if (Tool.run(newFrontendActionFactory<ActionT>().get()) != 0)
+                failures++;
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < jobs && i < files.size(); ++i)
+        threads.emplace_back(worker);
+    for (auto &thread : threads)
+        thread.join();
+    return failures.load() ? 1 : 0;
+}
+
+static llvm::cl::opt<bool> DumpCosts("dump-costs",
+    llvm::cl::desc("Print the static cost expression of every dispatched function ($n is its n-th parameter)"),
+    llvm::cl::cat(MyToolCategory));
+
+static llvm::cl::opt<std::string> CacheDir("cache-dir",
+    llvm::cl::desc("Directory for the incremental rewrite cache (disabled when empty)"),
+    llvm::cl::value_desc("dir"), llvm::cl::cat(MyToolCategory));
+
+static llvm::cl::opt<std::string> OutputDir("o",
+    llvm::cl::desc("Write rewritten files under this directory instead of overwriting the input"),
+    llvm::cl::value_desc("dir"), llvm::cl::cat(MyToolCategory));
+
+// Bump whenever the rewriter's output changes for the same input, so old cache entries miss.
+static const char *const REWRITE_CACHE_VERSION = "obfuscator-rewrite-cache 8";
+
+static uint64_t hashBytes(llvm::StringRef data, uint64_t hash = 0xcbf29ce484222325ull) {
+    for (unsigned char c : data) {
+        hash ^= c;
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+static bool readFile(const std::string &path, std::string &contents) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+        return false;
+    contents.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    return true;
+}
+
+// Content hash of a file, computed once per run; 0 if it cannot be read.
+static uint64_t contentHash(const std::string &path) {
+    static std::map<std::string, uint64_t> hashes;
+    auto it = hashes.find(path);
+    if (it != hashes.end())
+        return it->second;
+    std::string contents;
+    uint64_t hash = readFile(path, contents) ? hashBytes(contents) | 1 : 0;
+    hashes[path] = hash;
+    return hash;
+}
+
+// Hash of everything compiled in from cpp_functions.h.
+static uint64_t costTableHash() {
+    std::map<std::string, std::string> costs(cppFunctionsMap.begin(), cppFunctionsMap.end());
+    std::set<std::string> names(cppFunctionNamesSet.begin(), cppFunctionNamesSet.end());
+    uint64_t hash = hashBytes(REWRITE_CACHE_VERSION);
+    for (const auto &entry : costs)
+        hash = hashBytes(entry.second + "\n", hashBytes(entry.first + "=", hash));
+    for (const auto &name : names)
+        hash = hashBytes(name + "\n", hash);
+    std::set<std::string> profiled(cppProfiledFunctionsSet.begin(), cppProfiledFunctionsSet.end());
+    for (const auto &name : profiled)
+        hash = hashBytes("profiled " + name + "\n", hash);
+    return hashBytes(useCoroutines ? "coroutines" : "spin", hash);
+}
+
+static uint64_t globalUsageHash() {
+    uint64_t hash = hashBytes("globals");
+    for (const auto &entry : globalUsage)
+        hash = hashBytes(entry.first + (entry.second.written ? " w" : " r") + (entry.second.needsLock ? "l\n" : "a\n"), hash);
+    return hashBytes(CostModel.getValue() + " " + staticCostScaleText() + "\n", hash);
+}
+
+// Hash of the static costs a file's rewrite prints: only those of the functions it
+// calls, so editing one function leaves the files that never call it cached.
+static uint64_t calleeCostHash(const FileRecord &record) {
+    uint64_t hash = hashBytes("costs");
+    for (const std::string &name : record.callees) {
+        auto it = staticCosts.find(name);
+        std::string text = name;
+        if (it != staticCosts.end()) {
+            for (const std::string &param : it->second.params)
+                text += " " + param;
+            text += " = " + it->second.expression;
+        }
+        hash = hashBytes(text + "\n", hash);
+    }
+    return hash;
+}
+
+static uint64_t commandHash(const CompilationDatabase &Compilations, const std::string &path) {
+    uint64_t hash = hashBytes(REWRITE_CACHE_VERSION);
+    for (const CompileCommand &command : Compilations.getCompileCommands(path)) {
+        hash = hashBytes(command.Directory + "\n", hash);
+        for (const std::string &arg : command.CommandLine)
+            hash = hashBytes(arg + "\n", hash);
+    }
+    return hash;
+}
+
+// One cache entry per input path:
+//   <REWRITE_CACHE_VERSION>
+//   command <hash>                 compile command the entry was produced with
+//   dep <content hash> <path>      one per user file the TU read
+//   usage <written> <lock> <name>  globals the file touches
+//   cost <name> <n> <param>... <expression>  static cost of a function defined here
+//   call <name>                    dispatched function the file calls
+//   output <key> <size>            then <size> bytes of rewritten text
+// The dependencies and usage are reused when every dependency still hashes the
+// same; the output is reused when its key (command, cost table, global
+// classification, static costs of the callees) also matches.
+static std::string cacheEntryPath(const std::string &path) {
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.entry", (unsigned long long)hashBytes(path));
+    return (fs::path(CacheDir.getValue()) / name).string();
+}
+
+static void loadCacheEntry(const std::string &path, uint64_t command, FileRecord &record) {
+    std::ifstream in(cacheEntryPath(path), std::ios::binary);
+    std::string line;
+    if (!in || !std::getline(in, line) || line != REWRITE_CACHE_VERSION)
+        return;
+
+    FileRecord cached;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        std::string tag;
+        fields >> tag;
+        if (tag == "command") {
+            uint64_t hash = 0;
+            fields >> hash;
+            if (hash != command)
+                return;
+        } else if (tag == "dep") {
+            uint64_t hash = 0;
+            std::string dependency;
+            fields >> hash;
+            std::getline(fields >> std::ws, dependency);
+            if (contentHash(dependency) != hash)
+                return;
+            cached.dependencies.insert(dependency);
+        } else if (tag == "cost") {
+            std::string name;
+            size_t count = 0;
+            StaticCost cost;
+            fields >> name >> count;
+            cost.params.resize(count);
+            for (std::string &param : cost.params)
+                fields >> param;
+            std::getline(fields >> std::ws, cost.expression);
+            cached.costs[name] = cost;
+        } else if (tag == "call") {
+            std::string name;
+            fields >> name;
+            cached.callees.insert(name);
+        } else if (tag == "usage") {
+            GlobalUsage usage;
+            std::string name;
+            fields >> usage.written >> usage.needsLock;
+            std::getline(fields >> std::ws, name);
+            cached.usage[name] = usage;
+        } else if (tag == "output") {
+            size_t size = 0;
+            fields >> cached.outputKey >> size;
+            cached.output.resize(size);
+            if (!in.read(&cached.output[0], size))
+                return;
+            cached.hasOutput = true;
+        }
+    }
+
+    if (cached.dependencies.count(path) == 0)
+        return;
+    cached.usageKnown = true;
+    record = std::move(cached);
+}
+
+static void saveCacheEntry(const std::string &path, uint64_t command, const FileRecord &record) {
+    std::string contents = std::string(REWRITE_CACHE_VERSION) + "\n";
+    contents += "command " + std::to_string(command) + "\n";
+    for (const std::string &dependency : record.dependencies)
+        contents += "dep " + std::to_string(contentHash(dependency)) + " " + dependency + "\n";
+    for (const auto &entry : record.usage)
+        contents += "usage " + std::to_string(entry.second.written) + " " + std::to_string(entry.second.needsLock) + " " + entry.first + "\n";
+    for (const auto &entry : record.costs) {
+        contents += "cost " + entry.first + " " + std::to_string(entry.second.params.size());
+        for (const std::string &param : entry.second.params)
+            contents += " " + param;
+        contents += " " + entry.second.expression + "\n";
+    }
+    for (const std::string &name : record.callees)
+        contents += "call " + name + "\n";
+    if (record.hasOutput)
+        contents += "output " + std::to_string(record.outputKey) + " " + std::to_string(record.output.size()) + "\n" + record.output;
+
+    // Write then rename, so a crash never leaves a truncated entry behind.
+    std::string entryPath = cacheEntryPath(path);
+    std::string tempPath = entryPath + ".tmp";
+    {
+        std::ofstream out(tempPath, std::ios::binary | std::ios::trunc);
+        out << contents;
+        if (!out)
+            return;
+    }
+    std::error_code EC;
+    fs::rename(tempPath, entryPath, EC);
+}
+
+static std::string outputPathFor(const std::string &path, const fs::path &inputRoot) {
+    if (OutputDir.empty())
+        return path;
+    fs::path target = fs::path(OutputDir.getValue()) / fs::path(path).lexically_relative(inputRoot);
+    std::error_code EC;
+    fs::create_directories(target.parent_path(), EC);
+    return target.string();
+}
+
+static bool commitRewrites(const fs::path &inputRoot) {
+    bool ok = true;
+    for (const auto &entry : fileRecords) {
+        if (!entry.second.hasOutput)
+            continue;
+        std::string target = outputPathFor(entry.first, inputRoot);
+        std::error_code EC;
+        llvm::raw_fd_ostream OutFile(target, EC, llvm::sys::fs::OF_Text);
+        if (EC) {
+            std::cerr << "Cannot write " << target << ": " << EC.message() << "\n";
+            ok = false;
+            continue;
+        }
+        OutFile << entry.second.output;
+    }
+    return ok;
+}
+
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
 
 int main(int argc, const char **argv) {
     if (argc > 1) {
-        std::vector<std::string> cppFiles, headerFiles;
+        std::vector<std::string> cppFiles, headerFiles, runtimeFiles;
         fs::path inputPath(argv[1]);
+        fs::path inputRoot(canonicalPath(inputPath.string()));
 
         for (const auto &entry : fs::recursive_directory_iterator(inputPath)) {
             if (entry.is_regular_file()) {
                 auto ext = entry.path().extension().string();
                 auto filename = entry.path().filename().string();
+                std::string path = canonicalPath(entry.path().string());
 
-                if (filename == "obfuscator.cpp" || filename == "obfuscator.hpp") continue;
+                if (filename == "obfuscator.cpp" || filename == "obfuscator.hpp" ||
+                    filename == "obfuscation_runtime.hpp") {
+                    runtimeFiles.push_back(path);
+                    continue;
+                }
 
                 if (ext == ".cpp") {
-                    cppFiles.push_back(entry.path().string());
+                    cppFiles.push_back(path);
                 } else if (ext == ".h" || ext == ".hpp") {
-                    headerFiles.push_back(entry.path().string());
+                    headerFiles.push_back(path);
                 }
             }
         }
@@ -346,26 +1968,105 @@ int main(int argc, const char **argv) {
             return 1;
         }
         CommonOptionsParser &OptionsParser = ExpectedParser.get();
+        const CompilationDatabase &Compilations = OptionsParser.getCompilations();
+        unsigned jobs = Jobs ? Jobs.getValue() : std::max(1u, std::thread::hardware_concurrency());
+        bool useCache = !CacheDir.empty();
+        auto start = std::chrono::steady_clock::now();
+
+        std::vector<std::string> allFiles(cppFiles);
+        allFiles.insert(allFiles.end(), headerFiles.begin(), headerFiles.end());
+        std::map<std::string, uint64_t> commands;
+        for (const std::string &file : allFiles) {
+            commands[file] = commandHash(Compilations, file);
+            FileRecord &record = fileRecords[file];
+            if (useCache)
+                loadCacheEntry(file, commands[file], record);
+        }
 
-        ClangTool CppTool(OptionsParser.getCompilations(), cppFiles);
-        int result = CppTool.run(newFrontendActionFactory<FunctionFrontendAction>().get());
+        // Globals are classified from their uses in every file before any file is rewritten.
+        // Files whose dependencies are unchanged reuse the usage recorded in the cache.
+        std::vector<std::string> usageFiles;
+        for (const std::string &file : allFiles)
+            if (!fileRecords[file].usageKnown)
+                usageFiles.push_back(file);
+        auto phaseStart = std::chrono::steady_clock::now();
+        if (runTool<GlobalUsageAction>(Compilations, usageFiles, jobs) != 0) {
+            std::cerr << "Global usage analysis failed." << std::endl;
+            return 1;
+        }
+        for (const std::string &file : allFiles) {
+            for (const auto &entry : fileRecords[file].usage) {
+                GlobalUsage &usage = globalUsage[entry.first];
+                usage.written |= entry.second.written;
+                usage.needsLock |= entry.second.needsLock;
+            }
+            staticCosts.insert(fileRecords[file].costs.begin(), fileRecords[file].costs.end());
+        }
+        calibrateStaticCosts();
+        if (DumpCosts) {
+            for (const auto &entry : staticCosts)
+                std::cout << entry.first << ": " << entry.second.expression << "\n";
+        }
+        std::cout << "Global usage analysis (" << usageFiles.size() << " parsed): " << secondsSince(phaseStart) << " s\n";
+
+        // A cached rewrite is only valid for the same command, cost table, global
+        // classification and static costs of the functions the file calls.
+        uint64_t tableHash = costTableHash();
+        uint64_t globalsHash = globalUsageHash();
+        std::vector<std::string> staleCppFiles, staleHeaderFiles;
+        for (const std::string &file : allFiles) {
+            FileRecord &record = fileRecords[file];
+            uint64_t key = hashBytes(std::to_string(globalsHash), hashBytes(std::to_string(tableHash), commands[file]));
+            key = hashBytes(std::to_string(calleeCostHash(record)), key);
+            if (record.hasOutput && record.outputKey == key)
+                continue;
+            record.hasOutput = false;
+            record.outputKey = key;
+            bool isCpp = fs::path(file).extension() == ".cpp";
+            (isCpp ? staleCppFiles : staleHeaderFiles).push_back(file);
+        }
+        std::cout << "Rewrite cache: " << allFiles.size() - staleCppFiles.size() - staleHeaderFiles.size()
+                  << " of " << allFiles.size() << " files up to date\n";
+
+        phaseStart = std::chrono::steady_clock::now();
+        int result = runTool<FunctionFrontendAction>(Compilations, staleCppFiles, jobs);
         if (result != 0) {
             std::cerr << "C++ file rewriting failed." << std::endl;
             return result;
         }
+        std::cout << "Rewrote " << staleCppFiles.size() << " C++ files: " << secondsSince(phaseStart) << " s\n";
 
-        if (!headerFiles.empty()) {
+        if (!staleHeaderFiles.empty()) {
             std::cout << "Processing header files:\n";
-            for (const auto &file : headerFiles) {
+            for (const auto &file : staleHeaderFiles) {
                 std::cout << " - " << file << "\n";
             }
-            ClangTool HeaderTool(OptionsParser.getCompilations(), headerFiles);
-            result = HeaderTool.run(newFrontendActionFactory<FunctionFrontendAction>().get());
+            phaseStart = std::chrono::steady_clock::now();
+            result = runTool<FunctionFrontendAction>(Compilations, staleHeaderFiles, jobs);
             if (result != 0) {
                 std::cerr << "Header file rewriting failed." << std::endl;
                 return result;
             }
+            std::cout << "Rewrote " << staleHeaderFiles.size() << " header files: " << secondsSince(phaseStart) << " s\n";
+        }
+
+        // Entries are saved before anything is written so dependency hashes describe the input.
+        if (useCache) {
+            std::error_code EC;
+            fs::create_directories(CacheDir.getValue(), EC);
+            for (const std::string &file : allFiles)
+                if (fileRecords[file].fresh)
+                    saveCacheEntry(file, commands[file], fileRecords[file]);
+        }
+        if (!commitRewrites(inputRoot))
+            return 1;
+        if (!OutputDir.empty()) {
+            for (const std::string &file : runtimeFiles) {
+                std::error_code EC;
+                fs::copy_file(file, outputPathFor(file, inputRoot), fs::copy_options::overwrite_existing, EC);
+            }
         }
+        std::cout << "Total with " << jobs << " job(s): " << secondsSince(start) << " s\n";
     }
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,2572 @@
+#ifndef OBFUSCATION_RUNTIME_HPP
+#define OBFUSCATION_RUNTIME_HPP
+
+// Header-only scheduler behind the rewritten programs. Everything that does not
+// depend on the program lives here; the generated obfuscator.hpp/.cpp only add
+// the program's functions (FunctionID, argument structs, names) as a Config and
+// the thin wrappers the rewritten code calls.
+//
+// ObfuscationRuntime<Config> is specialized at compile time on the queue type,
+// the worker-selection policy, the idle policy and the worker count Config
+// names (see RuntimeDefaults). Define OBFUSCATION_COROUTINES before including
+// this header, and compile with -std=c++20, for the coroutine runtime.
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <deque>
+#include <random>
+#include <thread>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <initializer_list>
+#include <limits>
+#include <map>
+#include <new>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <utility>
+#ifdef OBFUSCATION_COROUTINES
+#include <coroutine>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+using namespace std;
+
+// Argument bytes a Task carries inline. Argument structs that fit and are
+// trivially copyable travel in the task itself; others are boxed in their
+// function's arena and the payload holds the slot index (see makeTask).
+constexpr size_t TASK_PAYLOAD_BYTES = 32;
+
+struct Task;
+#ifdef OBFUSCATION_COROUTINES
+struct ObfTask;
+using TaskResult = ObfTask;
+#else
+using TaskResult = void;
+#endif
+// Trampoline that unpacks a task's arguments and calls its function (runCall).
+using TaskEntry = TaskResult (*)(int thread_idx, Task &task);
+
+// Queue level of a task. Each worker keeps one queue per level and pops and
+// steals from the highest non-empty one, so results someone waits for are not
+// queued behind fire-and-forget work (see submitAwaitedTask).
+enum TaskPriority : uint8_t
+{
+    PRIORITY_DETACHED, // nobody waits for the task
+    PRIORITY_AWAITED,  // a caller waits for its result
+    PRIORITY_CRITICAL, // a caller that is itself awaited waits for it
+    TASK_PRIORITIES
+};
+
+#ifndef OBFUSCATION_COROUTINES
+// What a BasicTaskGroup waits on: its tasks that have not finished yet.
+struct alignas(64) TaskGroupState
+{
+    atomic<int> pending{0};
+};
+#endif
+
+struct Task
+{
+    int funcId = 0;
+    int cost = 0;
+    TaskEntry run = nullptr;
+#ifndef OBFUSCATION_COROUTINES
+    TaskGroupState *group = nullptr;  // set by submitTask(s) to the submitting thread's current group
+    int depth = 0;           // spawns between this task and one submitted from outside the pool
+    bool loopChunk = false;  // a range of parallelFor iterations, profiled per iteration
+#endif
+    uint8_t priority = PRIORITY_DETACHED;  // its TaskPriority, the queue level it waits at
+    alignas(uint64_t) unsigned char payload[TASK_PAYLOAD_BYTES] = {};
+#ifdef OBFUSCATION_COROUTINES
+    void *continuation = nullptr;
+#endif
+#ifdef OBFUSCATION_PROFILE
+    uint64_t submitTicks = 0;  // set by submitTask(s) to time the dispatch
+#endif
+};
+
+// Queues. A worker's queue is pushed to and popped from by its owner, newest
+// first, and stolen from by other workers, oldest first; empty() and size()
+// may be approximate. Config::Queue picks one.
+
+// Chase-Lev work-stealing deque. The owning worker pushes and pops at the
+// bottom without locks; any other thread may steal from the top.
+template <typename T>
+class WorkStealingDeque
+{
+    static_assert(is_trivially_copyable<T>::value, "deque items are copied word by word");
+    static constexpr size_t WORDS = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+    struct Slot
+    {
+        atomic<uint64_t> words[WORDS];
+    };
+
+    struct Buffer
+    {
+        int64_t capacity;
+        Slot *slots;
+
+        explicit Buffer(int64_t cap) : capacity(cap), slots(new Slot[cap]) {}
+        ~Buffer() { delete[] slots; }
+
+        void put(int64_t i, const T &item)
+        {
+            uint64_t raw[WORDS] = {};
+            memcpy(raw, &item, sizeof(T));
+            Slot &slot = slots[i & (capacity - 1)];
+            for (size_t w = 0; w < WORDS; w++)
+                slot.words[w].store(raw[w], memory_order_relaxed);
+        }
+
+        T get(int64_t i) const
+        {
+            uint64_t raw[WORDS];
+            const Slot &slot = slots[i & (capacity - 1)];
+            for (size_t w = 0; w < WORDS; w++)
+                raw[w] = slot.words[w].load(memory_order_relaxed);
+            T item;
+            memcpy(&item, raw, sizeof(T));
+            return item;
+        }
+    };
+
+public:
+    explicit WorkStealingDeque(int64_t capacity = 1024) : top(0), bottom(0), buffer(new Buffer(capacity)) {}
+
+    ~WorkStealingDeque()
+    {
+        delete buffer.load();
+        for (Buffer *old : retired)
+            delete old;
+    }
+
+    WorkStealingDeque(const WorkStealingDeque &) = delete;
+    WorkStealingDeque &operator=(const WorkStealingDeque &) = delete;
+
+    // Owner only.
+    void push(const T &item)
+    {
+        int64_t b = bottom.load(memory_order_relaxed);
+        int64_t t = top.load(memory_order_acquire);
+        Buffer *buf = buffer.load(memory_order_relaxed);
+        if (b - t > buf->capacity - 1)
+            buf = grow(buf, t, b);
+        buf->put(b, item);
+        atomic_thread_fence(memory_order_release);
+        bottom.store(b + 1, memory_order_relaxed);
+    }
+
+    // Owner only. Takes the most recently pushed item.
+    bool pop(T &item)
+    {
+        int64_t b = bottom.load(memory_order_relaxed) - 1;
+        Buffer *buf = buffer.load(memory_order_relaxed);
+        bottom.store(b, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        int64_t t = top.load(memory_order_relaxed);
+
+        if (t > b)
+        {
+            bottom.store(b + 1, memory_order_relaxed);
+            return false;
+        }
+
+        item = buf->get(b);
+        if (t == b)
+        {
+            bool won = top.compare_exchange_strong(t, t + 1, memory_order_seq_cst, memory_order_relaxed);
+            bottom.store(b + 1, memory_order_relaxed);
+            return won;
+        }
+        return true;
+    }
+
+    // Any thread. Takes the oldest item; fails spuriously if another thief wins the race.
+    bool steal(T &item)
+    {
+        int64_t t = top.load(memory_order_acquire);
+        atomic_thread_fence(memory_order_seq_cst);
+        int64_t b = bottom.load(memory_order_acquire);
+        if (t >= b)
+            return false;
+
+        Buffer *buf = buffer.load(memory_order_acquire);
+        item = buf->get(t);
+        return top.compare_exchange_strong(t, t + 1, memory_order_seq_cst, memory_order_relaxed);
+    }
+
+    bool empty() const
+    {
+        return bottom.load(memory_order_relaxed) <= top.load(memory_order_relaxed);
+    }
+
+    // Approximate while other threads push or steal; good enough for heuristics.
+    int64_t size() const
+    {
+        return max<int64_t>(0, bottom.load(memory_order_relaxed) - top.load(memory_order_relaxed));
+    }
+
+private:
+    Buffer *grow(Buffer *old, int64_t t, int64_t b)
+    {
+        Buffer *bigger = new Buffer(old->capacity * 2);
+        for (int64_t i = t; i < b; i++)
+            bigger->put(i, old->get(i));
+        // Thieves may still be reading the old buffer, so it is only freed with the deque.
+        retired.push_back(old);
+        buffer.store(bigger, memory_order_release);
+        return bigger;
+    }
+
+    alignas(64) atomic<int64_t> top;
+    alignas(64) atomic<int64_t> bottom;
+    atomic<Buffer *> buffer;
+    vector<Buffer *> retired;
+};
+
+// A deque behind one mutex: the baseline the work-stealing deque is measured against.
+template <typename T>
+class LockedQueue
+{
+public:
+    void push(const T &item)
+    {
+        lock_guard<mutex> lock(queueMutex);
+        items.push_back(item);
+        count.store((int64_t)items.size(), memory_order_relaxed);
+    }
+
+    bool pop(T &item)
+    {
+        lock_guard<mutex> lock(queueMutex);
+        if (items.empty())
+            return false;
+        item = items.back();
+        items.pop_back();
+        count.store((int64_t)items.size(), memory_order_relaxed);
+        return true;
+    }
+
+    bool steal(T &item)
+    {
+        lock_guard<mutex> lock(queueMutex);
+        if (items.empty())
+            return false;
+        item = items.front();
+        items.pop_front();
+        count.store((int64_t)items.size(), memory_order_relaxed);
+        return true;
+    }
+
+    bool empty() const { return count.load(memory_order_relaxed) == 0; }
+    int64_t size() const { return count.load(memory_order_relaxed); }
+
+private:
+    mutex queueMutex;
+    std::deque<T> items;
+    atomic<int64_t> count{0};
+};
+
+// Lock-free mailbox for tasks placed on a worker by a thread that does not own
+// its deque. Any thread may push; any thread may take the whole batch.
+class TaskInbox
+{
+    struct Node
+    {
+        Task task;
+        Node *next;
+    };
+
+public:
+    TaskInbox() : head(nullptr) {}
+
+    ~TaskInbox()
+    {
+        takeAll([](const Task &) {});
+    }
+
+    void push(const Task &task)
+    {
+        Node *node = new Node{task, head.load(memory_order_relaxed)};
+        while (!head.compare_exchange_weak(node->next, node, memory_order_release, memory_order_relaxed))
+            ;
+    }
+
+    // Hands every queued task to sink in submission order and returns how many there were.
+    template <typename Sink>
+    int takeAll(Sink &&sink)
+    {
+        Node *node = head.exchange(nullptr, memory_order_acquire);
+        Node *ordered = nullptr;
+        while (node)
+        {
+            Node *next = node->next;
+            node->next = ordered;
+            ordered = node;
+            node = next;
+        }
+
+        int taken = 0;
+        while (ordered)
+        {
+            Node *next = ordered->next;
+            sink(ordered->task);
+            delete ordered;
+            ordered = next;
+            taken++;
+        }
+        return taken;
+    }
+
+    bool empty() const
+    {
+        return head.load(memory_order_relaxed) == nullptr;
+    }
+
+private:
+    atomic<Node *> head;
+};
+
+// Online load estimation (Config::ADAPTIVE_LOAD, OBFUSCATION_ADAPTIVE_LOAD): every
+// task is timed, and each worker folds ADAPTIVE_BATCH samples of a function at a
+// time into that function's moving average, the new batch weighing
+// 1/ADAPTIVE_EMA_WEIGHT. A unit of estimated load is 2^ADAPTIVE_TICK_SHIFT ticks.
+// A worker's slowdown compares its batches with the averages, SPEED_ONE being par.
+constexpr int ADAPTIVE_BATCH = 16;
+constexpr int ADAPTIVE_EMA_WEIGHT = 4;
+constexpr int ADAPTIVE_TICK_SHIFT = 6;
+constexpr int SPEED_ONE = 256;
+
+// State owned by one worker. Each worker allocates its own block after it is
+// pinned, so first-touch places it on that worker's NUMA node. Fields that
+// other threads write start on a cache line of their own, so a producer
+// updating one worker's load or inbox never invalidates what its owner, or a
+// neighbouring worker, is reading.
+template <typename Queue>
+struct alignas(64) BasicWorkerState
+{
+    Queue deques[TASK_PRIORITIES];   // one per TaskPriority; a WorkStealingDeque keeps top and bottom on separate lines
+    alignas(64) TaskInbox inbox;     // pushed to by threads outside the pool
+    alignas(64) atomic<int> load{0}; // cost of queued tasks, read by the scheduler policy
+    alignas(64) atomic<uint64_t> submitted{0};  // tasks this worker submitted and finished;
+    atomic<uint64_t> finished{0};               // only it writes them (see quiescent)
+    atomic<int> slowdown{SPEED_ONE};            // and its speed against the estimates (see recordSample)
+    alignas(64) mutex parkMutex;     // the rest is only touched to park and wake
+    condition_variable parkCondition;
+    atomic<bool> sleeping{false};
+};
+
+using WorkerState = BasicWorkerState<WorkStealingDeque<Task>>;
+
+// What a scheduler policy reads the workers' loads through: one pointer per
+// worker to the load in its state block, or a plain array of counters.
+class LoadView
+{
+public:
+    LoadView(const atomic<int> *const *loads) : loads(loads), counters(nullptr) {}
+    LoadView(const atomic<int> *counters) : loads(nullptr), counters(counters) {}
+
+    int operator[](int worker) const
+    {
+        return (loads ? *loads[worker] : counters[worker]).load(memory_order_relaxed);
+    }
+
+private:
+    const atomic<int> *const *loads;
+    const atomic<int> *counters;
+};
+
+// Per-thread xorshift generator, so selection never shares RNG state between threads.
+inline unsigned int fastRandom()
+{
+    static thread_local unsigned int state = random_device{}() | 1u;
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+// Chooses which worker a task submitted from outside the pool is placed on.
+// loads gives each worker's pending cost. The runtime holds Config::Policy by
+// value, so the call is bound statically; the virtual interface only serves
+// code that swaps policies at run time, like Benchmark/policy_bench.
+class SchedulerPolicy
+{
+public:
+    virtual ~SchedulerPolicy() = default;
+    virtual int selectWorker(const LoadView &loads, int workers) = 0;
+};
+
+// The original heuristic: pick uniformly among workers at or below 80% of the
+// mean load, falling back to those at or below the median. O(N log N) per call.
+class BalancedRandomPolicy final : public SchedulerPolicy
+{
+public:
+    int selectWorker(const LoadView &loads, int workers) override
+    {
+        double sum = 0;
+        std::vector<int> values(workers);
+
+        for (int i = 0; i < workers; i++)
+        {
+            values[i] = loads[i];
+            sum += values[i];
+        }
+
+        double avg = sum / workers;
+        double threshold = avg * 0.8;
+
+        std::vector<int> candidateIndices;
+
+        for (int i = 0; i < workers; i++)
+        {
+            if (values[i] <= threshold)
+            {
+                candidateIndices.push_back(i);
+            }
+        }
+
+        if (candidateIndices.empty())
+        {
+            std::vector<int> sortedValues = values;
+            std::sort(sortedValues.begin(), sortedValues.end());
+            int median = sortedValues[workers / 2];
+
+            for (int i = 0; i < workers; i++)
+            {
+                if (values[i] <= median)
+                {
+                    candidateIndices.push_back(i);
+                }
+            }
+        }
+
+        return candidateIndices[fastRandom() % candidateIndices.size()];
+    }
+};
+
+// Power-of-two-choices: sample two distinct workers and keep the less loaded one.
+// Constant time and allocation free regardless of the worker count.
+class PowerOfTwoChoicesPolicy final : public SchedulerPolicy
+{
+public:
+    int selectWorker(const LoadView &loads, int workers) override
+    {
+        if (workers == 1)
+            return 0;
+
+        int first = fastRandom() % workers;
+        int second = fastRandom() % (workers - 1);
+        if (second >= first)
+            second++;
+
+        return loads[second] < loads[first] ? second : first;
+    }
+};
+
+constexpr size_t PARAM_ARENA_MAX_BYTES = size_t(64) << 20;
+
+// Granularity control defaults, overridable with OBFUSCATION_INLINE_COST and
+// OBFUSCATION_INLINE_DEPTH (see runInline). Benchmark/granularity_bench sweeps the threshold.
+constexpr int INLINE_COST_THRESHOLD = 32;
+constexpr int INLINE_QUEUE_DEPTH = 8;
+
+// Recursive call sites stop spawning this many spawns below a task submitted from
+// outside the pool (see runInlineRecursive); OBFUSCATION_SPAWN_DEPTH overrides it.
+constexpr int INLINE_SPAWN_DEPTH = 16;
+
+// Tasks a parallelFor range is split into per worker at most, whatever the
+// iterations cost (see parallelFor).
+constexpr int LOOP_CHUNKS_PER_WORKER = 8;
+
+// With call-graph affinity on (Config::AFFINITY_GROUPS), a task goes to its
+// function's worker group unless the worker picked there carries more than
+// AFFINITY_OVERLOAD times the load of a worker sampled from the whole pool.
+constexpr int AFFINITY_OVERLOAD = 2;
+
+// Idle policy defaults, overridable with OBFUSCATION_SPIN_US and OBFUSCATION_YIELD_US:
+// a worker that runs dry spins for IDLE_SPIN_MICROS, then yields for
+// IDLE_YIELD_MICROS, still polling for work, before it parks on its condition
+// variable. Only parked workers cost the submitter a futex wake.
+constexpr int IDLE_SPIN_MICROS = 20;
+constexpr int IDLE_YIELD_MICROS = 200;
+
+// Most tasks a TaskBatch holds before it submits on its own.
+constexpr int TASK_BATCH_MAX = 16;
+
+// exit() yields this many times while waiting for the tasks in flight, then
+// polls every EXIT_POLL_US microseconds.
+constexpr int EXIT_YIELD_POLLS = 1000;
+constexpr int EXIT_POLL_US = 50;
+
+#ifdef OBFUSCATION_PROFILE
+constexpr bool PROFILE_BUILD = true;
+#else
+constexpr bool PROFILE_BUILD = false;
+#endif
+
+// Largest cost a task carries, as the Obfuscator's static cost model caps it.
+constexpr long long TASK_COST_CAP = 1LL << 30;
+
+// The cost of a call as a task carries it: the estimate clamped to
+// [0, TASK_COST_CAP]. Generated <function>_cost functions return their cost
+// expression through it, whatever its type.
+template <typename T>
+inline int clampCost(T cost)
+{
+    if constexpr (is_floating_point<T>::value)
+    {
+        if (!(cost > 0))
+            return 0;
+        if (cost >= (T)TASK_COST_CAP)
+            return (int)TASK_COST_CAP;
+        return (int)cost;
+    }
+    else if constexpr (is_signed<T>::value)
+        return (int)min<long long>(max<long long>((long long)cost, 0), TASK_COST_CAP);
+    else
+        return (int)min<unsigned long long>((unsigned long long)cost, TASK_COST_CAP);
+}
+
+inline void cpuRelax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+// Polls for work under the idle policy. Returns true as soon as poll() does,
+// false once the spin and yield budgets are spent or stop() turns true.
+template <typename Poll, typename Stop>
+bool pollWhileIdle(int spinMicros, int yieldMicros, Poll poll, Stop stop)
+{
+    auto spinUntil = chrono::steady_clock::now() + chrono::microseconds(spinMicros);
+    auto yieldUntil = spinUntil + chrono::microseconds(yieldMicros);
+    while (!stop())
+    {
+        if (poll())
+            return true;
+        auto now = chrono::steady_clock::now();
+        if (now < spinUntil)
+        {
+            for (int i = 0; i < 32; i++)
+                cpuRelax();
+        }
+        else if (now < yieldUntil)
+            this_thread::yield();
+        else
+            return false;
+    }
+    return false;
+}
+
+// Idle policies: what a worker that ran dry does before it parks. wait()
+// returns true as soon as poll() finds work, false when the worker should park.
+// Config::Idle picks one.
+
+// Spin, then yield, then park (see pollWhileIdle).
+struct SpinYieldParkIdle
+{
+    int spinMicros = IDLE_SPIN_MICROS;
+    int yieldMicros = IDLE_YIELD_MICROS;
+
+    void configure()
+    {
+        if (const char *env = getenv("OBFUSCATION_SPIN_US"))
+            spinMicros = atoi(env);
+        if (const char *env = getenv("OBFUSCATION_YIELD_US"))
+            yieldMicros = atoi(env);
+    }
+
+    template <typename Poll, typename Stop>
+    bool wait(Poll poll, Stop stop) const
+    {
+        return pollWhileIdle(spinMicros, yieldMicros, poll, stop);
+    }
+};
+
+// Park as soon as the queues run dry: no CPU burnt while idle, a futex wake per wake-up.
+struct ParkIdle
+{
+    void configure() {}
+
+    template <typename Poll, typename Stop>
+    bool wait(Poll, Stop) const
+    {
+        return false;
+    }
+};
+
+// Slab arena for the boxed arguments of one dispatched function: those too
+// large or not trivially copyable to travel inside a Task. Slots never move
+// once handed out, so workers can keep reading a slot while other callers
+// acquire new ones. Free slots are cached per thread and moved
+// between threads in batches through a lock-free depot; only growing the arena
+// takes a lock. Each slot type must have exactly one arena, since the
+// per-thread cache is keyed on T.
+template <typename T>
+class SlotArena
+{
+    static constexpr int SLAB_SHIFT = 8;
+    static constexpr int SLAB_SLOTS = 1 << SLAB_SHIFT;
+    static constexpr int BATCH = 64;
+
+    // Every payload starts a cache line, so neighbouring slots never share one.
+    struct Slot
+    {
+        alignas(64) alignas(T) unsigned char storage[sizeof(T)];
+        int nextFree;
+        atomic<int> nextBatch;
+    };
+
+    struct LocalCache
+    {
+        int head = -1;
+        int count = 0;
+        unsigned int epoch = 0;
+    };
+
+public:
+    explicit SlotArena(size_t maxBytes = PARAM_ARENA_MAX_BYTES)
+        : maxSlabs(max<size_t>(1, maxBytes / (sizeof(Slot) * SLAB_SLOTS))),
+          slabs(new atomic<Slot *>[maxSlabs]),
+          slabCount(0),
+          depot(0),
+          epoch(1)
+    {
+        for (size_t i = 0; i < maxSlabs; i++)
+            slabs[i].store(nullptr, memory_order_relaxed);
+    }
+
+    ~SlotArena()
+    {
+        for (size_t i = 0; i < maxSlabs; i++)
+            delete[] slabs[i].load(memory_order_relaxed);
+        delete[] slabs;
+    }
+
+    SlotArena(const SlotArena &) = delete;
+    SlotArena &operator=(const SlotArena &) = delete;
+
+    // Returns a free slot index, or -1 if the memory cap is reached and no slot is free.
+    int acquire()
+    {
+        LocalCache &cache = localCache();
+        if (cache.head < 0 && !takeBatch(cache) && !grow(cache))
+            return -1;
+
+        int index = cache.head;
+        cache.head = slot(index).nextFree;
+        cache.count--;
+        return index;
+    }
+
+    template <typename... Args>
+    T &construct(int index, Args &&...args)
+    {
+        return *new (slot(index).storage) T{std::forward<Args>(args)...};
+    }
+
+    void release(int index)
+    {
+        (*this)[index].~T();
+
+        LocalCache &cache = localCache();
+        slot(index).nextFree = cache.head;
+        cache.head = index;
+        cache.count++;
+
+        if (cache.count >= 2 * BATCH)
+            giveBatch(cache);
+    }
+
+    T &operator[](int index)
+    {
+        return *std::launder(reinterpret_cast<T *>(slot(index).storage));
+    }
+
+    size_t capacity() const
+    {
+        return slabCount.load(memory_order_relaxed) * SLAB_SLOTS;
+    }
+
+    // Frees every slab. Only call while no task is running and no slot is in use.
+    void shrink()
+    {
+        lock_guard<mutex> lock(growMutex);
+        size_t count = slabCount.load(memory_order_relaxed);
+        for (size_t i = 0; i < count; i++)
+        {
+            delete[] slabs[i].load(memory_order_relaxed);
+            slabs[i].store(nullptr, memory_order_relaxed);
+        }
+        slabCount.store(0, memory_order_relaxed);
+        depot.store(0, memory_order_relaxed);
+        // Thread caches still point into the freed slabs; bumping the epoch makes them start over.
+        epoch.fetch_add(1, memory_order_release);
+    }
+
+private:
+    Slot &slot(int index)
+    {
+        return slabs[index >> SLAB_SHIFT].load(memory_order_relaxed)[index & (SLAB_SLOTS - 1)];
+    }
+
+    LocalCache &localCache()
+    {
+        LocalCache &cache = local;
+        unsigned int current = epoch.load(memory_order_acquire);
+        if (cache.epoch != current)
+            cache = LocalCache{-1, 0, current};
+        return cache;
+    }
+
+    // Depot head packs an ABA tag in the high word and (batch head index + 1) in the low word.
+    bool takeBatch(LocalCache &cache)
+    {
+        uint64_t head = depot.load(memory_order_acquire);
+        while (head & 0xffffffffu)
+        {
+            int index = int(head & 0xffffffffu) - 1;
+            uint64_t next = (head & ~uint64_t(0xffffffffu)) + (uint64_t(1) << 32) +
+                            uint64_t(slot(index).nextBatch.load(memory_order_relaxed) + 1);
+            if (depot.compare_exchange_weak(head, next, memory_order_acquire, memory_order_acquire))
+            {
+                cache.head = index;
+                cache.count = BATCH;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void giveBatch(LocalCache &cache)
+    {
+        int first = cache.head;
+        int last = first;
+        for (int i = 1; i < BATCH; i++)
+            last = slot(last).nextFree;
+        cache.head = slot(last).nextFree;
+        cache.count -= BATCH;
+        slot(last).nextFree = -1;
+
+        uint64_t head = depot.load(memory_order_relaxed);
+        do
+        {
+            slot(first).nextBatch.store(int(head & 0xffffffffu) - 1, memory_order_relaxed);
+        } while (!depot.compare_exchange_weak(head, (head & ~uint64_t(0xffffffffu)) + uint64_t(first + 1),
+                                              memory_order_release, memory_order_relaxed));
+    }
+
+    bool grow(LocalCache &cache)
+    {
+        lock_guard<mutex> lock(growMutex);
+        size_t count = slabCount.load(memory_order_relaxed);
+        if (count >= maxSlabs)
+            return false;
+
+        Slot *slab = new Slot[SLAB_SLOTS];
+        int base = int(count) << SLAB_SHIFT;
+        for (int i = 0; i < SLAB_SLOTS; i++)
+            slab[i].nextFree = i + 1 < SLAB_SLOTS ? base + i + 1 : cache.head;
+        slabs[count].store(slab, memory_order_release);
+        slabCount.store(count + 1, memory_order_relaxed);
+
+        cache.head = base;
+        cache.count += SLAB_SLOTS;
+        return true;
+    }
+
+    static thread_local LocalCache local;
+
+    size_t maxSlabs;
+    atomic<Slot *> *slabs;
+    atomic<size_t> slabCount;
+    alignas(64) atomic<uint64_t> depot;
+    atomic<unsigned int> epoch;
+    mutex growMutex;
+};
+
+template <typename T>
+thread_local typename SlotArena<T>::LocalCache SlotArena<T>::local;
+
+// The one arena per argument struct, created on first use.
+template <typename T>
+inline SlotArena<T> paramArena;
+
+// Where a non-void callee leaves its result: in the waiting caller's frame, so
+// nothing outlives the call. It has a line of its own, and the flag is set
+// after the value.
+struct alignas(64) CallResult
+{
+    int return_var;
+    atomic<bool> done{false};
+
+    void finish() { done.store(true, memory_order_release); }
+    bool isDone() const { return done.load(memory_order_acquire); }
+};
+
+// The worker the calling thread runs as, or -1 outside every pool.
+inline thread_local int current_worker = -1;
+
+constexpr int GLOBAL_LOCK_STRIPES = 64;
+
+// Synchronization for globals written by rewritten functions. The Obfuscator
+// turns loads, stores and simple read-modify-writes of integer globals into the
+// global* helpers below, and wraps other accesses in a GlobalLockGuard over the
+// globals' lock stripes. Globals that are never written get neither.
+template <typename T>
+inline T globalLoad(const T &global) { return __atomic_load_n(&global, __ATOMIC_SEQ_CST); }
+
+template <typename T, typename U>
+inline T globalStore(T &global, U value)
+{
+    T stored = static_cast<T>(value);
+    __atomic_store_n(&global, stored, __ATOMIC_SEQ_CST);
+    return stored;
+}
+
+template <typename T, typename U>
+inline T globalAddFetch(T &global, U value) { return __atomic_add_fetch(&global, static_cast<T>(value), __ATOMIC_SEQ_CST); }
+
+template <typename T, typename U>
+inline T globalSubFetch(T &global, U value) { return __atomic_sub_fetch(&global, static_cast<T>(value), __ATOMIC_SEQ_CST); }
+
+template <typename T, typename U>
+inline T globalAndFetch(T &global, U value) { return __atomic_and_fetch(&global, static_cast<T>(value), __ATOMIC_SEQ_CST); }
+
+template <typename T, typename U>
+inline T globalOrFetch(T &global, U value) { return __atomic_or_fetch(&global, static_cast<T>(value), __ATOMIC_SEQ_CST); }
+
+template <typename T, typename U>
+inline T globalXorFetch(T &global, U value) { return __atomic_xor_fetch(&global, static_cast<T>(value), __ATOMIC_SEQ_CST); }
+
+template <typename T, typename U>
+inline T globalFetchAdd(T &global, U value) { return __atomic_fetch_add(&global, static_cast<T>(value), __ATOMIC_SEQ_CST); }
+
+template <typename T, typename U>
+inline T globalFetchSub(T &global, U value) { return __atomic_fetch_sub(&global, static_cast<T>(value), __ATOMIC_SEQ_CST); }
+
+#ifdef OBFUSCATION_TRACE
+// Tracing build (-DOBFUSCATION_TRACE): every thread appends events to its own
+// buffer without locks, and exit() writes them as a Chrome/Perfetto trace to
+// OBFUSCATION_TRACE_FILE (default obfuscation.trace.json) and prints a counter
+// summary. Without the flag the trace* helpers below are empty and vanish.
+constexpr size_t TRACE_EVENTS_PER_THREAD = 1 << 18; // OBFUSCATION_TRACE_EVENTS overrides it
+
+enum TraceEventType : uint8_t
+{
+    TRACE_ENQUEUE, // a task was pushed; worker is the target
+    TRACE_TASK,    // a worker ran a task (one slice per resume in coroutine mode)
+    TRACE_WAIT,    // a caller waited for a callee's result
+    TRACE_LOCK     // a GlobalLockGuard waited for its stripes
+};
+
+struct TraceEvent
+{
+    uint64_t start; // steady_clock nanoseconds
+    uint64_t duration;
+    int32_t funcId; // or stripe count for TRACE_LOCK
+    int32_t worker; // target of an enqueue or worker running a task, -1 otherwise
+    int32_t depth;  // that worker's deque size after the enqueue or task start
+    uint8_t type;
+    uint8_t pick; // TracePick of an enqueue
+};
+
+// How an enqueue chose its worker.
+enum TracePick : uint8_t
+{
+    PICK_OWN,  // a worker pushed to its own deque
+    PICK_COOL, // the scheduler policy picked a worker loaded at or below the mean
+    PICK_HOT   // the scheduler policy picked a worker loaded above the mean
+};
+
+// Kept even when the buffer is full, so the summary stays exact.
+struct TraceCounters
+{
+    uint64_t enqueued, hotPicks, policyPicks, tasks, taskNs, waits, waitNs, locks, lockNs;
+    int maxDepth;
+};
+
+struct TraceBuffer
+{
+    char name[32];
+    TraceEvent *events;
+    size_t capacity;
+    size_t count;
+    uint64_t dropped;
+    TraceCounters counters;
+};
+
+inline mutex traceBuffersMutex;
+inline vector<TraceBuffer *> traceBuffers;
+inline size_t traceCapacity = TRACE_EVENTS_PER_THREAD;
+inline uint64_t traceStart;
+inline thread_local TraceBuffer *t_traceBuffer = nullptr;
+
+inline uint64_t traceClock()
+{
+    return (uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Called by initialize().
+inline void traceBegin()
+{
+    if (const char *env = getenv("OBFUSCATION_TRACE_EVENTS"))
+        traceCapacity = (size_t)max(0L, atol(env));
+    traceStart = traceClock();
+}
+
+inline TraceBuffer *registerTraceBuffer()
+{
+    TraceBuffer *buffer = new TraceBuffer();
+    buffer->capacity = traceCapacity;
+    buffer->events = new TraceEvent[traceCapacity];
+    lock_guard<mutex> lock(traceBuffersMutex);
+    if (current_worker >= 0)
+        snprintf(buffer->name, sizeof(buffer->name), "worker %d", current_worker);
+    else
+        snprintf(buffer->name, sizeof(buffer->name), "caller %zu", traceBuffers.size());
+    traceBuffers.push_back(buffer);
+    return buffer;
+}
+
+inline void traceRecord(TraceEventType type, uint64_t start, uint64_t end, int funcId, int worker, int depth,
+                        TracePick pick = PICK_OWN)
+{
+    TraceBuffer *buffer = t_traceBuffer ? t_traceBuffer : (t_traceBuffer = registerTraceBuffer());
+    TraceCounters &counters = buffer->counters;
+    uint64_t duration = end - start;
+    switch (type)
+    {
+    case TRACE_ENQUEUE:
+        counters.enqueued++;
+        counters.policyPicks += pick != PICK_OWN;
+        counters.hotPicks += pick == PICK_HOT;
+        counters.maxDepth = max(counters.maxDepth, depth);
+        break;
+    case TRACE_TASK:
+        counters.tasks++;
+        counters.taskNs += duration;
+        break;
+    case TRACE_WAIT:
+        counters.waits++;
+        counters.waitNs += duration;
+        break;
+    case TRACE_LOCK:
+        counters.locks++;
+        counters.lockNs += duration;
+        break;
+    }
+    if (buffer->count == buffer->capacity)
+    {
+        buffer->dropped++;
+        return;
+    }
+    buffer->events[buffer->count++] = TraceEvent{start, duration, funcId, worker, depth, type, pick};
+}
+
+// Chrome trace event format, for chrome://tracing or ui.perfetto.dev: one track
+// per thread that recorded events, plus a queue depth counter per worker.
+// Timestamps are microseconds since initialize(). Called once the workers have
+// stopped; events of other threads still running are not written.
+inline void writeTrace(const char *(*functionName)(int funcId))
+{
+    const char *env = getenv("OBFUSCATION_TRACE_FILE");
+    FILE *out = fopen(env && *env ? env : "obfuscation.trace.json", "w");
+    lock_guard<mutex> lock(traceBuffersMutex);
+    if (out)
+    {
+        static const char *const pickNames[] = {"own", "cool", "hot"};
+        const char *separator = "";
+        fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+        for (size_t tid = 0; tid < traceBuffers.size(); tid++)
+        {
+            const TraceBuffer &buffer = *traceBuffers[tid];
+            fprintf(out, "%s\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%zu,\"args\":{\"name\":\"%s\"}}",
+                    separator, tid, buffer.name);
+            separator = ",";
+            for (size_t i = 0; i < buffer.count; i++)
+            {
+                const TraceEvent &event = buffer.events[i];
+                double ts = (double)(event.start - traceStart) / 1000.0;
+                double dur = (double)event.duration / 1000.0;
+                switch (event.type)
+                {
+                case TRACE_ENQUEUE:
+                    fprintf(out, ",\n{\"ph\":\"i\",\"s\":\"t\",\"cat\":\"enqueue\",\"name\":\"enqueue %s\",\"pid\":1,\"tid\":%zu,\"ts\":%.3f,"
+                                 "\"args\":{\"target\":%d,\"depth\":%d,\"pick\":\"%s\"}}",
+                            functionName(event.funcId), tid, ts, event.worker, event.depth, pickNames[event.pick]);
+                    break;
+                case TRACE_TASK:
+                    fprintf(out, ",\n{\"ph\":\"X\",\"cat\":\"task\",\"name\":\"%s\",\"pid\":1,\"tid\":%zu,\"ts\":%.3f,\"dur\":%.3f}",
+                            functionName(event.funcId), tid, ts, dur);
+                    break;
+                case TRACE_WAIT:
+                    fprintf(out, ",\n{\"ph\":\"X\",\"cat\":\"wait\",\"name\":\"wait %s\",\"pid\":1,\"tid\":%zu,\"ts\":%.3f,\"dur\":%.3f}",
+                            functionName(event.funcId), tid, ts, dur);
+                    break;
+                case TRACE_LOCK:
+                    fprintf(out, ",\n{\"ph\":\"X\",\"cat\":\"lock\",\"name\":\"lock\",\"pid\":1,\"tid\":%zu,\"ts\":%.3f,\"dur\":%.3f,"
+                                 "\"args\":{\"stripes\":%d}}",
+                            tid, ts, dur, event.funcId);
+                    break;
+                }
+                if (event.worker >= 0)
+                    fprintf(out, ",\n{\"ph\":\"C\",\"name\":\"queue %d\",\"pid\":1,\"ts\":%.3f,\"args\":{\"depth\":%d}}",
+                            event.worker, ts, event.depth);
+            }
+        }
+        fprintf(out, "\n]}\n");
+        fclose(out);
+    }
+
+    fprintf(stderr, "%-10s %9s %9s %9s %9s %9s %10s %9s %10s %9s %10s %9s\n", "thread", "enqueued", "policy", "hot",
+            "max depth", "tasks", "task ms", "waits", "wait ms", "locks", "lock ms", "dropped");
+    TraceCounters total{};
+    uint64_t dropped = 0;
+    for (TraceBuffer *buffer : traceBuffers)
+    {
+        const TraceCounters &c = buffer->counters;
+        fprintf(stderr, "%-10s %9llu %9llu %9llu %9d %9llu %10.3f %9llu %10.3f %9llu %10.3f %9llu\n", buffer->name,
+                (unsigned long long)c.enqueued, (unsigned long long)c.policyPicks, (unsigned long long)c.hotPicks,
+                c.maxDepth, (unsigned long long)c.tasks, c.taskNs / 1e6, (unsigned long long)c.waits, c.waitNs / 1e6,
+                (unsigned long long)c.locks, c.lockNs / 1e6, (unsigned long long)buffer->dropped);
+        total.enqueued += c.enqueued;
+        total.policyPicks += c.policyPicks;
+        total.hotPicks += c.hotPicks;
+        total.maxDepth = max(total.maxDepth, c.maxDepth);
+        total.tasks += c.tasks;
+        total.taskNs += c.taskNs;
+        total.waits += c.waits;
+        total.waitNs += c.waitNs;
+        total.locks += c.locks;
+        total.lockNs += c.lockNs;
+        dropped += buffer->dropped;
+        delete[] buffer->events;
+        delete buffer;
+    }
+    fprintf(stderr, "%-10s %9llu %9llu %9llu %9d %9llu %10.3f %9llu %10.3f %9llu %10.3f %9llu\n", "total",
+            (unsigned long long)total.enqueued, (unsigned long long)total.policyPicks,
+            (unsigned long long)total.hotPicks, total.maxDepth, (unsigned long long)total.tasks, total.taskNs / 1e6,
+            (unsigned long long)total.waits, total.waitNs / 1e6, (unsigned long long)total.locks, total.lockNs / 1e6,
+            (unsigned long long)dropped);
+    traceBuffers.clear();
+    t_traceBuffer = nullptr;
+}
+#endif
+
+// Rewritten callers bracket their wait for a callee's result with these.
+inline uint64_t traceWaitBegin()
+{
+#ifdef OBFUSCATION_TRACE
+    return traceClock();
+#else
+    return 0;
+#endif
+}
+
+inline void traceWaitEnd(int funcId, uint64_t start)
+{
+#ifdef OBFUSCATION_TRACE
+    traceRecord(TRACE_WAIT, start, traceClock(), funcId, -1, 0);
+#else
+    (void)funcId;
+    (void)start;
+#endif
+}
+
+struct alignas(64) GlobalLockStripe
+{
+    mutex lock;
+};
+
+inline GlobalLockStripe globalLockStripes[GLOBAL_LOCK_STRIPES];
+
+static_assert(GLOBAL_LOCK_STRIPES <= 64, "GlobalLockGuard tracks stripes in a 64-bit mask");
+
+// Holds the lock stripes of every global a line touches. Stripes are taken in
+// index order, so two lines locking overlapping globals cannot deadlock.
+class GlobalLockGuard
+{
+public:
+    GlobalLockGuard(initializer_list<const void *> globals) : held(0)
+    {
+        for (const void *global : globals)
+            held |= uint64_t(1) << stripeFor(global);
+#ifdef OBFUSCATION_TRACE
+        uint64_t start = traceClock();
+#endif
+        for (uint64_t stripes = held; stripes != 0; stripes &= stripes - 1)
+            globalLockStripes[__builtin_ctzll(stripes)].lock.lock();
+#ifdef OBFUSCATION_TRACE
+        traceRecord(TRACE_LOCK, start, traceClock(), __builtin_popcountll(held), -1, 0);
+#endif
+    }
+
+    ~GlobalLockGuard()
+    {
+        for (uint64_t stripes = held; stripes != 0; stripes &= stripes - 1)
+            globalLockStripes[__builtin_ctzll(stripes)].lock.unlock();
+    }
+
+    GlobalLockGuard(const GlobalLockGuard &) = delete;
+    GlobalLockGuard &operator=(const GlobalLockGuard &) = delete;
+
+    static int stripeFor(const void *global)
+    {
+        uint64_t address = reinterpret_cast<uintptr_t>(global);
+        return (int)((address * 0x9E3779B97F4A7C15ull) >> 58) % GLOBAL_LOCK_STRIPES;
+    }
+
+private:
+    uint64_t held;
+};
+
+// Evaluates a dispatched call's argument that reads locked globals under their
+// lock stripes, so the value copied into the task is consistent.
+template <typename Read>
+inline auto globalLockedRead(initializer_list<const void *> globals, Read read) -> decltype(read())
+{
+    GlobalLockGuard guard(globals);
+    return read();
+}
+
+#ifdef OBFUSCATION_PROFILE
+// Profiling build (-DOBFUSCATION_PROFILE): every task's own execution time is
+// recorded per function in a log2 histogram of clock ticks, and exit() writes
+// the totals to OBFUSCATION_PROFILE_FILE (default obfuscation.profile) for
+// Estimation to turn into measured costs.
+constexpr int PROFILE_BUCKETS = 64;
+
+struct FunctionProfile
+{
+    uint64_t calls;
+    uint64_t ticks;
+    uint64_t histogram[PROFILE_BUCKETS];
+};
+
+#endif
+
+// What profiling and load estimation time tasks with: the TSC where available,
+// steady_clock nanoseconds elsewhere.
+inline uint64_t cycleClock()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return (uint64_t)chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+#ifdef OBFUSCATION_COROUTINES
+// Every rewritten function is a coroutine returning ObfTask. Frames start
+// suspended; execute() starts them on a worker and they free themselves when
+// done, resuming the caller that awaited them on the same worker.
+struct ObfTask
+{
+    // What the runtime that adopted a frame needs to account for it when it ends.
+    struct Frame
+    {
+        int worker = -1;
+        int cost = 0;
+        int priority = PRIORITY_DETACHED;  // passed on to the callees it awaits
+#ifdef OBFUSCATION_PROFILE
+        int funcId = 0;
+        uint64_t profileStart = 0;  // when the frame last started running
+        uint64_t profileTicks = 0;  // running time before its last suspension
+#endif
+    };
+
+    struct promise_type
+    {
+        coroutine_handle<> continuation;
+        Frame frame;
+        void (*finished)(const Frame &frame) = nullptr;  // set by the adopting runtime
+
+        struct FinalAwaiter
+        {
+            bool await_ready() noexcept { return false; }
+
+            coroutine_handle<> await_suspend(coroutine_handle<promise_type> self) noexcept
+            {
+                coroutine_handle<> next = self.promise().continuation;
+                Frame frame = self.promise().frame;
+                void (*finished)(const Frame &) = self.promise().finished;
+                self.destroy();
+                finished(frame);
+                return next ? next : noop_coroutine();
+            }
+
+            void await_resume() noexcept {}
+        };
+
+        ObfTask get_return_object() { return ObfTask{coroutine_handle<promise_type>::from_promise(*this)}; }
+        suspend_always initial_suspend() noexcept { return {}; }
+        FinalAwaiter final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { terminate(); }
+    };
+
+    coroutine_handle<promise_type> handle;
+};
+#endif
+
+// Rewritten functions take the worker they run on and their <name>_values
+// argument struct by value, which a coroutine keeps in its frame.
+template <typename Function>
+struct CallTraits;
+
+template <typename Result, typename Values>
+struct CallTraits<Result (*)(int, Values)>
+{
+    using ValuesType = Values;
+};
+
+template <auto Function>
+using CallValues = typename CallTraits<decltype(Function)>::ValuesType;
+
+// Whether a function's arguments travel inside its tasks rather than in its arena.
+template <typename Values>
+constexpr bool travelsInline = is_trivially_copyable<Values>::value && sizeof(Values) <= TASK_PAYLOAD_BYTES &&
+                               alignof(Values) <= alignof(uint64_t);
+
+// The TaskEntry of every task calling Function: unpacks the arguments and calls it.
+template <auto Function>
+TaskResult runCall(int thread_idx, Task &task)
+{
+    using Values = CallValues<Function>;
+    if constexpr (travelsInline<Values>)
+        return Function(thread_idx, *std::launder(reinterpret_cast<Values *>(task.payload)));
+    else
+    {
+        int index;
+        memcpy(&index, task.payload, sizeof(index));
+        Values args(std::move(paramArena<Values>[index]));
+        paramArena<Values>.release(index);
+        return Function(thread_idx, std::move(args));
+    }
+}
+
+// Arguments that travel inside tasks never touch their arena, so it is not created.
+template <typename Values>
+void shrinkParamArena()
+{
+    if constexpr (!travelsInline<Values>)
+        paramArena<Values>.shrink();
+}
+
+// CPU placement of the workers.
+
+inline vector<int> parseCpuList(const string &list)
+{
+    vector<int> cpus;
+    stringstream ranges(list);
+    string range;
+    while (getline(ranges, range, ','))
+    {
+        if (range.empty())
+            continue;
+        size_t dash = range.find('-');
+        int first = stoi(range.substr(0, dash));
+        int last = dash == string::npos ? first : stoi(range.substr(dash + 1));
+        for (int cpu = first; cpu <= last; cpu++)
+            cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+inline string readSysfs(const string &path)
+{
+    ifstream file(path);
+    string line;
+    getline(file, line);
+    return line;
+}
+
+// CPU for each worker, or empty when pinning is off. OBFUSCATION_PIN selects the layout:
+//   compact - fill one NUMA node before moving to the next (default)
+//   scatter - round-robin workers across NUMA nodes
+//   none    - leave placement to the OS
+// Within a node, one hardware thread per physical core is used before SMT siblings.
+inline vector<int> workerCpus(int count)
+{
+    const char *env = getenv("OBFUSCATION_PIN");
+    string layout = env ? env : "compact";
+    if (layout == "none")
+        return {};
+
+#ifdef __linux__
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        return {};
+
+    map<int, int> nodeOf;
+    for (int node = 0; node < 1024; node++)
+    {
+        string list = readSysfs("/sys/devices/system/node/node" + to_string(node) + "/cpulist");
+        for (int cpu : parseCpuList(list))
+            nodeOf[cpu] = node;
+    }
+
+    map<int, vector<pair<int, int>>> byNode;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (!CPU_ISSET(cpu, &allowed))
+            continue;
+        vector<int> siblings = parseCpuList(readSysfs("/sys/devices/system/cpu/cpu" + to_string(cpu) + "/topology/thread_siblings_list"));
+        int smtRank = 0;
+        for (int sibling : siblings)
+            smtRank += sibling < cpu;
+        byNode[nodeOf.count(cpu) ? nodeOf[cpu] : 0].emplace_back(smtRank, cpu);
+    }
+    if (byNode.empty())
+        return {};
+
+    vector<vector<int>> nodes;
+    for (auto &entry : byNode)
+    {
+        sort(entry.second.begin(), entry.second.end());
+        vector<int> cpus;
+        for (auto &rankedCpu : entry.second)
+            cpus.push_back(rankedCpu.second);
+        nodes.push_back(cpus);
+    }
+
+    vector<int> order;
+    if (layout == "scatter")
+    {
+        for (size_t i = 0; order.size() < (size_t)count && i < (size_t)CPU_SETSIZE; i++)
+        {
+            for (auto &cpus : nodes)
+                if (i < cpus.size())
+                    order.push_back(cpus[i]);
+        }
+    }
+    else
+    {
+        for (auto &cpus : nodes)
+            order.insert(order.end(), cpus.begin(), cpus.end());
+    }
+
+    vector<int> result(count);
+    for (int i = 0; i < count; i++)
+        result[i] = order[i % order.size()];
+    return result;
+#else
+    (void)count;
+    return {};
+#endif
+}
+
+// Compile-time configuration of an ObfuscationRuntime. A program derives its
+// own from it and overrides what it needs; the generated one adds the
+// function registry.
+struct RuntimeDefaults
+{
+    // Per-worker task queue (WorkStealingDeque or LockedQueue).
+    template <typename T>
+    using Queue = WorkStealingDeque<T>;
+    // Picks the worker for tasks submitted from outside the pool (PowerOfTwoChoicesPolicy or BalancedRandomPolicy).
+    using Policy = PowerOfTwoChoicesPolicy;
+    // What a worker that ran dry does before it parks (SpinYieldParkIdle or ParkIdle).
+    using Idle = SpinYieldParkIdle;
+    // Pool size. 0 sizes it at startup (OBFUSCATION_THREADS, else one worker per
+    // hardware thread); a fixed count ignores the environment.
+    static constexpr int WORKERS = 0;
+    // Starting points of OBFUSCATION_INLINE_COST, OBFUSCATION_INLINE_DEPTH and OBFUSCATION_SPAWN_DEPTH.
+    static constexpr int INLINE_COST = INLINE_COST_THRESHOLD;
+    static constexpr int INLINE_DEPTH = INLINE_QUEUE_DEPTH;
+    static constexpr int SPAWN_DEPTH = INLINE_SPAWN_DEPTH;
+    // Starting points of OBFUSCATION_ADAPTIVE_LOAD (measure what tasks cost and
+    // place by that, see recordSample) and OBFUSCATION_PLACEMENT=eft (place tasks
+    // from outside the pool on the worker expected to finish them first, see pickWorker).
+    static constexpr bool ADAPTIVE_LOAD = false;
+    static constexpr bool EARLIEST_FINISH = false;
+    // Starting point of OBFUSCATION_PRIORITIES: queue awaited calls ahead of
+    // fire-and-forget ones (see submitAwaitedTask). Off, every task shares one queue.
+    static constexpr bool PRIORITIES = true;
+
+    // Function registry: funcIds run from 0 to FUNCTIONS - 1.
+    static constexpr int FUNCTIONS = 1;
+    static const char *functionName(int) { return "task"; }
+    // Call-graph affinity: with more than one group the pool is split into that
+    // many worker groups, and each function's tasks prefer the workers of its
+    // group (see affinityWorker). 0 places tasks by load alone.
+    static constexpr int AFFINITY_GROUPS = 0;
+    static int affinityGroup(int) { return 0; }
+    // Frees argument arenas once every task has finished.
+    static void releaseArenas() {}
+};
+
+// The scheduler: a pool of workers, one queue and inbox each, fed by
+// submitTask(s) and drained by execute(). All state is static, so each Config
+// gets exactly one pool, and every call is bound at compile time.
+template <typename Config>
+struct ObfuscationRuntime
+{
+    using Queue = typename Config::template Queue<Task>;
+    using Policy = typename Config::Policy;
+    using Idle = typename Config::Idle;
+    using Worker = BasicWorkerState<Queue>;
+
+    static inline int runtimeWorkers = 0;
+    static inline thread *threads;
+    static inline Worker **workers;
+    static inline atomic<int> **loads;  // each worker's load, for the policy's LoadView
+    static inline atomic<int> idleWorkers{0};
+    static inline atomic<int> workersReady{0};
+
+    static inline atomic<bool> stopThreads{false};
+
+    static inline atomic<uint64_t> externalSubmitted{0};  // tasks submitted from outside the pool
+
+    static inline Policy policy;
+    static inline Idle idle;
+    static inline int inlineCostThreshold = Config::INLINE_COST;
+    static inline int inlineQueueDepth = Config::INLINE_DEPTH;
+    static inline int spawnDepthLimit = Config::SPAWN_DEPTH;
+#ifndef OBFUSCATION_COROUTINES
+    static inline thread_local int t_spawnDepth = 0;  // depth of the task running on this thread
+    static inline thread_local TaskGroupState *t_currentGroup = nullptr;
+    static inline thread_local uint64_t t_nestedTicks = 0;  // ticks of tasks run inside the current one
+    static inline thread_local int t_taskPriority = PRIORITY_DETACHED;  // that of the task running on this thread
+#endif
+    static inline bool priorities = true;
+
+    // Online load estimation; the coroutine runtime keeps static costs.
+    struct alignas(64) FunctionEstimate
+    {
+        atomic<int> units{0};  // moving average of the function's own time, 0 until the first batch
+    };
+
+    struct AdaptiveSample
+    {
+        uint64_t ticks;
+        int calls;
+    };
+
+    static inline bool adaptiveLoad = false;
+    static inline bool earliestFinish = false;
+    static inline FunctionEstimate *functionEstimates;
+    static inline AdaptiveSample *adaptiveSamples;  // one row of Config::FUNCTIONS per worker, owner only
+
+#ifdef OBFUSCATION_PROFILE
+    // Extra per-worker entry after the functions: time from submission to start of
+    // every task that was dispatched rather than run inline.
+    static constexpr int PROFILE_DISPATCH = Config::FUNCTIONS;
+    static constexpr int PROFILE_ROW = Config::FUNCTIONS + 1;
+
+    // One row of PROFILE_ROW entries per worker, so workers rarely share a line.
+    static inline FunctionProfile *functionProfiles;
+    static inline uint64_t profileStartTicks;
+    static inline chrono::steady_clock::time_point profileStartTime;
+#endif
+
+    static int workerCount()
+    {
+        if constexpr (Config::WORKERS > 0)
+            return Config::WORKERS;
+        else
+            return runtimeWorkers;
+    }
+
+    static void initialize()
+    {
+        runtimeWorkers = configuredWorkerCount();
+        vector<int> cpus = workerCpus(workerCount());
+
+#ifdef OBFUSCATION_PROFILE
+        functionProfiles = new FunctionProfile[(size_t)workerCount() * PROFILE_ROW]();
+        profileStartTime = chrono::steady_clock::now();
+        profileStartTicks = cycleClock();
+#endif
+#ifdef OBFUSCATION_TRACE
+        traceBegin();
+#endif
+
+        if (const char *env = getenv("OBFUSCATION_INLINE_COST"))
+            inlineCostThreshold = atoi(env);
+        if (const char *env = getenv("OBFUSCATION_INLINE_DEPTH"))
+            inlineQueueDepth = atoi(env);
+        if (const char *env = getenv("OBFUSCATION_SPAWN_DEPTH"))
+            spawnDepthLimit = atoi(env);
+#ifndef OBFUSCATION_COROUTINES
+        adaptiveLoad = Config::ADAPTIVE_LOAD;
+        if (const char *env = getenv("OBFUSCATION_ADAPTIVE_LOAD"))
+            adaptiveLoad = atoi(env) != 0;
+#endif
+        earliestFinish = Config::EARLIEST_FINISH;
+        priorities = Config::PRIORITIES;
+        if (const char *env = getenv("OBFUSCATION_PRIORITIES"))
+            priorities = atoi(env) != 0;
+        if (const char *env = getenv("OBFUSCATION_PLACEMENT"))
+            earliestFinish = string(env) == "eft";
+        if (adaptiveLoad)
+        {
+            functionEstimates = new FunctionEstimate[Config::FUNCTIONS]();
+            adaptiveSamples = new AdaptiveSample[(size_t)workerCount() * Config::FUNCTIONS]();
+        }
+        idle.configure();
+
+        stopThreads.store(false);
+        workersReady.store(0);
+        externalSubmitted.store(0);
+        workers = new Worker *[workerCount()]();
+        loads = new atomic<int> *[workerCount()]();
+        threads = new thread[workerCount()];
+        for (int i = 0; i < workerCount(); i++)
+        {
+            threads[i] = thread(threadFunction, i, cpus.empty() ? -1 : cpus[i]);
+        }
+
+        // Workers build their own state; nothing may be submitted or stolen before all of it exists.
+        while (workersReady.load() < workerCount())
+            this_thread::yield();
+    }
+
+    // Config::WORKERS if set; else OBFUSCATION_THREADS, or one worker per hardware thread.
+    static int configuredWorkerCount()
+    {
+        if constexpr (Config::WORKERS > 0)
+            return Config::WORKERS;
+
+        if (const char *env = getenv("OBFUSCATION_THREADS"))
+        {
+            int count = atoi(env);
+            if (count > 0)
+                return count;
+        }
+
+        int hardware = (int)thread::hardware_concurrency();
+        return hardware > 0 ? hardware : 2;
+    }
+
+    static void exit()
+    {
+        // The caller is the last thread outside the pool, so once nothing is in
+        // flight nothing can be submitted again.
+        for (int polls = 0; !quiescent(); polls++)
+        {
+            if (polls < EXIT_YIELD_POLLS)
+                this_thread::yield();
+            else
+                this_thread::sleep_for(chrono::microseconds(EXIT_POLL_US));
+        }
+
+        stopThreads.store(true);
+
+        for (int i = 0; i < workerCount(); i++)
+        {
+            {
+                lock_guard<mutex> parkLock(workers[i]->parkMutex);
+                workers[i]->parkCondition.notify_all();
+            }
+            threads[i].join();
+        }
+
+        for (int i = 0; i < workerCount(); i++)
+            delete workers[i];
+        delete[] workers;
+        delete[] loads;
+        delete[] threads;
+        if (adaptiveLoad)
+        {
+            delete[] functionEstimates;
+            delete[] adaptiveSamples;
+        }
+
+        Config::releaseArenas();
+#ifdef OBFUSCATION_PROFILE
+        writeProfile();
+#endif
+#ifdef OBFUSCATION_TRACE
+        writeTrace(Config::functionName);
+#endif
+    }
+
+#ifdef OBFUSCATION_PROFILE
+    // Only the worker itself writes its row: threads outside the pool never run
+    // tasks, and a coroutine frame resumed elsewhere moves to the new worker (see
+    // CallAwaiter::await_resume). writeProfile reads the rows once the workers joined.
+    static void recordProfile(int thread_idx, int funcId, uint64_t ticks)
+    {
+        FunctionProfile &profile = functionProfiles[(size_t)thread_idx * PROFILE_ROW + funcId];
+        int bucket = 63 - __builtin_clzll(ticks | 1);
+        profile.calls++;
+        profile.ticks += ticks;
+        profile.histogram[bucket]++;
+    }
+
+    // Format, one function per line after the header, then the dispatch latencies:
+    //   obfuscation-profile 2
+    //   ticks_per_ns <ratio>
+    //   <function> <calls> <ticks> <64 histogram buckets, bucket b counting [2^b, 2^(b+1)) ticks>
+    //   @dispatch <tasks> <ticks> <64 histogram buckets>
+    static void writeProfile()
+    {
+        double nanos = chrono::duration<double, nano>(chrono::steady_clock::now() - profileStartTime).count();
+        double ticksPerNs = nanos > 0 ? (cycleClock() - profileStartTicks) / nanos : 1.0;
+
+        const char *env = getenv("OBFUSCATION_PROFILE_FILE");
+        ofstream out(env && *env ? env : "obfuscation.profile");
+        out << "obfuscation-profile 2\n";
+        out << "ticks_per_ns " << ticksPerNs << "\n";
+        for (int f = 0; f < PROFILE_ROW; f++)
+        {
+            FunctionProfile total{};
+            for (int w = 0; w < workerCount(); w++)
+            {
+                const FunctionProfile &row = functionProfiles[(size_t)w * PROFILE_ROW + f];
+                total.calls += row.calls;
+                total.ticks += row.ticks;
+                for (int b = 0; b < PROFILE_BUCKETS; b++)
+                    total.histogram[b] += row.histogram[b];
+            }
+            out << (f == PROFILE_DISPATCH ? "@dispatch" : Config::functionName(f)) << " " << total.calls << " " << total.ticks;
+            for (int b = 0; b < PROFILE_BUCKETS; b++)
+                out << " " << total.histogram[b];
+            out << "\n";
+        }
+        delete[] functionProfiles;
+    }
+#endif
+
+#ifdef OBFUSCATION_TRACE
+    // Placement of a task the scheduler policy sent to `target`, before it is counted in its load.
+    static TracePick tracePick(int target)
+    {
+        long total = 0;
+        for (int i = 0; i < workerCount(); i++)
+            total += workers[i]->load.load(memory_order_relaxed);
+        return (long)workers[target]->load.load(memory_order_relaxed) * workerCount() > total ? PICK_HOT : PICK_COOL;
+    }
+
+    static void traceEnqueue(const Task &task, int target, TracePick pick)
+    {
+        uint64_t now = traceClock();
+        traceRecord(TRACE_ENQUEUE, now, now, task.funcId, target, (int)queuedTasks(target), pick);
+    }
+#endif
+
+    static int currentWorker()
+    {
+        return current_worker;
+    }
+
+    static int selectWorker(const Task &task)
+    {
+        return pickWorker(task, 0, workerCount());
+    }
+
+    // The worker in [first, first + size) a task is placed on: the policy's pick by
+    // load or, with earliest-finish placement, the worker whose queued load plus
+    // the task, scaled by its slowdown, ends first (HEFT's EFT rule over the
+    // estimates). The scan starts at a random worker, so ties spread.
+    static int pickWorker(const Task &task, int first, int size)
+    {
+        if (!earliestFinish)
+            return first + policy.selectWorker(LoadView(loads + first), size);
+        int start = (int)(fastRandom() % size);
+        int best = first + start;
+        long long bestFinish = numeric_limits<long long>::max();
+        for (int i = 0; i < size; i++)
+        {
+            int worker = first + (start + i) % size;
+            long long finish = ((long long)loads[worker]->load(memory_order_relaxed) + task.cost) *
+                               workers[worker]->slowdown.load(memory_order_relaxed);
+            if (finish < bestFinish)
+            {
+                best = worker;
+                bestFinish = finish;
+            }
+        }
+        return best;
+    }
+
+    // What a task adds to its worker's load under load estimation: the moving
+    // average of its function (per iteration for a loop chunk), or its static cost
+    // until the function has one.
+    static int adaptiveCost(const Task &task)
+    {
+        if ((unsigned)task.funcId >= (unsigned)Config::FUNCTIONS)
+            return task.cost;
+        int units = functionEstimates[task.funcId].units.load(memory_order_relaxed);
+        if (units == 0)
+            return task.cost;
+#ifndef OBFUSCATION_COROUTINES
+        if (task.loopChunk)
+        {
+            LoopChunk chunk;
+            memcpy(&chunk, task.payload, sizeof(chunk));
+            return (int)min<long long>((long long)(chunk.end - chunk.begin) * units, TASK_COST_CAP);
+        }
+#endif
+        return units;
+    }
+
+    // Adds one timed run of funcId on this worker. Every ADAPTIVE_BATCH runs the
+    // batch mean moves the function's average, and the batch against the previous
+    // average moves this worker's slowdown. Workers fold into an average without a
+    // lock; a batch lost to a concurrent fold only delays convergence.
+    static void recordSample(int thread_idx, int funcId, uint64_t ticks)
+    {
+        if ((unsigned)funcId >= (unsigned)Config::FUNCTIONS)
+            return;
+        AdaptiveSample &sample = adaptiveSamples[(size_t)thread_idx * Config::FUNCTIONS + funcId];
+        sample.ticks += ticks;
+        if (++sample.calls < ADAPTIVE_BATCH)
+            return;
+        long long observed = min<long long>(max<long long>((long long)((sample.ticks / sample.calls) >> ADAPTIVE_TICK_SHIFT), 1),
+                                            TASK_COST_CAP);
+        sample = AdaptiveSample{};
+
+        atomic<int> &estimate = functionEstimates[funcId].units;
+        int previous = estimate.load(memory_order_relaxed);
+        estimate.store(previous == 0 ? (int)observed : previous + (int)((observed - previous) / ADAPTIVE_EMA_WEIGHT),
+                       memory_order_relaxed);
+        if (previous > 0)
+        {
+            atomic<int> &slowdown = workers[thread_idx]->slowdown;
+            long long ratio = min<long long>(max<long long>(observed * SPEED_ONE / previous, SPEED_ONE / 8), SPEED_ONE * 8);
+            int current = slowdown.load(memory_order_relaxed);
+            slowdown.store(current + (int)((ratio - current) / ADAPTIVE_EMA_WEIGHT), memory_order_relaxed);
+        }
+    }
+
+    // Worker groups the pool is split into: contiguous ranges of workers, so a
+    // group shares caches when workers are pinned to consecutive CPUs.
+    static int affinityGroupCount()
+    {
+        return min(Config::AFFINITY_GROUPS, workerCount());
+    }
+
+    static int affinityGroupStart(int group)
+    {
+        return group * workerCount() / affinityGroupCount();
+    }
+
+    static int affinityGroupOf(int worker)
+    {
+        return ((worker + 1) * affinityGroupCount() - 1) / workerCount();
+    }
+
+    // Where call-graph affinity places a task submitted by `from` (-1 outside the
+    // pool): `from` itself if it belongs to the function's group, else the group
+    // worker the policy picks among them. -1 when affinity is off or the group is
+    // overloaded, and the task is placed as usual.
+    static int affinityWorker(const Task &task, int from)
+    {
+        if constexpr (Config::AFFINITY_GROUPS <= 1)
+        {
+            (void)task;
+            (void)from;
+            return -1;
+        }
+        else
+        {
+            int groups = affinityGroupCount();
+            if (groups <= 1)
+                return -1;
+            int group = Config::affinityGroup(task.funcId) % groups;
+            int first = affinityGroupStart(group);
+            int size = affinityGroupStart(group + 1) - first;
+            if (from >= first && from < first + size)
+                return from;
+
+            int target = pickWorker(task, first, size);
+            int sample = fastRandom() % workerCount();
+            if (loads[target]->load(memory_order_relaxed) >
+                AFFINITY_OVERLOAD * loads[sample]->load(memory_order_relaxed) + task.cost)
+                return -1;
+            return target;
+        }
+    }
+
+    // Queues a task on a worker's inbox; targets collects the workers to wake.
+    static void sendToInbox(const Task &task, int target, vector<int> &targets)
+    {
+#ifdef OBFUSCATION_TRACE
+        TracePick pick = tracePick(target);
+#endif
+        workers[target]->load.fetch_add(task.cost);
+        workers[target]->inbox.push(task);
+#ifdef OBFUSCATION_TRACE
+        traceEnqueue(task, target, pick);
+#endif
+        if (find(targets.begin(), targets.end(), target) == targets.end())
+            targets.push_back(target);
+    }
+
+    static void wakeTargets(const vector<int> &targets)
+    {
+        bool woke = false;
+        for (int target : targets)
+            woke |= wakeWorker(target);
+        if (!woke)
+            wakeIdleWorker();
+    }
+
+    static void submitTask(Task task)
+    {
+        countSubmitted(1);
+#ifdef OBFUSCATION_PROFILE
+        task.submitTicks = cycleClock();
+#endif
+#ifndef OBFUSCATION_COROUTINES
+        task.depth = t_spawnDepth + 1;
+        task.group = t_currentGroup;
+        if (task.group)
+            task.group->pending.fetch_add(1, memory_order_relaxed);
+#endif
+        if (adaptiveLoad)
+            task.cost = adaptiveCost(task);
+
+        int thread_idx = current_worker;
+        int target = affinityWorker(task, thread_idx);
+        if (thread_idx >= 0 && (target < 0 || target == thread_idx))
+        {
+            // Workers keep what they spawn; idle workers steal it if they run dry.
+            workers[thread_idx]->load.fetch_add(task.cost);
+            workers[thread_idx]->deques[task.priority].push(task);
+#ifdef OBFUSCATION_TRACE
+            traceEnqueue(task, thread_idx, PICK_OWN);
+#endif
+            wakeIdleWorker();
+            return;
+        }
+
+        // Tasks from outside the pool, and those affinity sends to another worker
+        // group, go to the chosen worker's inbox.
+        if (target < 0)
+            target = selectWorker(task);
+#ifdef OBFUSCATION_TRACE
+        TracePick pick = tracePick(target);
+#endif
+        workers[target]->load.fetch_add(task.cost);
+        workers[target]->inbox.push(task);
+#ifdef OBFUSCATION_TRACE
+        traceEnqueue(task, target, pick);
+#endif
+        if (!wakeWorker(target))
+            wakeIdleWorker();
+    }
+
+    // Submits a call whose caller waits for the result. Its task is queued ahead of
+    // fire-and-forget ones, and a caller that is itself awaited passes that on,
+    // so a chain of awaited calls runs at the top level (priority inheritance).
+    static void submitAwaitedTask(Task task)
+    {
+#ifdef OBFUSCATION_COROUTINES
+        task.priority = awaitedPriority(PRIORITY_DETACHED);  // awaiting frames go through CallAwaiter
+#else
+        task.priority = awaitedPriority(t_taskPriority);
+#endif
+        submitTask(task);
+    }
+
+    // The level of a task that a task at level `waiter` waits for.
+    static uint8_t awaitedPriority(int waiter)
+    {
+        if (!priorities)
+            return PRIORITY_DETACHED;
+        return waiter > PRIORITY_DETACHED ? PRIORITY_CRITICAL : PRIORITY_AWAITED;
+    }
+
+    // Submits a run of tasks at once. A worker pushes them all to its own deque and
+    // wakes at most one parked worker per task; other threads spread them over the
+    // inboxes and wake each target worker once.
+    static void submitTasks(const Task *tasks, int count)
+    {
+        if (count <= 0)
+            return;
+        countSubmitted(count);
+#ifndef OBFUSCATION_COROUTINES
+        if (t_currentGroup)
+            t_currentGroup->pending.fetch_add(count, memory_order_relaxed);
+#endif
+#ifdef OBFUSCATION_PROFILE
+        uint64_t submitTicks = cycleClock();
+#endif
+
+        int thread_idx = current_worker;
+        vector<int> targets;
+        if (thread_idx >= 0)
+        {
+            int cost = 0;
+            int kept = 0;  // tasks pushed on this worker's own deques
+            for (int i = 0; i < count; i++)
+            {
+                Task task = tasks[i];
+#ifdef OBFUSCATION_PROFILE
+                task.submitTicks = submitTicks;
+#endif
+#ifndef OBFUSCATION_COROUTINES
+                task.depth = t_spawnDepth + 1;
+                task.group = t_currentGroup;
+#endif
+                if (adaptiveLoad)
+                    task.cost = adaptiveCost(task);
+                int target = affinityWorker(task, thread_idx);
+                if (target >= 0 && target != thread_idx)
+                {
+                    sendToInbox(task, target, targets);
+                    continue;
+                }
+                cost += task.cost;
+                kept++;
+                workers[thread_idx]->deques[task.priority].push(task);
+#ifdef OBFUSCATION_TRACE
+                traceEnqueue(task, thread_idx, PICK_OWN);
+#endif
+            }
+            workers[thread_idx]->load.fetch_add(cost);
+            // Inbox targets are woken once each; the tasks kept here wake at most
+            // one parked worker apiece to steal them.
+            if (!targets.empty())
+                wakeTargets(targets);
+            for (int i = 0; i < kept && wakeIdleWorker(); i++)
+                ;
+            return;
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            Task task = tasks[i];
+#ifdef OBFUSCATION_PROFILE
+            task.submitTicks = submitTicks;
+#endif
+#ifndef OBFUSCATION_COROUTINES
+            task.depth = t_spawnDepth + 1;
+            task.group = t_currentGroup;
+#endif
+            if (adaptiveLoad)
+                task.cost = adaptiveCost(task);
+            int target = affinityWorker(task, -1);
+            sendToInbox(task, target >= 0 ? target : selectWorker(task), targets);
+        }
+        wakeTargets(targets);
+    }
+
+    static bool wakeWorker(int thread_idx)
+    {
+        atomic_thread_fence(memory_order_seq_cst);
+        if (!workers[thread_idx]->sleeping.exchange(false))
+            return false;
+
+        lock_guard<mutex> parkLock(workers[thread_idx]->parkMutex);
+        workers[thread_idx]->parkCondition.notify_one();
+        return true;
+    }
+
+    static bool wakeIdleWorker()
+    {
+        atomic_thread_fence(memory_order_seq_cst);
+        if (idleWorkers.load() == 0)
+            return false;
+
+        for (int i = 0; i < workerCount(); i++)
+        {
+            if (workers[i]->sleeping.load() && workers[i]->sleeping.exchange(false))
+            {
+                lock_guard<mutex> parkLock(workers[i]->parkMutex);
+                workers[i]->parkCondition.notify_one();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // True when every worker has at least inlineQueueDepth tasks queued (0 disables the check).
+    static bool allQueuesDeep()
+    {
+        if (inlineQueueDepth <= 0)
+            return false;
+        for (int i = 0; i < workerCount(); i++)
+        {
+            if (queuedTasks(i) < inlineQueueDepth)
+                return false;
+        }
+        return true;
+    }
+
+    // Granularity control: rewritten call sites run the callee on the calling worker
+    // instead of dispatching it when it is cheaper than the dispatch itself, or when
+    // every worker already has a deep queue and another task would only wait.
+    static bool runInline(int cost)
+    {
+        return cost < inlineCostThreshold || allQueuesDeep();
+    }
+
+    // The check at a function's call sites of itself: past spawnDepthLimit spawns
+    // (0 disables the cutoff), a recursion runs the rest of its call tree in place,
+    // since its upper levels have made enough tasks to keep every worker busy.
+    static bool runInlineRecursive(int cost)
+    {
+#ifndef OBFUSCATION_COROUTINES
+        if (spawnDepthLimit > 0 && t_spawnDepth >= spawnDepthLimit)
+            return true;
+#endif
+        return runInline(cost);
+    }
+
+    static bool hasPendingTasks()
+    {
+        for (int i = 0; i < workerCount(); i++)
+        {
+            if (hasQueuedTasks(i) || !workers[i]->inbox.empty())
+                return true;
+        }
+        return false;
+    }
+
+    static int64_t queuedTasks(int worker)
+    {
+        int64_t count = 0;
+        for (Queue &queue : workers[worker]->deques)
+            count += queue.size();
+        return count;
+    }
+
+    static bool hasQueuedTasks(int worker)
+    {
+        for (Queue &queue : workers[worker]->deques)
+        {
+            if (!queue.empty())
+                return true;
+        }
+        return false;
+    }
+
+    // The owner's next task: the newest of its highest non-empty level. Levels above
+    // the lowest are usually empty, and are checked without the pop's fence.
+    static bool popTask(int thread_idx, Task &task)
+    {
+        Queue *deques = workers[thread_idx]->deques;
+        for (int level = TASK_PRIORITIES - 1; level > 0; level--)
+        {
+            if (!deques[level].empty() && deques[level].pop(task))
+                return true;
+        }
+        return deques[0].pop(task);
+    }
+
+    static int adoptInbox(int owner, int thread_idx)
+    {
+        return workers[owner]->inbox.takeAll([&](const Task &task)
+                                             {
+                                                 if (owner != thread_idx)
+                                                 {
+                                                     workers[owner]->load.fetch_sub(task.cost);
+                                                     workers[thread_idx]->load.fetch_add(task.cost);
+                                                 }
+                                                 workers[thread_idx]->deques[task.priority].push(task);
+                                             });
+    }
+
+    static bool stealTask(int thread_idx, Task &task)
+    {
+        // With call-graph affinity, thieves start with the rest of their own group.
+        int start = fastRandom() % workerCount();
+        if constexpr (Config::AFFINITY_GROUPS > 1)
+        {
+            if (affinityGroupCount() > 1)
+            {
+                int group = affinityGroupOf(thread_idx);
+                int first = affinityGroupStart(group);
+                start = first + fastRandom() % (affinityGroupStart(group + 1) - first);
+            }
+        }
+        // One pass over the victims per level, highest first; inboxes are adopted in the first.
+        int levels = priorities ? (int)TASK_PRIORITIES : 1;
+        for (int level = levels - 1; level >= 0; level--)
+        {
+            for (int i = 0; i < workerCount(); i++)
+            {
+                int victim = (start + i) % workerCount();
+                if (victim == thread_idx)
+                    continue;
+
+                if (level == levels - 1 && adoptInbox(victim, thread_idx) > 0 && popTask(thread_idx, task))
+                    return true;
+
+                Queue &queue = workers[victim]->deques[level];
+                if ((level == 0 || !queue.empty()) && queue.steal(task))
+                {
+                    workers[victim]->load.fetch_sub(task.cost);
+                    workers[thread_idx]->load.fetch_add(task.cost);
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    // Termination detection without a shared counter: every worker counts the tasks
+    // it submits and finishes on a line only it writes, and threads outside the pool
+    // share externalSubmitted. A task is counted as submitted before it is queued and
+    // as finished after it ran, so summing every finished count before any submitted
+    // count gives equal totals only if, at some instant between the two passes,
+    // nothing was in flight.
+    static void countSubmitted(int count)
+    {
+        int worker = current_worker;
+        if (worker >= 0)
+            workers[worker]->submitted.fetch_add(count);
+        else
+            externalSubmitted.fetch_add(count);
+    }
+
+    static void taskFinished(int thread_idx)
+    {
+        workers[thread_idx]->finished.fetch_add(1);
+    }
+
+    static bool quiescent()
+    {
+        uint64_t finished = 0;
+        for (int i = 0; i < workerCount(); i++)
+            finished += workers[i]->finished.load();
+        uint64_t submitted = externalSubmitted.load();
+        for (int i = 0; i < workerCount(); i++)
+            submitted += workers[i]->submitted.load();
+        return submitted == finished;
+    }
+
+    // Packs a call to Function into a task. If boxed arguments find their arena at
+    // its memory cap, the caller helps run tasks until a slot frees up.
+    template <auto Function>
+    static Task makeTask(int funcId, int cost, CallValues<Function> args)
+    {
+        using Values = CallValues<Function>;
+        Task task{funcId, cost, runCall<Function>};
+        if constexpr (travelsInline<Values>)
+            memcpy(task.payload, &args, sizeof(Values));
+        else
+        {
+            int index;
+            while ((index = paramArena<Values>.acquire()) < 0)
+            {
+                int worker = currentWorker();
+                if (worker < 0 || !execute(worker))
+                    this_thread::yield();
+            }
+            paramArena<Values>.construct(index, std::move(args));
+            memcpy(task.payload, &index, sizeof(index));
+        }
+        return task;
+    }
+
+    static bool execute(int thread_idx)
+    {
+        Task task;
+        if (!workers[thread_idx]->inbox.empty())
+            adoptInbox(thread_idx, thread_idx);
+
+        if (!popTask(thread_idx, task) && !stealTask(thread_idx, task))
+            return false;
+#ifdef OBFUSCATION_PROFILE
+        recordProfile(thread_idx, PROFILE_DISPATCH, cycleClock() - task.submitTicks);
+#endif
+#ifdef OBFUSCATION_TRACE
+        uint64_t traceStartNs = traceClock();
+        int traceDepth = (int)queuedTasks(thread_idx);
+#endif
+
+#ifdef OBFUSCATION_COROUTINES
+        // The frame finishes the task itself (see frameFinished), possibly later
+        // on another worker if it suspends on a callee.
+        adoptFrame(task.run(thread_idx, task), task.funcId, thread_idx, task.cost, task.priority, task.continuation).resume();
+#else
+        int parentDepth = t_spawnDepth;
+        int parentPriority = t_taskPriority;
+        TaskGroupState *parentGroup = t_currentGroup;
+        t_spawnDepth = task.depth;
+        t_taskPriority = task.priority;
+        t_currentGroup = task.group;
+        // A loop chunk's iterations are timed one by one (see runLoopRange).
+        runTimed(thread_idx, task.funcId, !task.loopChunk, [&]
+                 { task.run(thread_idx, task); });
+        t_spawnDepth = parentDepth;
+        t_taskPriority = parentPriority;
+        t_currentGroup = parentGroup;
+#endif
+#ifdef OBFUSCATION_TRACE
+        traceRecord(TRACE_TASK, traceStartNs, traceClock(), task.funcId, thread_idx, traceDepth);
+#endif
+
+#ifndef OBFUSCATION_COROUTINES
+        workers[thread_idx]->load.fetch_sub(task.cost);
+        taskFinished(thread_idx);
+        // The group's owner may return, ending the group, as soon as this lands.
+        if (task.group)
+            task.group->pending.fetch_sub(1, memory_order_release);
+#endif
+        return true;
+    }
+
+#ifndef OBFUSCATION_COROUTINES
+    // Runs a task's code, timed when profiling or load estimation wants it. Tasks
+    // run inside it while it waits are timed on their own, so only the rest is
+    // recorded as funcId's time (when `record` is set).
+    template <typename Code>
+    static void runTimed(int thread_idx, int funcId, bool record, Code code)
+    {
+        if (!PROFILE_BUILD && !adaptiveLoad)
+        {
+            code();
+            return;
+        }
+        uint64_t start = cycleClock();
+        uint64_t nestedBefore = t_nestedTicks;
+        code();
+        uint64_t elapsed = cycleClock() - start;
+        if (record)
+        {
+            uint64_t own = elapsed - (t_nestedTicks - nestedBefore);
+#ifdef OBFUSCATION_PROFILE
+            recordProfile(thread_idx, funcId, own);
+#endif
+            if (adaptiveLoad)
+                recordSample(thread_idx, funcId, own);
+        }
+        t_nestedTicks = nestedBefore + elapsed;
+    }
+
+    // One parallelFor call: its body, and how many of its iterations have not run
+    // yet. Lives on the caller's stack until that count reaches zero.
+    template <typename Body>
+    struct ParallelLoop
+    {
+        Body &body;
+        int funcId;
+        int cost;  // estimated cost of one iteration
+        long grain;
+        uint8_t priority;  // of its chunks: the loop's caller waits for them
+        atomic<long> remaining;
+    };
+
+    // The payload of a parallelFor chunk task: iterations [begin, end) of a loop.
+    struct LoopChunk
+    {
+        void *loop;
+        long begin;
+        long end;
+    };
+
+    template <typename Body>
+    static Task makeLoopChunk(ParallelLoop<Body> &loop, long begin, long end)
+    {
+        long long cost = min<long long>((long long)(end - begin) * max(loop.cost, 1), TASK_COST_CAP);
+        Task task{loop.funcId, (int)cost, runLoopChunk<Body>};
+        task.loopChunk = true;
+        task.priority = loop.priority;
+        LoopChunk chunk{&loop, begin, end};
+        memcpy(task.payload, &chunk, sizeof(chunk));
+        return task;
+    }
+
+    template <typename Body>
+    static void runLoopChunk(int thread_idx, Task &task)
+    {
+        LoopChunk chunk;
+        memcpy(&chunk, task.payload, sizeof(chunk));
+        runLoopRange(*static_cast<ParallelLoop<Body> *>(chunk.loop), thread_idx, chunk.begin, chunk.end);
+    }
+
+    // Lazy binary splitting: while the range holds more than a grain and this
+    // worker has nothing queued for thieves, the upper half becomes a task of its
+    // own; otherwise one grain runs here and the check repeats. Busy workers thus
+    // run their ranges without making tasks nobody would steal.
+    template <typename Body>
+    static void runLoopRange(ParallelLoop<Body> &loop, int thread_idx, long begin, long end)
+    {
+        while (begin < end)
+        {
+            if (end - begin > loop.grain && !hasQueuedTasks(thread_idx))
+            {
+                long middle = begin + (end - begin) / 2;
+                submitTask(makeLoopChunk(loop, middle, end));
+                end = middle;
+                continue;
+            }
+            long stop = min(end, begin + loop.grain);
+            // Each iteration is one call of funcId, whatever chunk it ran in.
+            for (long i = begin; i < stop; i++)
+                runTimed(thread_idx, loop.funcId, true, [&]
+                         { loop.body(thread_idx, i); });
+            // The loop may be gone once the last iterations are counted.
+            loop.remaining.fetch_sub(stop - begin, memory_order_release);
+            begin = stop;
+        }
+    }
+
+    // Runs body(thread_idx, i) for every i in [begin, end) across the pool and
+    // returns once all have run: the single join of a rewritten counted loop whose
+    // iterations each call funcId at `cost`. A grain holds the iterations that
+    // together reach the inline threshold, and the range is split into at most
+    // LOOP_CHUNKS_PER_WORKER grains per worker. Past the spawn depth cutoff the
+    // loop runs in place, like a recursive call would.
+    template <typename Body>
+    static void parallelFor(int funcId, long begin, long end, int cost, Body body)
+    {
+        if (begin >= end)
+            return;
+        int worker = currentWorker();
+        long count = end - begin;
+        long grain = max({1L, (long)(inlineCostThreshold / max(cost, 1)),
+                          count / ((long)workerCount() * LOOP_CHUNKS_PER_WORKER)});
+        if (worker >= 0 && spawnDepthLimit > 0 && t_spawnDepth >= spawnDepthLimit)
+            grain = count;
+        ParallelLoop<Body> loop{body, funcId, cost, grain, awaitedPriority(t_taskPriority), {count}};
+
+        if (worker >= 0)
+            runLoopRange(loop, worker, begin, end);
+        else
+            submitTask(makeLoopChunk(loop, begin, end));
+
+        uint64_t waitStart = traceWaitBegin();
+        while (loop.remaining.load(memory_order_acquire) > 0)
+        {
+            if (worker < 0 || !execute(worker))
+                this_thread::yield();
+        }
+        traceWaitEnd(funcId, waitStart);
+    }
+#endif
+
+#ifdef OBFUSCATION_COROUTINES
+    static coroutine_handle<> adoptFrame(ObfTask job, int funcId, int thread_idx, int cost, int priority, void *continuation)
+    {
+        ObfTask::promise_type &promise = job.handle.promise();
+        promise.continuation = coroutine_handle<>::from_address(continuation);
+        promise.finished = frameFinished;
+        promise.frame.worker = thread_idx;
+        promise.frame.cost = cost;
+        promise.frame.priority = priority;
+#ifdef OBFUSCATION_PROFILE
+        promise.frame.funcId = funcId;
+        promise.frame.profileStart = cycleClock();
+#else
+        (void)funcId;
+#endif
+        return job.handle;
+    }
+
+    // Runs once a frame adopted by this runtime has been destroyed.
+    static void frameFinished(const ObfTask::Frame &frame)
+    {
+#ifdef OBFUSCATION_PROFILE
+        recordProfile(frame.worker, frame.funcId, frame.profileTicks + cycleClock() - frame.profileStart);
+#endif
+        workers[frame.worker]->load.fetch_sub(frame.cost);
+        taskFinished(frame.worker);
+    }
+
+    // A fire-and-forget call that runInline() kept on this worker: run the frame now
+    // instead of queueing it. It still counts as in flight until it finishes.
+    static void resumeInline(ObfTask job, int funcId, int thread_idx)
+    {
+        countSubmitted(1);
+        adoptFrame(job, funcId, thread_idx, 0, PRIORITY_DETACHED, nullptr).resume();
+    }
+#endif
+
+    static void threadFunction(int thread_idx, int cpu)
+    {
+#ifdef __linux__
+        if (cpu >= 0)
+        {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(cpu, &cpus);
+            pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        }
+#else
+        (void)cpu;
+#endif
+
+        current_worker = thread_idx;
+        Worker *self = new Worker();
+        workers[thread_idx] = self;
+        loads[thread_idx] = &self->load;
+        workersReady++;
+        while (workersReady.load() < workerCount())
+            this_thread::yield();
+
+        while (!stopThreads.load())
+        {
+            if (execute(thread_idx))
+                continue;
+
+            // Keep polling for a while before parking, so bursts of small tasks do not
+            // pay a futex wake and a context switch each.
+            if (idle.wait([&]
+                          { return hasPendingTasks() && execute(thread_idx); },
+                          []
+                          { return stopThreads.load(); }))
+                continue;
+
+            unique_lock<mutex> parkLock(self->parkMutex);
+            self->sleeping.store(true);
+            idleWorkers++;
+            atomic_thread_fence(memory_order_seq_cst);
+
+            // Re-check after announcing ourselves so a concurrent push cannot be missed.
+            if (!hasPendingTasks() && !stopThreads.load())
+            {
+                self->parkCondition.wait(parkLock, [&]
+                                         { return !self->sleeping.load() || stopThreads.load(); });
+            }
+
+            self->sleeping.store(false);
+            idleWorkers--;
+        }
+    }
+};
+
+// Collects a run of consecutive fire-and-forget calls so they are submitted
+// together: one load update and at most one wake per worker instead of one each.
+template <typename Runtime>
+struct BasicTaskBatch
+{
+    Task tasks[TASK_BATCH_MAX];
+    int count = 0;
+
+    void add(const Task &task)
+    {
+        tasks[count++] = task;
+        if (count == TASK_BATCH_MAX)
+            submit();
+    }
+
+    void submit()
+    {
+        if (count > 0)
+            Runtime::submitTasks(tasks, count);
+        count = 0;
+    }
+};
+
+#ifndef OBFUSCATION_COROUTINES
+// A scope of tasks that can be waited for on its own, where exit() waits for
+// everything in flight. Tasks submitted on this thread while the group is open
+// belong to it, and so does everything they submit while they run. A group
+// opened inside one of those tasks nests: it is waited for before that task
+// ends, so its tasks end within the outer group's. Groups close in the order a
+// thread opened them, which their scope guarantees.
+template <typename Runtime>
+class BasicTaskGroup
+{
+public:
+    BasicTaskGroup() : parent(Runtime::t_currentGroup) { Runtime::t_currentGroup = &state; }
+
+    ~BasicTaskGroup()
+    {
+        wait();
+        Runtime::t_currentGroup = parent;
+    }
+
+    BasicTaskGroup(const BasicTaskGroup &) = delete;
+    BasicTaskGroup &operator=(const BasicTaskGroup &) = delete;
+
+    // Returns once every task of the group has finished. A worker runs other
+    // tasks meanwhile; any other thread yields.
+    void wait()
+    {
+        int worker = Runtime::currentWorker();
+        while (state.pending.load(memory_order_acquire) > 0)
+        {
+            if (worker < 0 || !Runtime::execute(worker))
+                this_thread::yield();
+        }
+    }
+
+private:
+    TaskGroupState state;
+    TaskGroupState *parent;
+};
+#endif
+
+#ifdef OBFUSCATION_COROUTINES
+// co_await'ed by a caller that needs a callee's result. The caller is suspended
+// instead of spinning, and evaluates to the worker it was resumed on so the
+// rewritten code can refresh its thread_idx. A callee that runInline() accepts
+// is started on this worker straight away and resumes the caller when done.
+template <typename Runtime>
+struct CallAwaiter
+{
+    Task task;
+    coroutine_handle<ObfTask::promise_type> caller;
+#ifdef OBFUSCATION_TRACE
+    uint64_t waitStart = 0;
+#endif
+
+    bool await_ready() noexcept { return false; }
+
+    coroutine_handle<> await_suspend(coroutine_handle<ObfTask::promise_type> self)
+    {
+        caller = self;
+        ObfTask::Frame &frame = self.promise().frame;
+#ifdef OBFUSCATION_PROFILE
+        frame.profileTicks += cycleClock() - frame.profileStart;
+#endif
+#ifdef OBFUSCATION_TRACE
+        waitStart = traceWaitBegin();
+#endif
+        // The callee inherits a higher priority if this caller is itself awaited.
+        task.priority = Runtime::awaitedPriority(frame.priority);
+        if (Runtime::runInline(task.cost))
+        {
+            Runtime::countSubmitted(1);
+            return Runtime::adoptFrame(task.run(frame.worker, task), task.funcId, frame.worker, 0, task.priority,
+                                       self.address());
+        }
+        // The callee may finish and resume us on another worker before this returns,
+        // so nothing in the frame may be touched after the push.
+        task.continuation = self.address();
+        Runtime::submitTask(task);
+        return noop_coroutine();
+    }
+
+    int await_resume()
+    {
+        ObfTask::Frame &frame = caller.promise().frame;
+#ifdef OBFUSCATION_PROFILE
+        frame.profileStart = cycleClock();
+#endif
+#ifdef OBFUSCATION_TRACE
+        traceWaitEnd(task.funcId, waitStart);
+#endif
+        int now = Runtime::currentWorker();
+        if (now != frame.worker)
+        {
+            Runtime::workers[frame.worker]->load.fetch_sub(frame.cost);
+            Runtime::workers[now]->load.fetch_add(frame.cost);
+            frame.worker = now;
+        }
+        return now;
+    }
+};
+#endif
+
+#endif
@@ -0,0 +1,276 @@
+"""
+Generates a synthetic C++ input program with a configurable call-graph shape:
+depth, fan-out, self-recursion, the mix of void and non-void functions, how
+often functions touch shared globals and how much work each call does.
+
+The program is plain sequential C++ in the style of Input/ and prints a result
+that does not depend on scheduling, so the original and the rewritten build can
+be checked against each other. It only uses constructs the Obfuscator rewrites
+correctly: every call is on its own line, and non-void functions return once,
+at the end of their body, since only top-level returns are rewritten.
+Self-recursion, which needs a guard, is therefore only generated for void
+functions, and main repeats the root through a void driver.
+
+Probes check that a deferred join still orders globals: a probed function calls
+a probe of its own, which sets a global, and reads that global right after the
+call, before it uses the probe's result. Every probe stores the same constant,
+so the value read only differs if the caller ran ahead of its callee. The caller
+then passes the global as an argument, to a check that counts wrong values and
+to the probe again, so arguments that read globals are rewritten as well.
+"""
+
+import argparse
+import os
+import random
+from dataclasses import dataclass, field, fields, replace
+
+
+@dataclass
+class Shape:
+    depth: int = 4  # levels of the call graph, the root included
+    fanout: int = 4  # calls from every non-leaf function into the next level
+    width: int = 8  # functions per level below the root
+    recursion_rate: float = 0.0  # share of void functions that also call themselves
+    recursion_depth: int = 3  # how deep self-recursive functions recurse
+    void_ratio: float = 0.5  # share of non-root functions that return nothing
+    global_rate: float = 0.2  # share of functions that update a shared global
+    globals: int = 4  # number of shared globals
+    work: int = 500  # loop iterations of local work per call
+    probe_rate: float = 0.0  # share of non-void functions that read a global their callee sets (see render_probe)
+    repeat: int = 20  # calls of the root, one after another
+    functions_per_file: int = 16
+    seed: int = 1
+
+
+PRESETS = {
+    # Many independent fire-and-forget calls: dispatch and batching throughput.
+    "wide": Shape(depth=3, fanout=24, width=24, void_ratio=0.8, work=2000, repeat=200),
+    # Long chains of calls waiting on results: join overhead.
+    "deep": Shape(depth=12, fanout=2, width=4, void_ratio=0.2, work=3000, repeat=20),
+    # Self-recursive functions on every level.
+    "recursive": Shape(depth=4, fanout=3, width=6, recursion_rate=0.8, recursion_depth=4, void_ratio=0.7, work=4000,
+                       repeat=400),
+    # Small functions hammering a few globals: synchronization cost.
+    "contended": Shape(depth=4, fanout=4, width=8, global_rate=1.0, globals=2, work=200, repeat=2000),
+    "mixed": Shape(depth=5, fanout=5, work=5000, repeat=100),
+    # Callers reading globals their awaited callees write: ordering of deferred joins.
+    "ordered": Shape(depth=4, fanout=3, width=6, void_ratio=0.3, probe_rate=1.0, work=2000, repeat=50),
+}
+
+
+@dataclass
+class Function:
+    name: str
+    level: int
+    returns: bool
+    recursive: bool = False
+    globals: list = field(default_factory=list)
+    callees: list = field(default_factory=list)
+    probe: int = -1  # index of the probe it calls, or -1
+
+
+def build_call_graph(shape):
+    """Returns the functions level by level; the single root is levels[0][0]."""
+    rng = random.Random(shape.seed)
+    levels = [[Function("f0_0", 0, True)]]
+    for level in range(1, shape.depth):
+        levels.append([Function(f"f{level}_{i}", level, rng.random() >= shape.void_ratio)
+                       for i in range(shape.width)])
+
+    for level, functions in enumerate(levels):
+        for func in functions:
+            if level + 1 < len(levels):
+                func.callees = [rng.choice(levels[level + 1]) for _ in range(shape.fanout)]
+            func.recursive = not func.returns and rng.random() < shape.recursion_rate
+            if shape.globals > 0 and rng.random() < shape.global_rate:
+                func.globals = [rng.randrange(shape.globals)]
+    probed = [func for functions in levels for func in functions if func.returns]
+    for func in probed:
+        if rng.random() < shape.probe_rate:
+            func.probe = sum(1 for other in probed if other.probe >= 0)
+    return levels
+
+
+def probes(levels):
+    return [func.probe for functions in levels for func in functions if func.probe >= 0]
+
+
+def render_probe(index, shape):
+    # Dispatched, as it does a call's worth of work, and sets its global at the end.
+    lines = [f"int probe_{index}(int n){{"]
+    lines.append(f"    unsigned acc = (unsigned)n + {index}u;")
+    lines.append(f"    for (int i = 0; i < {shape.work}; i++)")
+    lines.append("        acc = acc * 31u + (unsigned)i;")
+    lines.append(f"    p_{index} = {index + 1};")
+    lines.append("    return (int)(acc & 0xffffu);")
+    lines.append("}")
+    lines.append("")
+    # Called with the probe's global as its argument, which has to be read after the probe's store.
+    lines.append(f"void check_{index}(int v){{")
+    lines.append(f"    if (v != {index + 1})")
+    lines.append("    {")
+    lines.append("        g_mismatches += 1;")
+    lines.append("    }")
+    lines.append("}")
+    return "\n".join(lines) + "\n"
+
+
+def render_function(func, shape):
+    # Every call sits on its own line: the Obfuscator rewrites call sites line by line.
+    lines = [f"{'int' if func.returns else 'void'} {func.name}(int n){{"]
+    lines.append(f"    unsigned acc = (unsigned)n + {func.level * 131 + 7}u;")
+    lines.append(f"    for (int i = 0; i < {shape.work}; i++)")
+    lines.append("        acc = acc * 31u + (unsigned)i;")
+    for index in func.globals:
+        lines.append(f"    g_{index} += 1;")
+    # Results are only read once every callee has been called, so the rewritten
+    # program dispatches all of them before it joins the first.
+    for k, callee in enumerate(func.callees):
+        if callee.returns:
+            lines.append(f"    int r{k} = {callee.name}(n);")
+        else:
+            lines.append(f"    {callee.name}(n);")
+    if func.probe >= 0:
+        # The global is read before the result: the join has to come first all the same.
+        lines.append(f"    int q = probe_{func.probe}(n);")
+        lines.append(f"    acc += (unsigned)p_{func.probe};")
+        lines.append("    acc += (unsigned)q;")
+        lines.append(f"    check_{func.probe}(p_{func.probe});")
+        lines.append(f"    int s = probe_{func.probe}(p_{func.probe});")
+        lines.append("    acc += (unsigned)s;")
+    for k, callee in enumerate(func.callees):
+        if callee.returns:
+            lines.append(f"    acc += (unsigned)r{k};")
+    if func.recursive:
+        lines.append("    if (n > 0)")
+        lines.append("    {")
+        lines.append(f"        {func.name}(n - 1);")
+        lines.append("    }")
+    if func.returns:
+        lines.append("    return (int)(acc & 0xffffu);")
+    else:
+        lines.append("    volatile unsigned sink = acc;")
+        lines.append("    (void)sink;")
+    lines.append("}")
+    return "\n".join(lines) + "\n"
+
+
+def render_header(levels, shape):
+    lines = ["#ifndef WORKLOAD_H", "#define WORKLOAD_H", ""]
+    lines.append("extern int g_result;")
+    for index in range(shape.globals):
+        lines.append(f"extern int g_{index};")
+    if probes(levels):
+        lines.append("extern int g_mismatches;")
+    for index in probes(levels):
+        lines.append(f"extern int p_{index};")
+    lines.append("")
+    lines.append("void run(int n);")
+    for functions in levels:
+        for func in functions:
+            lines.append(f"{'int' if func.returns else 'void'} {func.name}(int n);")
+    for index in probes(levels):
+        lines.append(f"int probe_{index}(int n);")
+        lines.append(f"void check_{index}(int v);")
+    lines += ["", "#endif"]
+    return "\n".join(lines) + "\n"
+
+
+def render_main(levels, shape):
+    root = levels[0][0]
+    lines = ["#include <cstdlib>", "#include <iostream>", '#include "workload.h"', "", "using namespace std;", ""]
+    lines.append("int g_result = 0;")
+    for index in range(shape.globals):
+        lines.append(f"int g_{index} = 0;")
+    if probes(levels):
+        lines.append("int g_mismatches = 0;")
+    for index in probes(levels):
+        lines.append(f"int p_{index} = 0;")
+    lines.append("")
+    # Runs the root n times, each run after the previous one has returned.
+    lines.append("void run(int n){")
+    lines.append(f"    int r = {root.name}({shape.recursion_depth});")
+    lines.append("    g_result += r;")
+    lines.append("    if (n > 1)")
+    lines.append("    {")
+    lines.append("        run(n - 1);")
+    lines.append("    }")
+    lines.append("}")
+    lines.append("")
+    lines.append("int main(){")
+    # Fire-and-forget calls may still be running when main returns; the totals
+    # are printed once the runtime has drained them.
+    lines.append("    atexit([] {")
+    lines.append("        long total = 0;")
+    for index in range(shape.globals):
+        lines.append(f"        total += g_{index};")
+    if probes(levels):
+        lines.append('        cout << "mismatches " << g_mismatches << endl;')
+    lines.append('        cout << "result " << g_result << " globals " << total << endl;')
+    lines.append("    });")
+    lines.append(f"    run({shape.repeat});")
+    lines.append("    return 0;")
+    lines.append("}")
+    return "\n".join(lines) + "\n"
+
+
+def call_count(levels, shape):
+    """Calls the program makes, run() included, for reporting call throughput."""
+    memo = {}
+
+    def calls(func, n):
+        key = (func.name, n)
+        if key not in memo:
+            total = 1 + sum(calls(callee, n) for callee in func.callees) + 3 * (func.probe >= 0)
+            if func.recursive and n > 0:
+                total += calls(func, n - 1)
+            memo[key] = total
+        return memo[key]
+
+    return shape.repeat * (1 + calls(levels[0][0], shape.recursion_depth))
+
+
+def generate(shape, out_dir):
+    """Writes the program to out_dir and returns the number of calls it makes."""
+    levels = build_call_graph(shape)
+    os.makedirs(out_dir, exist_ok=True)
+    with open(os.path.join(out_dir, "workload.h"), "w", encoding="utf-8") as file:
+        file.write(render_header(levels, shape))
+    with open(os.path.join(out_dir, "main.cpp"), "w", encoding="utf-8") as file:
+        file.write(render_main(levels, shape))
+
+    functions = [func for level in levels for func in level]
+    per_file = max(1, shape.functions_per_file)
+    for start in range(0, len(functions), per_file):
+        with open(os.path.join(out_dir, f"calls_{start // per_file}.cpp"), "w", encoding="utf-8") as file:
+            file.write('#include "workload.h"\n\n')
+            file.write("\n".join(render_function(func, shape) for func in functions[start:start + per_file]))
+    if probes(levels):
+        with open(os.path.join(out_dir, "probes.cpp"), "w", encoding="utf-8") as file:
+            file.write('#include "workload.h"\n\n')
+            file.write("\n".join(render_probe(index, shape) for index in probes(levels)))
+    return call_count(levels, shape)
+
+
+def add_shape_arguments(parser):
+    """Adds one option per Shape field; options left out keep the preset's value."""
+    for option in fields(Shape):
+        parser.add_argument(f"--{option.name.replace('_', '-')}", type=type(option.default), default=None)
+
+
+def shape_from_arguments(args, preset):
+    shape = PRESETS[preset]
+    overrides = {option.name: getattr(args, option.name) for option in fields(Shape)
+                 if getattr(args, option.name) is not None}
+    return replace(shape, **overrides)
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("--preset", choices=sorted(PRESETS), default="mixed", help="starting shape")
+    add_shape_arguments(parser)
+    parser.add_argument("--out", required=True, help="directory to write the program to")
+    args = parser.parse_args()
+    shape = shape_from_arguments(args, args.preset)
+    calls = generate(shape, args.out)
+    print(f"{args.out}: {shape}, {calls} calls")
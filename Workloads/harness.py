@@ -0,0 +1,191 @@
+"""
+End-to-end benchmark: generates each workload, builds it as-is and after the
+full pipeline (Estimation, Obfuscator, generated runtime), runs both and
+reports wall time, CPU time, call and task throughput, dispatch latency and
+peak RSS. Everything runs offline; Estimation uses its static cost model.
+
+Dispatch latency and the number of dispatched tasks come from a second,
+-DOBFUSCATION_PROFILE build of the rewritten program, so the timed build
+carries no instrumentation.
+"""
+
+import argparse
+import os
+import shutil
+import statistics
+import subprocess
+import sys
+import time
+
+import generate
+
+REPO_ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+ESTIMATION_DIR = os.path.join(REPO_ROOT, "Estimation")
+OBFUSCATOR_DIR = os.path.join(REPO_ROOT, "Obfuscator")
+CXXFLAGS = ["-std=c++17", "-O2", "-pthread"]
+
+
+class ConsoleColors:
+    HEADER = '\033[95m'
+    OKCYAN = '\033[96m'
+    FAIL = '\033[91m'
+    ENDC = '\033[0m'
+
+
+def step(message):
+    print(f"{ConsoleColors.OKCYAN}{message}{ConsoleColors.ENDC}", flush=True)
+
+
+def check_call(command, cwd=None, env=None):
+    """Runs a build step, showing its output only if it fails."""
+    result = subprocess.run(command, cwd=cwd, env=env, stdout=subprocess.PIPE, stderr=subprocess.STDOUT, text=True)
+    if result.returncode != 0:
+        print(result.stdout)
+        raise RuntimeError(f"{' '.join(command)} failed with exit code {result.returncode}")
+
+
+def compile_program(cxx, source_dir, binary, extra_flags=()):
+    sources = sorted(os.path.join(source_dir, name) for name in os.listdir(source_dir) if name.endswith(".cpp"))
+    check_call([cxx, *CXXFLAGS, *extra_flags, "-I", source_dir, *sources, "-o", binary])
+
+
+def build_obfuscator(tool_dir):
+    """Builds a private copy of the Obfuscator around the cpp_functions.h Estimation wrote to tool_dir."""
+    for name in ("CMakeLists.txt", "obfuscator.cpp"):
+        shutil.copy(os.path.join(OBFUSCATOR_DIR, name), tool_dir)
+    build_dir = os.path.join(tool_dir, "build")
+    check_call(["cmake", "-S", tool_dir, "-B", build_dir, "-DCMAKE_BUILD_TYPE=Release"])
+    check_call(["cmake", "--build", build_dir, "-j", str(os.cpu_count() or 1)])
+    return os.path.join(build_dir, "Obfuscator")
+
+
+def run_once(binary, env):
+    """Runs binary once; returns (wall s, CPU s, peak RSS KiB, stdout)."""
+    start = time.perf_counter()
+    process = subprocess.Popen([binary], env=env, stdout=subprocess.PIPE, stderr=subprocess.DEVNULL, text=True)
+    output = process.stdout.read()
+    _, status, usage = os.wait4(process.pid, 0)
+    wall = time.perf_counter() - start
+    process.returncode = os.waitstatus_to_exitcode(status)
+    if process.returncode != 0:
+        raise RuntimeError(f"{binary} exited with code {process.returncode}")
+    return wall, usage.ru_utime + usage.ru_stime, usage.ru_maxrss, output
+
+
+def measure(binary, runs, env):
+    samples = [run_once(binary, env) for _ in range(runs)]
+    outputs = {sample[3] for sample in samples}
+    return {
+        "wall": statistics.median(sample[0] for sample in samples),
+        "cpu": statistics.median(sample[1] for sample in samples),
+        "rss": max(sample[2] for sample in samples),
+        "output": outputs.pop() if len(outputs) == 1 else None,  # None: runs disagreed
+    }
+
+
+def histogram_percentile(histogram, fraction):
+    """Upper bound, in ticks, of the log2 bucket holding the given fraction of samples."""
+    total = sum(histogram)
+    seen = 0
+    for bucket, count in enumerate(histogram):
+        seen += count
+        if total and seen >= fraction * total:
+            return float(2 << bucket)
+    return 0.0
+
+
+def read_dispatch_profile(path):
+    """Returns (dispatched tasks, p50 us, p99 us) from the @dispatch line of a runtime profile."""
+    ticks_per_ns = 1.0
+    with open(path, "r", encoding="utf-8") as file:
+        for line in file:
+            fields = line.split()
+            if fields[0] == "ticks_per_ns":
+                ticks_per_ns = float(fields[1]) or 1.0
+            elif fields[0] == "@dispatch":
+                histogram = [int(count) for count in fields[3:]]
+                to_us = 1.0 / ticks_per_ns / 1000.0
+                return (int(fields[1]), histogram_percentile(histogram, 0.5) * to_us,
+                        histogram_percentile(histogram, 0.99) * to_us)
+    return 0, 0.0, 0.0
+
+
+def run_workload(name, shape, args):
+    work_dir = os.path.join(os.path.abspath(args.work_dir), name)
+    source_dir = os.path.join(work_dir, "src")
+    tool_dir = os.path.join(work_dir, "tool")
+    output_dir = os.path.join(work_dir, "out")
+    shutil.rmtree(work_dir, ignore_errors=True)
+    os.makedirs(tool_dir)
+
+    step(f"[{name}] generating {shape}")
+    calls = generate.generate(shape, source_dir)
+
+    step(f"[{name}] building the original program")
+    baseline = os.path.join(work_dir, "baseline")
+    compile_program(args.cxx, source_dir, baseline)
+
+    step(f"[{name}] estimating costs and generating the runtime")
+    env = dict(os.environ, ESTIMATION_SOURCE=source_dir, ESTIMATION_TABLE_DIR=tool_dir,
+               ESTIMATION_MODEL=os.environ.get("ESTIMATION_MODEL", "static"))
+    check_call([sys.executable, "main.py"], cwd=ESTIMATION_DIR, env=env)
+
+    step(f"[{name}] building the Obfuscator and rewriting")
+    obfuscator = build_obfuscator(tool_dir)
+    check_call([obfuscator, source_dir + os.sep, "-o", output_dir + os.sep], cwd=tool_dir)
+
+    step(f"[{name}] building the rewritten program")
+    rewritten = os.path.join(work_dir, "obfuscated")
+    profiled = os.path.join(work_dir, "obfuscated_profile")
+    compile_program(args.cxx, output_dir, rewritten)
+    compile_program(args.cxx, output_dir, profiled, ["-DOBFUSCATION_PROFILE"])
+
+    step(f"[{name}] running {args.runs} time(s) each")
+    run_env = dict(os.environ)
+    if args.threads:
+        run_env["OBFUSCATION_THREADS"] = str(args.threads)
+    before = measure(baseline, args.runs, run_env)
+    after = measure(rewritten, args.runs, run_env)
+    profile_path = os.path.join(work_dir, "obfuscation.profile")
+    run_once(profiled, dict(run_env, OBFUSCATION_PROFILE_FILE=profile_path))
+    tasks, p50, p99 = read_dispatch_profile(profile_path)
+
+    if before["output"] is None or after["output"] != before["output"]:
+        print(f"{ConsoleColors.FAIL}[{name}] output mismatch: {before['output']!r} vs {after['output']!r}{ConsoleColors.ENDC}")
+    return {
+        "name": name, "calls": calls, "before": before, "after": after, "tasks": tasks, "p50": p50, "p99": p99,
+        "match": before["output"] is not None and after["output"] == before["output"],
+    }
+
+
+def print_report(results):
+    header = (f"{'workload':<12} {'build':<10} {'wall s':>8} {'cpu s':>8} {'Mcall/s':>8} {'Mtask/s':>8} "
+              f"{'p50 us':>8} {'p99 us':>8} {'RSS MiB':>8} {'speedup':>8} {'output':>7}")
+    print(f"{ConsoleColors.HEADER}{header}{ConsoleColors.ENDC}")
+    for result in results:
+        before, after = result["before"], result["after"]
+        print(f"{result['name']:<12} {'original':<10} {before['wall']:>8.3f} {before['cpu']:>8.3f} "
+              f"{result['calls'] / before['wall'] / 1e6:>8.2f} {'-':>8} {'-':>8} {'-':>8} "
+              f"{before['rss'] / 1024:>8.1f} {1.0:>7.2f}x {'':>7}")
+        print(f"{'':<12} {'rewritten':<10} {after['wall']:>8.3f} {after['cpu']:>8.3f} "
+              f"{result['calls'] / after['wall'] / 1e6:>8.2f} {result['tasks'] / after['wall'] / 1e6:>8.2f} "
+              f"{result['p50']:>8.2f} {result['p99']:>8.2f} {after['rss'] / 1024:>8.1f} "
+              f"{before['wall'] / after['wall']:>7.2f}x {'ok' if result['match'] else 'DIFF':>7}")
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("--preset", nargs="+", choices=sorted(generate.PRESETS), default=sorted(generate.PRESETS),
+                        help="workloads to run (default: all presets)")
+    generate.add_shape_arguments(parser)
+    parser.add_argument("--runs", type=int, default=5, help="timed runs per build; the median is reported")
+    parser.add_argument("--threads", type=int, default=0, help="OBFUSCATION_THREADS for the rewritten program")
+    parser.add_argument("--cxx", default=os.environ.get("CXX", "g++"))
+    parser.add_argument("--work-dir", default="build")
+    args = parser.parse_args()
+
+    results = []
+    for preset in args.preset:
+        results.append(run_workload(preset, generate.shape_from_arguments(args, preset), args))
+    print_report(results)
+    sys.exit(0 if all(result["match"] for result in results) else 1)